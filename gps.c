@@ -1,13 +1,31 @@
 #include <errno.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <pthread.h>
 #include <termios.h>
 #include <fcntl.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <poll.h>
 #include <math.h>
 #include <time.h>
 #include <signal.h>
 #include <unistd.h>
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
 #define  LOG_TAG  "gps_serial"
 
 #include <cutils/log.h>
@@ -15,24 +33,45 @@
 #include <cutils/properties.h>
 #include <hardware/gps.h>
 
-#if (12 <= __ANDROID_API__) || defined(_BSD_SOURCE) || defined(_SVID_SOURCE) || defined(_DEFAULT_SOURCE)
-    #define _USE_TIMEGM
-#endif
+#include "gps_serial.h"
 
 /* this is the state of our connection to the qemu_gpsd daemon */
 typedef struct {
     int                     init;
-    int                     fd;
+    int                     fd;             // opened by the GPS thread
+    char                    device[256];
     GpsCallbacks            *callbacks;
     GpsStatus               status;
     pthread_t               thread;
     int                     control[2];
+    uint32_t                fix_interval;   // min_interval of set_position_mode (ms)
+    uint32_t                fix_ttff;       // preferred_time of set_position_mode (ms)
+    uint32_t                batch_flags;    // options of the last batching start()
+    uint32_t                batch_interval;
+    uint32_t                batch_period;
+    int64_t                 aid_time;       // UTC (ms) of the last inject_time()
+    int64_t                 aid_time_ref;   // CLOCK_BOOTTIME (ms) at which aid_time was right
+    uint32_t                aid_time_acc;   // ms
+    int32_t                 aid_lat;        // 1e-7 degrees, of the last inject_location()
+    int32_t                 aid_lon;
+    uint32_t                aid_pos_acc;    // cm
+    uint32_t                aid_delete;     // GPS_DELETE_* flags not handled yet
 } GpsState;
 
 static GpsState       _gps_state[1];
-static int            id_in_fixed[12];
 static unsigned short period_in_ms;
 static long           time_sync;
+static int            ubx_mode;
+static int            epoch_end;
+static int            nmea_boottime;
+static float          sv_snr_tolerance;
+static int            sv_refresh_ms;
+static unsigned       rate_tier_ms[3];  /* GPS_RATE_* measurement periods (ms), 0 if fixed */
+static int            nmea_filter;
+static unsigned char  sv_divisor;
+static int            aiding;
+static char           dbd_path[PROPERTY_VALUE_MAX];
+static int            dbd_period_ms;
 
 //#define  GPS_DEBUG  1
 
@@ -46,8 +85,34 @@ static long           time_sync;
 
 #define GPS_DEV_SLOW_UPDATE_RATE (10)
 #define GPS_DEV_HIGH_UPDATE_RATE (1)
-
-static void gps_dev_set_meas_rate(int fd, unsigned short period_ms);
+#define GPS_DEV_MAX_MEAS_PERIOD  (1000)  /* ms, when solutions are spread over several measurements */
+#define GPS_DEV_MAX_NAV_RATE     (127)   /* measurements per navigation solution */
+
+#define GPS_DEV_TX_ACK_TIMEOUT   (1000)  /* ms for the receiver to answer a CFG message */
+#define GPS_DEV_DBD_QUIT         (2000)  /* ms to wait for the navigation database at cleanup */
+#define GPS_EPOCH_IDLE_MS        (50)    /* ms of silence after which an epoch is complete */
+#define GPS_DEV_OPEN_RETRY       (1000)  /* ms before opening a missing device again, */
+#define GPS_DEV_OPEN_RETRY_MAX   (60000) /* doubled after each failure up to this */
+
+static void gps_dev_set_meas_rate(int fd, unsigned short period_ms, unsigned short nav_rate);
+static void gps_dev_tx_ack(unsigned char cls, unsigned char id, int ack, int64_t now);
+static int gps_dev_tx_check(int64_t now);
+static int gps_dev_tx_drain(int64_t now);
+static void gps_dev_tx_reset(void);
+static void gps_dev_set_output(int fd);
+static void gps_dev_aid_time(int fd, int64_t utc_ms, uint32_t acc_ms);
+static void gps_dev_aid_pos(int fd, int32_t lat, int32_t lon, uint32_t acc_cm);
+static void gps_dev_mga(unsigned char id, const unsigned char *payload, int len, int64_t now);
+static void gps_dev_dbd_load(void);
+static int gps_dev_dbd_poll(int fd, int64_t now);
+static int gps_dev_dbd_step(int fd, int64_t now, int active);
+static int gps_dev_dbd_quit(int fd, int64_t now);
+static int gps_dev_dbd_busy(void);
+static void gps_dev_dbd_reset(void);
+static void gps_dev_delete_aiding(int fd, uint32_t flags);
+static int gps_dev_baud_supported(unsigned long baud);
+static int gps_dev_set_baud(int fd, unsigned long baud);
+static unsigned long gps_dev_negotiate_baud(int fd, unsigned long baud, unsigned long target);
 
 /*****************************************************************/
 /*****************************************************************/
@@ -58,6 +123,7 @@ static void gps_dev_set_meas_rate(int fd, unsigned short period_ms);
 /*****************************************************************/
 
 #define  MAX_NMEA_TOKENS  32
+#define  NMEA_MAX_SIZE    255
 
 typedef struct {
     const char*  p;
@@ -67,15 +133,46 @@ typedef struct {
 
 typedef struct {
     int     count;
+    int     limit;
     Token   tokens[ MAX_NMEA_TOKENS ];
 } NmeaTokenizer;
 
 
+static __inline__ void
+nmea_tokenizer_add( NmeaTokenizer*  t, const char*  comma )
+{
+    if (t->count < t->limit) {
+        t->tokens[t->count].end = comma;
+        t->count += 1;
+        if (t->count < t->limit)
+            t->tokens[t->count].p = comma + 1;
+    }
+}
+
+
+static int
+hex2int( int  c )
+{
+    if ((unsigned)(c - '0') < 10)
+        return c - '0';
+    if ((unsigned)(c - 'A') < 6)
+        return c - 'A' + 10;
+    if ((unsigned)(c - 'a') < 6)
+        return c - 'a' + 10;
+    return -1;
+}
+
+
+/* split the sentence into comma-separated tokens and verify its checksum,
+ * both in a single pass over the data. only the first 'limit' tokens are
+ * recorded. returns the number of tokens, or -1 if the sentence carries a
+ * '*XX' checksum that does not match.
+ */
 static int
-nmea_tokenizer_init( NmeaTokenizer*  t, const char*  p, const char*  end )
+nmea_tokenizer_init( NmeaTokenizer*  t, const char*  p, const char*  end, int  limit )
 {
-    int count = 0;
-    //char* q;
+    unsigned  csum = 0;
+    int       expected = -1;
 
     // the initial '$' is optional
     if (p < end && p[0] == '$')
@@ -88,31 +185,101 @@ nmea_tokenizer_init( NmeaTokenizer*  t, const char*  p, const char*  end )
             end -= 1;
     }
 
-    // get rid of checksum at the end of the sentence
+    // get the checksum at the end of the sentence
     if (end >= p+3 && end[-3] == '*') {
+        int  hi = hex2int(end[-2]);
+        int  lo = hex2int(end[-1]);
+
+        if ((hi|lo) < 0)
+            return -1;
+
+        expected = (hi << 4) | lo;
         end -= 3;
     }
 
-    while (p < end) {
-        const char*  q = p;
+    if (limit > MAX_NMEA_TOKENS)
+        limit = MAX_NMEA_TOKENS;
+
+    t->count = 0;
+    t->limit = limit;
+    if (p >= end)
+        return 0;
+
+    t->tokens[0].p = p;
+
+#if defined(__SSE2__)
+    {
+        const __m128i  comma = _mm_set1_epi8(',');
+        __m128i        acc   = _mm_setzero_si128();
 
-        q = memchr(p, ',', end-p);
-        if (q == NULL)
-            q = end;
+        for ( ; p + 16 <= end; p += 16) {
+            __m128i   v    = _mm_loadu_si128((const __m128i*) p);
+            unsigned  mask = (unsigned) _mm_movemask_epi8(_mm_cmpeq_epi8(v, comma));
 
-        if (count < MAX_NMEA_TOKENS) {
-            t->tokens[count].p = p;
-            t->tokens[count].end = q;
-            count += 1;
+            acc = _mm_xor_si128(acc, v);
+            while (mask) {
+                nmea_tokenizer_add(t, p + __builtin_ctz(mask));
+                mask &= mask - 1;
+            }
         }
-        if (q < end)
-            q += 1;
+        acc  = _mm_xor_si128(acc, _mm_srli_si128(acc, 8));
+        acc  = _mm_xor_si128(acc, _mm_srli_si128(acc, 4));
+        acc  = _mm_xor_si128(acc, _mm_srli_si128(acc, 2));
+        acc  = _mm_xor_si128(acc, _mm_srli_si128(acc, 1));
+        csum = (unsigned) _mm_cvtsi128_si32(acc) & 0xff;
+    }
+#elif defined(__ARM_NEON)
+    {
+        static const uint8_t  bits[16] = { 1, 2, 4, 8, 16, 32, 64, 128,
+                                           1, 2, 4, 8, 16, 32, 64, 128 };
+        const uint8x16_t  comma = vdupq_n_u8(',');
+        const uint8x16_t  bit   = vld1q_u8(bits);
+        uint8x16_t        acc   = vdupq_n_u8(0);
+        uint8x8_t         x;
+
+        for ( ; p + 16 <= end; p += 16) {
+            uint8x16_t  v  = vld1q_u8((const uint8_t*) p);
+            uint8x16_t  m  = vandq_u8(vceqq_u8(v, comma), bit);
+            uint8x8_t   lo = vget_low_u8(m);
+            uint8x8_t   hi = vget_high_u8(m);
+            unsigned    mask;
+
+            acc = veorq_u8(acc, v);
+
+            // gather one bit per lane, like SSE2's movemask
+            lo = vpadd_u8(lo, hi);
+            lo = vpadd_u8(lo, lo);
+            lo = vpadd_u8(lo, lo);
+            mask = vget_lane_u8(lo, 0) | (vget_lane_u8(lo, 1) << 8);
+
+            while (mask) {
+                nmea_tokenizer_add(t, p + __builtin_ctz(mask));
+                mask &= mask - 1;
+            }
+        }
+        x    = veor_u8(vget_low_u8(acc), vget_high_u8(acc));
+        x    = veor_u8(x, vext_u8(x, x, 4));
+        x    = veor_u8(x, vext_u8(x, x, 2));
+        x    = veor_u8(x, vext_u8(x, x, 1));
+        csum = vget_lane_u8(x, 0);
+    }
+#endif
+
+    for ( ; p < end; p++) {
+        csum ^= (unsigned char) *p;
+        if (*p == ',')
+            nmea_tokenizer_add(t, p);
+    }
 
-        p = q;
+    if (t->count < t->limit) {
+        t->tokens[t->count].end = end;
+        t->count += 1;
     }
 
-    t->count = count;
-    return count;
+    if (expected >= 0 && (int) csum != expected)
+        return -1;
+
+    return t->count;
 }
 
 
@@ -155,579 +322,731 @@ Fail:
 }
 
 
-static double
-str2float( const char*  p, const char*  end )
-{
-    size_t len = end - p;
-    char   temp[16];
+/* NMEA decimal fields are parsed without copies or strtod() into a
+ * fixed-point value: mant / 10^scale. only the leading significant
+ * digits that fit into the mantissa are kept, and at most
+ * FIXED_MAX_DIGITS fraction digits: extra fraction digits are truncated.
+ */
+#define  FIXED_MAX_DIGITS  18
 
-    if (len >= sizeof(temp))
-        return 0.;
+typedef struct {
+    int64_t  mant;
+    int      scale;
+} NmeaFixed;
+
+static const int64_t  pow10_table[ FIXED_MAX_DIGITS+1 ] = {
+    1LL, 10LL, 100LL, 1000LL, 10000LL, 100000LL, 1000000LL, 10000000LL,
+    100000000LL, 1000000000LL, 10000000000LL, 100000000000LL,
+    1000000000000LL, 10000000000000LL, 100000000000000LL,
+    1000000000000000LL, 10000000000000000LL, 100000000000000000LL,
+    1000000000000000000LL
+};
 
-    memcpy( temp, p, len );
-    temp[len] = '\0';
-    return strtod( temp, NULL );
-}
 
+static int
+str2fixed( const char*  p, const char*  end, NmeaFixed*  f )
+{
+    int64_t  mant   = 0;
+    int      scale  = 0;
+    int      digits = 0;
+    int      neg    = 0;
+    int      dot    = 0;
+
+    if (p < end && (*p == '-' || *p == '+')) {
+        neg = (*p == '-');
+        p  += 1;
+    }
+    if (p >= end)
+        return -1;
 
-/*****************************************************************/
-/*****************************************************************/
-/*****                                                       *****/
-/*****       N M E A   P A R S E R                           *****/
-/*****                                                       *****/
-/*****************************************************************/
-/*****************************************************************/
+    for ( ; p < end; p++) {
+        int  c = *p - '0';
 
-#define  NMEA_MAX_SIZE  255
+        if ((unsigned)c >= 10) {
+            if (*p == '.' && !dot) {
+                dot = 1;
+                continue;
+            }
+            return -1;
+        }
 
-typedef struct {
-    int     pos;
-    int     overflow;
-    int     utc_year;
-    int     utc_mon;
-    int     utc_day;
-    //time_t  utc_diff;
-    bool    gsa; // TRUE if GSA sentence was detected
-    GpsLocation  fix;
-    GpsSvStatus sv_status;
-    gps_location_callback  callback;
-    char    in[ NMEA_MAX_SIZE+1 ];
-} NmeaReader;
+        if (mant == 0 && c == 0 && !dot)
+            continue;       // leading zeroes
 
+        if (digits >= FIXED_MAX_DIGITS || scale >= FIXED_MAX_DIGITS) {
+            if (!dot)
+                return -1;  // integer part too large
+            continue;       // drop the extra fraction digits
+        }
 
-void update_gps_status(GpsStatusValue val)
-{
-    GpsState*  state = _gps_state;
-    //Should be made thread safe...
-    state->status.status=val;
-    if (state->callbacks->status_cb)
-        state->callbacks->status_cb(&state->status);
+        mant    = mant*10 + c;
+        digits += (mant != 0);
+        scale  += dot;
+    }
+
+    f->mant  = neg ? -mant : mant;
+    f->scale = scale;
+    return 0;
 }
 
 
-void update_gps_svstatus(GpsSvStatus *val)
+/* convert 'f' into an integer count of 10^-scale units, rounded to the
+ * nearest. returns -1 if it does not fit into 64 bits.
+ */
+static int
+fixed_rescale( NmeaFixed  f, int  scale, int64_t*  result )
 {
-    GpsState*  state = _gps_state;
-    //Should be made thread safe...
-    if (state->callbacks->sv_status_cb)
-        state->callbacks->sv_status_cb(val);
-}
+    int64_t  mul, div;
 
+    if (f.scale <= scale) {
+        if (f.mant == 0) {
+            *result = 0;
+            return 0;
+        }
+        if (scale - f.scale > FIXED_MAX_DIGITS)
+            return -1;
+        mul = pow10_table[scale - f.scale];
+        if (f.mant > INT64_MAX / mul || f.mant < -INT64_MAX / mul)
+            return -1;
+        *result = f.mant * mul;
+        return 0;
+    }
 
-void update_gps_location(GpsLocation *fix)
-{
-    GpsState*  state = _gps_state;
-    //Should be made thread safe...
-    if (state->callbacks->location_cb)
-        state->callbacks->location_cb(fix);
+    if (f.scale - scale > FIXED_MAX_DIGITS) {
+        *result = 0;    // |mant| < 10^18, so less than half a unit
+        return 0;
+    }
+    div = pow10_table[f.scale - scale];
+    if (f.mant < 0)
+        *result = (f.mant - div/2) / div;
+    else
+        *result = (f.mant + div/2) / div;
+    return 0;
 }
 
 
-#ifndef _USE_TIMEGM
-static time_t get_utc_diff()
+/* parse a hhmmss[.sss] field into milliseconds since midnight */
+static int
+str2tod( const char*  p, const char*  end )
 {
-    // 3rd January, 1970, Time: 00:00:00
-    static struct tm tm = { 0, 0, 0, 3, 0, 70, 0, 0, -1 };
-    return (2 * 24 * 3600) - mktime(&tm);
+    int  hour, minute, second, ms = 0, scale = 100;
+
+    if (p + 6 > end)
+        return -1;
+
+    hour   = str2int(p, p+2);
+    minute = str2int(p+2, p+4);
+    second = str2int(p+4, p+6);
+    if ((hour|minute|second) < 0 || hour > 23 || minute > 59 || second > 60)
+        return -1;
+
+    p += 6;
+    if (p < end && *p == '.') {
+        for (p++; p < end && scale > 0; p++, scale /= 10) {
+            int  c = *p - '0';
+            if ((unsigned)c >= 10)
+                return -1;
+            ms += c * scale;
+        }
+    }
+
+    return ((hour*60 + minute)*60 + second)*1000 + ms;
 }
-#endif // _USE_TIMEGM
 
 
-static void
-nmea_reader_init( NmeaReader*  r )
+static double
+str2float( const char*  p, const char*  end )
 {
-    memset( r, 0, sizeof(*r) );
+    NmeaFixed  f;
 
-    r->pos      = 0;
-    r->overflow = 0;
-    r->utc_year = -1;
-    r->utc_mon  = -1;
-    r->utc_day  = -1;
-    r->gsa      = false;
-    r->callback = NULL;
-    r->fix.size = sizeof(r->fix);
+    if (str2fixed(p, end, &f) < 0)
+        return 0.;
 
-    //nmea_reader_update_utc_diff( r );
+    // correctly rounded while mant fits into the 53 bits of a double, as it
+    // does for the fields receivers send. beyond, within an ulp
+    return (double) f.mant / (double) pow10_table[f.scale];
 }
 
 
-static int
-nmea_reader_update_time( NmeaReader*  r, Token  tok, time_t *gmt )
-{
-    int        hour, minute;
-    double     seconds;
-    struct tm  tm;
+/*****************************************************************/
+/*****************************************************************/
+/*****                                                       *****/
+/*****       T R A C I N G                                   *****/
+/*****                                                       *****/
+/*****************************************************************/
+/*****************************************************************/
 
-    if (tok.p + 6 > tok.end)
-        return -1;
+/* optional atrace compatible markers in the kernel trace buffer, so a
+ * systrace/Perfetto capture shows each stage of a fix next to the
+ * scheduler. they are enabled by setting debug.gps.trace to 1, which is
+ * checked again whenever a session starts.
+ */
+#define  GPS_TRACE_MARKER      "/sys/kernel/tracing/trace_marker"
+#define  GPS_TRACE_MARKER_OLD  "/sys/kernel/debug/tracing/trace_marker"
 
-    if (r->utc_year < 0) {
-        // no date yet, get current one
-        time_t  now = time(NULL);
-        gmtime_r( &now, &tm );
-        r->utc_year = tm.tm_year + 1900;
-        r->utc_mon  = tm.tm_mon + 1;
-        r->utc_day  = tm.tm_mday;
-    }
+static int  trace_fd = -1;
+static int  trace_enabled;
+static int  trace_pid;
 
-    tm.tm_hour  = str2int(tok.p, tok.p+2);
-    tm.tm_min   = str2int(tok.p+2, tok.p+4);
-    tm.tm_sec   = (int) str2float(tok.p+4, tok.end);
-    tm.tm_year  = r->utc_year - 1900;
-    tm.tm_mon   = r->utc_mon - 1;
-    tm.tm_mday  = r->utc_day;
-    tm.tm_isdst = -1;
+#define  GPS_TRACE_BEGIN(...)        do { if (trace_enabled) gps_trace('B', __VA_ARGS__); } while (0)
+#define  GPS_TRACE_END()             do { if (trace_enabled) gps_trace('E', NULL); } while (0)
+#define  GPS_TRACE_COUNTER(name, v)  do { if (trace_enabled) gps_trace('C', "%s|%lld", name, (long long)(v)); } while (0)
 
-#ifdef _USE_TIMEGM
-    *gmt = timegm( &tm );
-#else
-    *gmt = mktime( &tm ) + get_utc_diff();
-#endif
-    r->fix.timestamp = (long long) *gmt * 1000;
-    return 0;
+static void
+gps_trace( char  type, const char*  fmt, ... )
+{
+    char  buff[128];
+    int   len = snprintf(buff, sizeof(buff), "%c|%d", type, trace_pid);
+
+    if (fmt) {
+        va_list  args;
+
+        buff[len++] = '|';
+        va_start(args, fmt);
+        len += vsnprintf(buff + len, sizeof(buff) - len, fmt, args);
+        va_end(args);
+        if (len >= (int) sizeof(buff))
+            len = sizeof(buff) - 1;
+    }
+
+    write(trace_fd, buff, len);
 }
 
 
-static int
-nmea_reader_update_date( NmeaReader*  r, Token  date_tok, Token  time_tok )
+static void
+gps_trace_update( void )
 {
-    Token  tok = date_tok;
-    int    day, mon, year;
+    char  prop[PROPERTY_VALUE_MAX];
 
-    if (tok.p + 6 != tok.end) {
-        D("Date not properly formatted: '%.*s'", tok.end-tok.p, tok.p);
-        return -1;
+    property_get("debug.gps.trace", prop, "0");
+    if (atoi(prop) <= 0) {
+        trace_enabled = 0;
+        return;
     }
-    day  = str2int(tok.p, tok.p+2);
-    mon  = str2int(tok.p+2, tok.p+4);
-    year = str2int(tok.p+4, tok.p+6) + 2000;
 
-    if ((day|mon|year) < 0) {
-        D("Date not properly formatted: '%.*s'", tok.end-tok.p, tok.p);
-        return -1;
+    // the marker stays open once used: other threads may be writing to it
+    if (trace_fd < 0) {
+        trace_fd = open(GPS_TRACE_MARKER, O_WRONLY | O_CLOEXEC);
+        if (trace_fd < 0)
+            trace_fd = open(GPS_TRACE_MARKER_OLD, O_WRONLY | O_CLOEXEC);
+        if (trace_fd < 0) {
+            ALOGE("could not open trace_marker: %s", strerror(errno));
+            return;
+        }
     }
 
-    r->utc_year  = year;
-    r->utc_mon   = mon;
-    r->utc_day   = day;
+    trace_pid     = getpid();
+    trace_enabled = 1;
+}
 
-    time_t gmt;
-    int result = nmea_reader_update_time( r, time_tok, &gmt );
 
-    if (0 < time_sync)
-    {
-        long dif = (long) (time(NULL) - gmt);
-        if (dif < -time_sync || time_sync < dif)
-        {
-            D("System time synchronized with the GPS");
-            struct timeval tv = { gmt, 0 };
-            settimeofday(&tv, NULL);
-        }
-    }
+/*****************************************************************/
+/*****************************************************************/
+/*****                                                       *****/
+/*****       E V E N T   Q U E U E                           *****/
+/*****                                                       *****/
+/*****************************************************************/
+/*****************************************************************/
 
-    return result;
-}
+/* framework callbacks are not called by the GPS thread while it parses,
+ * since a slow callback would stall the serial reads. the GPS thread
+ * (the only producer) copies each report into a preallocated record of a
+ * lock-free ring, and a dispatch thread (the only consumer) calls the
+ * framework from there.
+ *
+ * when the dispatch thread falls behind and the ring is full, the
+ * configured policy either drops the oldest record, or coalesces: the
+ * newest report of each kind is kept in a per-kind mailbox, delivered
+ * once the ring is drained, and raw NMEA is dropped.
+ *
+ * the consumer tells which record it copies in 'reading': a slot freed by
+ * dropping its record is not rewritten while it is being copied, the new
+ * report is dropped instead.
+ *
+ * a batch of fixes is too large for a record: the GPS thread posts the
+ * buffer that holds it instead, and does not touch that buffer again
+ * until the dispatch thread has delivered it. a batch is never dropped.
+ */
+#define  GPS_EVENT_QUEUE_SIZE  64   /* must be a power of 2 */
+#define  GPS_EVENT_QUEUE_MASK  (GPS_EVENT_QUEUE_SIZE-1)
 
+enum {
+    GPS_EVENT_LOCATION = 0,
+    GPS_EVENT_SV_STATUS,
+    GPS_EVENT_GNSS_SV_STATUS,
+    GPS_EVENT_STATUS,
+    GPS_EVENT_NMEA,
+    GPS_EVENT_MAX
+};
 
-static double
-convert_from_hhmm( Token  tok )
+enum {
+    GPS_QUEUE_DROP_OLDEST = 0,
+    GPS_QUEUE_COALESCE
+};
+
+typedef struct {
+    int         type;
+    unsigned    seq;
+    int64_t     elapsed;    // CLOCK_BOOTTIME (ns) its data was read at, or -1
+    union {
+        GpsLocation  location;
+        GpsSvStatus   sv_status;
+        GnssSvStatus  gnss_sv_status;
+        GpsStatus     status;
+        struct {
+            GpsUtcTime   timestamp;
+            int          length;
+            char         data[ NMEA_MAX_SIZE+1 ];
+        } nmea;
+    } u;
+} GpsEvent;
+
+typedef struct {
+    unsigned    version;    // odd while the producer writes 'event'
+    GpsEvent    event;
+} GpsEventMailbox;
+
+typedef struct {
+    unsigned         head;      // next record to fill, producer owned
+    unsigned         tail;      // next record to deliver
+    unsigned         reading;   // consumer: 1 + slot of the record it copies, 0 if none
+    int              sleeping;  // consumer waits on wakeup_fd
+    int              quit;
+    int              running;   // dispatch thread is up
+    int              policy;
+    int              wakeup_fd;
+    unsigned         seq;       // producer sequence number
+    unsigned         dropped;
+    unsigned         delivered[ GPS_EVENT_MAX ];  // consumer: last seq
+    pthread_t        thread;
+    GpsCallbacks*    callbacks;
+    const GpsEvent*  current;   // event being delivered
+    GpsSerialBatchingCallbacks*  batch_callbacks;
+    const GpsLocation*  batch;  // posted batch, owned by the consumer
+    int              batch_count;   // fixes in it, 0 once delivered
+    GpsEvent         local;     // used when there is no dispatch thread
+    GpsEventMailbox  latest[ GPS_EVENT_MAX ];
+    GpsEvent         events[ GPS_EVENT_QUEUE_SIZE ];
+} GpsEventQueue;
+
+static GpsEventQueue  _gps_events[1] = {{ .wakeup_fd = -1 }};
+
+
+/* the part of a record its report actually uses, which is all a consumer
+ * needs to copy
+ */
+static size_t
+gps_event_size( const GpsEvent*  e )
 {
-    double  val     = str2float(tok.p, tok.end);
-    int     degrees = (int)(floor(val) / 100);
-    double  minutes = val - degrees*100.;
-    double  dcoord  = degrees + minutes / 60.0;
-    return dcoord;
+    size_t  size;
+
+    switch (e->type) {
+    case GPS_EVENT_LOCATION:
+        return offsetof(GpsEvent, u) + sizeof(GpsLocation);
+    case GPS_EVENT_SV_STATUS:
+        return offsetof(GpsEvent, u) + sizeof(GpsSvStatus);
+    case GPS_EVENT_GNSS_SV_STATUS:
+        size = (unsigned) e->u.gnss_sv_status.num_svs;
+        if (size > GNSS_MAX_SVS)
+            size = GNSS_MAX_SVS;
+        return offsetof(GpsEvent, u.gnss_sv_status.gnss_sv_list) + size * sizeof(GnssSvInfo);
+    case GPS_EVENT_STATUS:
+        return offsetof(GpsEvent, u) + sizeof(GpsStatus);
+    case GPS_EVENT_NMEA:
+        size = (unsigned) e->u.nmea.length;
+        if (size > NMEA_MAX_SIZE)
+            size = NMEA_MAX_SIZE;
+        return offsetof(GpsEvent, u.nmea.data) + size + 1;
+    }
+    return sizeof(GpsEvent);
 }
 
 
-static int
-nmea_reader_update_latlong( NmeaReader*  r,
-                            Token        latitude,
-                            char         latitudeHemi,
-                            Token        longitude,
-                            char         longitudeHemi )
+static void
+gps_event_deliver( GpsEventQueue*  q, GpsEvent*  e )
 {
-    double   lat, lon;
-    Token    tok;
+    GpsCallbacks*  cb = q->callbacks;
 
-    tok = latitude;
-    if (tok.p + 6 > tok.end) {
-        D("Latitude is too short: '%.*s'", tok.end-tok.p, tok.p);
-        return -1;
-    }
-    lat = convert_from_hhmm(tok);
-    if (latitudeHemi == 'S')
-        lat = -lat;
-
-    tok = longitude;
-    if (tok.p + 6 > tok.end) {
-        D("Longitude is too short: '%.*s'", tok.end-tok.p, tok.p);
-        return -1;
+    // a coalesced report may be older than one already delivered
+    if ((int)(e->seq - q->delivered[e->type]) < 0)
+        return;
+    q->delivered[e->type] = e->seq;
+
+    q->current = e;
+    switch (e->type) {
+    case GPS_EVENT_LOCATION:
+        if (cb->location_cb) {
+            GPS_TRACE_BEGIN("location_cb");
+            cb->location_cb(&e->u.location);
+            GPS_TRACE_END();
+        }
+        break;
+    case GPS_EVENT_SV_STATUS:
+        if (cb->sv_status_cb)
+            cb->sv_status_cb(&e->u.sv_status);
+        break;
+    case GPS_EVENT_GNSS_SV_STATUS:
+        if (cb->gnss_sv_status_cb)
+            cb->gnss_sv_status_cb(&e->u.gnss_sv_status);
+        break;
+    case GPS_EVENT_STATUS:
+        if (cb->status_cb)
+            cb->status_cb(&e->u.status);
+        break;
+    case GPS_EVENT_NMEA:
+        if (cb->nmea_cb)
+            cb->nmea_cb(e->u.nmea.timestamp, e->u.nmea.data, e->u.nmea.length);
+        break;
     }
-    lon = convert_from_hhmm(tok);
-    if (longitudeHemi == 'W')
-        lon = -lon;
-
-    r->fix.flags    |= GPS_LOCATION_HAS_LAT_LONG;
-    r->fix.latitude  = lat;
-    r->fix.longitude = lon;
-    return 0;
+    q->current = NULL;
 }
 
 
-static int
-nmea_reader_update_altitude( NmeaReader*  r,
-                             Token        altitude,
-                             Token        units )
+/* get a record to fill for a report of the given type, or NULL if the
+ * report must be dropped. gps_event_commit() must follow.
+ */
+static GpsEvent*
+gps_event_begin( GpsEventQueue*  q, int  type )
 {
-    //double  alt;
-    Token   tok = altitude;
+    GpsEvent*  e;
+    unsigned   t;
 
-    if (tok.p >= tok.end)
-        return -1;
+    if (!q->running) {
+        e = &q->local;
+    } else {
+        t = __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+        if (q->head - t >= GPS_EVENT_QUEUE_SIZE && q->policy == GPS_QUEUE_DROP_OLDEST) {
+            // the consumer notices that its CAS on tail fails, and
+            // discards whatever it copied from this record. if it got
+            // there first, t is the tail it left
+            if (__atomic_compare_exchange_n(&q->tail, &t, t+1, 0,
+                                            __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+                q->dropped += 1;
+                t += 1;
+            }
+        }
+        if (q->head - t < GPS_EVENT_QUEUE_SIZE) {
+            // the record this slot held was dropped, and is still being copied
+            if (__atomic_load_n(&q->reading, __ATOMIC_SEQ_CST) == (q->head & GPS_EVENT_QUEUE_MASK) + 1) {
+                q->dropped += 1;
+                return NULL;
+            }
+            e = &q->events[q->head & GPS_EVENT_QUEUE_MASK];
+        } else if (type != GPS_EVENT_NMEA) {
+            GpsEventMailbox*  m = &q->latest[type];
+
+            __atomic_store_n(&m->version, m->version + 1, __ATOMIC_RELAXED);
+            __atomic_thread_fence(__ATOMIC_RELEASE);
+            q->dropped += 1;
+            e = &m->event;
+        } else {
+            q->dropped += 1;
+            return NULL;
+        }
+    }
 
-    r->fix.flags   |= GPS_LOCATION_HAS_ALTITUDE;
-    r->fix.altitude = str2float(tok.p, tok.end);
-    return 0;
+    e->type    = type;
+    e->seq     = q->seq++;
+    e->elapsed = -1;
+    return e;
 }
 
 
-static int nmea_reader_update_accuracy(NmeaReader* r, Token accuracy, bool is_fix)
+static void
+gps_event_commit( GpsEventQueue*  q, GpsEvent*  e )
 {
-    //double  acc;
-    Token   tok = accuracy;
-
-    if (tok.p >= tok.end)
-        return -1;
+    if (e == &q->local) {
+        gps_event_deliver(q, e);
+        return;
+    }
 
-    r->fix.accuracy = (float) str2float(tok.p, tok.end);
-    if (99.0f < r->fix.accuracy)
-        return 0;
+    if (e == &q->latest[e->type].event) {
+        GpsEventMailbox*  m = &q->latest[e->type];
+        __atomic_store_n(&m->version, m->version + 1, __ATOMIC_RELEASE);
+    } else {
+        __atomic_store_n(&q->head, q->head + 1, __ATOMIC_SEQ_CST);
+    }
 
-    if (is_fix)
-        r->fix.flags |= GPS_LOCATION_HAS_ACCURACY;
-    return 0;
+    if (__atomic_load_n(&q->sleeping, __ATOMIC_SEQ_CST)) {
+        uint64_t  one = 1;
+        write(q->wakeup_fd, &one, sizeof(one));
+    }
 }
 
 
+/* hand a batch of fixes over to the dispatch thread. returns -1 if the
+ * previous one is still being delivered: the caller must keep its fixes
+ * and try again later.
+ */
 static int
-nmea_reader_update_bearing( NmeaReader*  r,
-                            Token        bearing )
+gps_event_post_batch( GpsEventQueue*  q, GpsSerialBatchingCallbacks*  callbacks,
+                      const GpsLocation*  locations, int  count )
 {
-    //double  alt;
-    Token   tok = bearing;
+    if (!q->running) {
+        if (callbacks && callbacks->batch_location_cb)
+            callbacks->batch_location_cb(count, (GpsLocation*) locations);
+        return 0;
+    }
 
-    if (tok.p >= tok.end)
+    if (__atomic_load_n(&q->batch_count, __ATOMIC_ACQUIRE) != 0)
         return -1;
 
-    r->fix.flags   |= GPS_LOCATION_HAS_BEARING;
-    r->fix.bearing  = str2float(tok.p, tok.end);
+    q->batch_callbacks = callbacks;
+    q->batch           = locations;
+    __atomic_store_n(&q->batch_count, count, __ATOMIC_SEQ_CST);
+
+    if (__atomic_load_n(&q->sleeping, __ATOMIC_SEQ_CST)) {
+        uint64_t  one = 1;
+        write(q->wakeup_fd, &one, sizeof(one));
+    }
     return 0;
 }
 
 
+/* consumer: deliver the posted batch, if any, and give its buffer back */
 static int
-nmea_reader_update_speed( NmeaReader*  r,
-                          Token        speed )
+gps_event_deliver_batch( GpsEventQueue*  q )
 {
-    //double  alt;
-    Token   tok = speed;
+    int  count = __atomic_load_n(&q->batch_count, __ATOMIC_SEQ_CST);
 
-    if (tok.p >= tok.end)
-        return -1;
+    if (count == 0)
+        return 0;
 
-    r->fix.flags |= GPS_LOCATION_HAS_SPEED;
-    r->fix.speed = (float) (str2float(tok.p, tok.end) * (1.852 / 3.6));
-    return 0;
+    GPS_TRACE_BEGIN("batch_location_cb");
+    if (q->batch_callbacks && q->batch_callbacks->batch_location_cb)
+        q->batch_callbacks->batch_location_cb(count, (GpsLocation*) q->batch);
+    GPS_TRACE_END();
+
+    __atomic_store_n(&q->batch_count, 0, __ATOMIC_RELEASE);
+    return 1;
 }
 
 
+/* consumer: copy the oldest record out of the ring. returns 0 if the
+ * ring is empty.
+ */
 static int
-nmea_reader_update_svs( NmeaReader*  r, int inview, int num, int i, Token prn, Token elevation, Token azimuth, Token snr )
-{
-    int o;
-    int prnid;
-    i = (num - 1)*4 + i;
-    if (i < inview) {
-        r->sv_status.sv_list[i].prn=str2int(prn.p,prn.end);
-        r->sv_status.sv_list[i].elevation=str2int(elevation.p,elevation.end);
-        r->sv_status.sv_list[i].azimuth=str2int(azimuth.p,azimuth.end);
-        r->sv_status.sv_list[i].snr=str2int(snr.p,snr.end);
-        for (o=0;o<12;o++){
-            if (id_in_fixed[o]==str2int(prn.p,prn.end)){
-                prnid = str2int(prn.p, prn.end);
-                r->sv_status.used_in_fix_mask |= (1ul << (prnid-1));
-            }
+gps_event_pop( GpsEventQueue*  q, GpsEvent*  e )
+{
+    for (;;) {
+        unsigned  t = __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+        unsigned  h = __atomic_load_n(&q->head, __ATOMIC_SEQ_CST);
+
+        if (t == h)
+            return 0;
+
+        const GpsEvent*  src = &q->events[t & GPS_EVENT_QUEUE_MASK];
+        int              done = 0;
+
+        // claim the record, then check it was not dropped first: past
+        // this point, the producer does not rewrite its slot
+        __atomic_store_n(&q->reading, (t & GPS_EVENT_QUEUE_MASK) + 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&q->tail, __ATOMIC_SEQ_CST) == t) {
+            memcpy(e, src, gps_event_size(src));
+            __atomic_store_n(&q->reading, 0, __ATOMIC_RELEASE);
+            done = __atomic_compare_exchange_n(&q->tail, &t, t+1, 0,
+                                               __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+        } else {
+            __atomic_store_n(&q->reading, 0, __ATOMIC_RELEASE);
         }
+        if (done)
+            return 1;
+        // the producer dropped this record meanwhile, retry
     }
-    return 0;
 }
 
 
-static void
-nmea_reader_parse( NmeaReader*  r )
+/* consumer: copy a coalesced report out of a mailbox, if it is newer
+ * than the last one delivered.
+ */
+static int
+gps_event_pop_latest( GpsEventQueue*  q, int  type, GpsEvent*  e )
 {
-   /* we received a complete sentence, now parse it to generate
-    * a new GPS fix...
-    */
-    NmeaTokenizer  tzer[1];
-    Token          tok;
-    struct timeval tv;
+    GpsEventMailbox*  m = &q->latest[type];
+    unsigned          v1, v2;
 
-    D("Received: '%.*s'", r->pos, r->in);
-    if (r->pos < 9) {
-        D("Too short. discarded.");
-        return;
-    }
+    do {
+        v1 = __atomic_load_n(&m->version, __ATOMIC_ACQUIRE);
+        if (v1 == 0 || (v1 & 1))
+            return 0;
+        memcpy(e, &m->event, gps_event_size(&m->event));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        v2 = __atomic_load_n(&m->version, __ATOMIC_RELAXED);
+    } while (v1 != v2);
+
+    return (int)(e->seq - q->delivered[type]) > 0;
+}
 
-    r->in[r->pos] = 0;
 
-    gettimeofday(&tv, NULL);
-    if (_gps_state->init)
-        _gps_state->callbacks->nmea_cb(tv.tv_sec*1000+tv.tv_usec/1000, r->in, r->pos);
+static void
+gps_dispatch_thread( void*  arg )
+{
+    GpsEventQueue*  q = (GpsEventQueue*) arg;
+    GpsEvent        e;
+    int             type;
 
-    nmea_tokenizer_init(tzer, r->in, r->in + r->pos);
-#if GPS_DEBUG
-    {
-        int  n;
-        D("Found %d tokens", tzer->count);
-        for (n = 0; n < tzer->count; n++) {
-            Token  tok = nmea_tokenizer_get(tzer,n);
-            D("%2d: '%.*s'", n, tok.end-tok.p, tok.p);
-        }
-    }
-#endif
+    D("GPS dispatch thread running");
 
-    tok = nmea_tokenizer_get(tzer, 0);
-    if (tok.p + 5 > tok.end) {
-        D("Sentence id '%.*s' too short, ignored.", tok.end-tok.p, tok.p);
-        return;
-    }
+    while (!__atomic_load_n(&q->quit, __ATOMIC_ACQUIRE)) {
+        uint64_t  count;
+        int       pending = 0;
 
-    // ignore first two characters.
-    tok.p += 2;
-
-    bool send_msg = false;
-    if ( !memcmp(tok.p, "GGA", 3) ) {
-        // GPS fix
-        Token  tok_time          = nmea_tokenizer_get(tzer,1);
-        Token  tok_latitude      = nmea_tokenizer_get(tzer,2);
-        Token  tok_latitudeHemi  = nmea_tokenizer_get(tzer,3);
-        Token  tok_longitude     = nmea_tokenizer_get(tzer,4);
-        Token  tok_longitudeHemi = nmea_tokenizer_get(tzer,5);
-        Token  tok_fix           = nmea_tokenizer_get(tzer,6);
-        Token  tok_accuracy      = nmea_tokenizer_get(tzer,8);
-        Token  tok_altitude      = nmea_tokenizer_get(tzer,9);
-        Token  tok_altitudeUnits = nmea_tokenizer_get(tzer,10);
-
-        int fix = str2int(tok_fix.p, tok_fix.end);
-        if (0 < fix)
-        {
-            time_t gmt;
-            nmea_reader_update_time(r, tok_time, &gmt);
-            nmea_reader_update_latlong(r, tok_latitude, tok_latitudeHemi.p[0], tok_longitude, tok_longitudeHemi.p[0]);
-            nmea_reader_update_altitude(r, tok_altitude, tok_altitudeUnits);
+        if (gps_event_pop(q, &e)) {
+            gps_event_deliver(q, &e);
+            continue;
         }
 
-        if (!r->gsa)
-        {
-            nmea_reader_update_accuracy(r, tok_accuracy, 0 < fix);
-            send_msg = true;
-        }
-    } else if ( !memcmp(tok.p, "GSA", 3) ) {
-        /*
-          1    = Mode:
-                 M=Manual, forced to operate in 2D or 3D
-                 A=Automatic, 3D/2D
-          2    = Mode:
-                 1=Fix not available
-                 2=2D
-                 3=3D
-          3-14 = IDs of SVs used in position fix (null for unused fields)
-          15   = PDOP
-          16   = HDOP
-          17   = VDOP
-        */
-        if (r->gsa)
-        {
-            //Token tok_mode = nmea_tokenizer_get(tzer,1);
-            Token tok_fix = nmea_tokenizer_get(tzer,2);
-            //Token tok_id   = nmea_tokenizer_get(tzer,3);
-            //Token tok_pdop = nmea_tokenizer_get(tzer,15);
-            Token tok_hdop = nmea_tokenizer_get(tzer,16);
-            //Token tok_vdop = nmea_tokenizer_get(tzer,17);
-
-            int fix = str2int(tok_fix.p, tok_fix.end);
-            if (fix == 2)
-                r->fix.flags &= ~GPS_LOCATION_HAS_ALTITUDE;
-
-            nmea_reader_update_accuracy(r, tok_hdop, 1 < fix);
-            send_msg = true;
-
-            int i;
-            for (i = 0; i < 12; i++) {
-                Token tok_id = nmea_tokenizer_get(tzer, 3 + i);
-                if (tok_id.end > tok_id.p) {
-                    id_in_fixed[i] = str2int(tok_id.p, tok_id.end);
-                    D("Satellite used '%.*s'", tok_id.end - tok_id.p, tok_id.p);
-                }
+        for (type = 0; type < GPS_EVENT_MAX; type++) {
+            if (gps_event_pop_latest(q, type, &e)) {
+                gps_event_deliver(q, &e);
+                pending = 1;
             }
         }
+        if (gps_event_deliver_batch(q))
+            pending = 1;
+        if (pending)
+            continue;
 
-        r->gsa = true;
-    } else if ( !memcmp(tok.p, "GSV", 3) ) {
-        /*
-        1    = Total number of messages of this type in this cycle
-        2    = Message number
-        3    = Total number of SVs in view
-        4    = SV PRN number
-        5    = Elevation in degrees, 90 maximum
-        6    = Azimuth, degrees from true north, 000 to 359
-        7    = SNR, 00-99 dB (null when not tracking)
-        8-11 = Information about second SV, same as field 4-7
-        12-15= Information about third SV, same as field 4-7
-        16-19= Information about fourth SV, same as field 4-7
-        */
-
-        //Satellites are handled by RPC-side code.
-        Token tok_num_messages   = nmea_tokenizer_get(tzer,1);
-        Token tok_msg_number     = nmea_tokenizer_get(tzer,2);
-        Token tok_svs_inview     = nmea_tokenizer_get(tzer,3);
-        Token tok_sv1_prn_num    = nmea_tokenizer_get(tzer,4);
-        Token tok_sv1_elevation  = nmea_tokenizer_get(tzer,5);
-        Token tok_sv1_azimuth    = nmea_tokenizer_get(tzer,6);
-        Token tok_sv1_snr        = nmea_tokenizer_get(tzer,7);
-        Token tok_sv2_prn_num    = nmea_tokenizer_get(tzer,8);
-        Token tok_sv2_elevation  = nmea_tokenizer_get(tzer,9);
-        Token tok_sv2_azimuth    = nmea_tokenizer_get(tzer,10);
-        Token tok_sv2_snr        = nmea_tokenizer_get(tzer,11);
-        Token tok_sv3_prn_num    = nmea_tokenizer_get(tzer,12);
-        Token tok_sv3_elevation  = nmea_tokenizer_get(tzer,13);
-        Token tok_sv3_azimuth    = nmea_tokenizer_get(tzer,14);
-        Token tok_sv3_snr        = nmea_tokenizer_get(tzer,15);
-        Token tok_sv4_prn_num    = nmea_tokenizer_get(tzer,16);
-        Token tok_sv4_elevation  = nmea_tokenizer_get(tzer,17);
-        Token tok_sv4_azimuth    = nmea_tokenizer_get(tzer,18);
-        Token tok_sv4_snr        = nmea_tokenizer_get(tzer,19);
-        int num_messages = str2int(tok_num_messages.p,tok_num_messages.end);
-        int msg_number = str2int(tok_msg_number.p,tok_msg_number.end);
-        int svs_inview = str2int(tok_svs_inview.p,tok_svs_inview.end);
-        D("GSV %d %d %d", num_messages, msg_number, svs_inview );
-        if (msg_number==1){
-            r->sv_status.used_in_fix_mask = 0ul;
+        // announce that we sleep, then check again before doing so
+        __atomic_store_n(&q->sleeping, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&q->head, __ATOMIC_SEQ_CST) == __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE) &&
+            __atomic_load_n(&q->batch_count, __ATOMIC_SEQ_CST) == 0 &&
+            !__atomic_load_n(&q->quit, __ATOMIC_ACQUIRE)) {
+            while (read(q->wakeup_fd, &count, sizeof(count)) < 0 && errno == EINTR)
+                ;
         }
+        __atomic_store_n(&q->sleeping, 0, __ATOMIC_SEQ_CST);
+    }
 
-        nmea_reader_update_svs( r, svs_inview, msg_number, 0, tok_sv1_prn_num, tok_sv1_elevation, tok_sv1_azimuth, tok_sv1_snr );
-        nmea_reader_update_svs( r, svs_inview, msg_number, 1, tok_sv2_prn_num, tok_sv2_elevation, tok_sv2_azimuth, tok_sv2_snr );
-        nmea_reader_update_svs( r, svs_inview, msg_number, 2, tok_sv3_prn_num, tok_sv3_elevation, tok_sv3_azimuth, tok_sv3_snr );
-        nmea_reader_update_svs( r, svs_inview, msg_number, 3, tok_sv4_prn_num, tok_sv4_elevation, tok_sv4_azimuth, tok_sv4_snr );
-        r->sv_status.num_svs=svs_inview;
-
-        if (num_messages==msg_number)
-            update_gps_svstatus(&r->sv_status);
-
-    } else if ( !memcmp(tok.p, "RMC", 3) ) {
-        Token  tok_time          = nmea_tokenizer_get(tzer,1);
-        Token  tok_fixStatus     = nmea_tokenizer_get(tzer,2);
-        Token  tok_latitude      = nmea_tokenizer_get(tzer,3);
-        Token  tok_latitudeHemi  = nmea_tokenizer_get(tzer,4);
-        Token  tok_longitude     = nmea_tokenizer_get(tzer,5);
-        Token  tok_longitudeHemi = nmea_tokenizer_get(tzer,6);
-        Token  tok_speed         = nmea_tokenizer_get(tzer,7);
-        Token  tok_bearing       = nmea_tokenizer_get(tzer,8);
-        Token  tok_date          = nmea_tokenizer_get(tzer,9);
-
-        D("in RMC, fixStatus=%c", tok_fixStatus.p[0]);
-        if (tok_fixStatus.p[0] == 'A') {
-            nmea_reader_update_date( r, tok_date, tok_time );
-
-            nmea_reader_update_latlong( r, tok_latitude,
-                                           tok_latitudeHemi.p[0],
-                                           tok_longitude,
-                                           tok_longitudeHemi.p[0] );
-
-            nmea_reader_update_bearing( r, tok_bearing );
-            nmea_reader_update_speed  ( r, tok_speed );
-        }
-    } else if ( !memcmp(tok.p, "VTG", 3) ) {
-        Token  tok_fixStatus     = nmea_tokenizer_get(tzer,9);
+    D("GPS dispatch thread quitting");
+}
 
-        if (tok_fixStatus.p[0] != '\0' && tok_fixStatus.p[0] != 'N') {
-            Token  tok_bearing       = nmea_tokenizer_get(tzer,1);
-            Token  tok_speed         = nmea_tokenizer_get(tzer,5);
 
-            nmea_reader_update_bearing( r, tok_bearing );
-            nmea_reader_update_speed  ( r, tok_speed );
-        }
-    } else {
-        tok.p -= 2;
-        D("Unknown sentence '%.*s", tok.end-tok.p, tok.p);
-    }
+static void
+gps_event_queue_init( GpsEventQueue*  q, GpsCallbacks*  callbacks )
+{
+    char  prop[PROPERTY_VALUE_MAX];
 
-#if GPS_DEBUG
-    if (r->fix.flags) {
+    memset(q, 0, sizeof(*q));
+    q->callbacks = callbacks;
+    q->wakeup_fd = -1;
 
-        char   temp[256];
-        char*  p   = temp;
-        char*  end = p + sizeof(temp);
-        struct tm   utc;
+    q->policy = GPS_QUEUE_DROP_OLDEST;
+    if (property_get("ro.kernel.android.gps.queue_policy", prop, "") != 0)
+    {
+        if (strcmp(prop, "coalesce") == 0)
+            q->policy = GPS_QUEUE_COALESCE;
+        else if (strcmp(prop, "drop_oldest") != 0)
+            ALOGE("unknown GPS queue policy '%s'", prop);
+    }
 
-        p += snprintf( p, end-p, "Sending fix" );
-        if (r->fix.flags & GPS_LOCATION_HAS_LAT_LONG) {
-            p += snprintf(p, end-p, " lat=%g lon=%g", r->fix.latitude, r->fix.longitude);
-        }
-        if (r->fix.flags & GPS_LOCATION_HAS_ALTITUDE) {
-            p += snprintf(p, end-p, " altitude=%g", r->fix.altitude);
-        }
-        if (r->fix.flags & GPS_LOCATION_HAS_SPEED) {
-            p += snprintf(p, end-p, " speed=%g", r->fix.speed);
-        }
-        if (r->fix.flags & GPS_LOCATION_HAS_BEARING) {
-            p += snprintf(p, end-p, " bearing=%g", r->fix.bearing);
-        }
-        if (r->fix.flags & GPS_LOCATION_HAS_ACCURACY) {
-            p += snprintf(p,end-p, " accuracy=%g", r->fix.accuracy);
-        }
-        gmtime_r( (time_t*) &r->fix.timestamp, &utc );
-        p += snprintf(p, end-p, " time=%s", asctime( &utc ) );
-        D("%s\n", temp);
+    D("event queue policy is %s", (q->policy == GPS_QUEUE_COALESCE) ? "coalesce" : "drop_oldest");
+
+    q->wakeup_fd = eventfd(0, 0);
+    if (q->wakeup_fd < 0) {
+        ALOGE("Could not create event queue wakeup fd: %s", strerror(errno));
+        return;
     }
-#endif
-    if (send_msg)
-    {
-        if (_gps_state->callbacks->location_cb)
-        {
-            _gps_state->callbacks->location_cb(&r->fix);
-            r->fix.flags = 0;
-        }
-        else
-        {
-            D("No callback, keeping data until needed !");
-        }
+
+    // mark the queue running first, the thread may start right away
+    q->running = 1;
+    q->thread  = callbacks->create_thread_cb( "gps_dispatch_thread", gps_dispatch_thread, q );
+    if ( !q->thread ) {
+        ALOGE("Could not create GPS dispatch thread: %s, calling back synchronously", strerror(errno));
+        q->running = 0;
     }
 }
 
 
 static void
-nmea_reader_addc( NmeaReader*  r, int  c )
+gps_event_queue_done( GpsEventQueue*  q )
 {
-    if (r->overflow) {
-        r->overflow = (c != '\n');
-        return;
+    void*  dummy;
+
+    if (q->running) {
+        uint64_t  one = 1;
+
+        __atomic_store_n(&q->quit, 1, __ATOMIC_RELEASE);
+        write(q->wakeup_fd, &one, sizeof(one));
+        pthread_join(q->thread, &dummy);
+        q->running = 0;
     }
 
-    if (r->pos >= (int) sizeof(r->in)-1 ) {
-        r->overflow = 1;
-        r->pos      = 0;
-        return;
+    if (q->dropped)
+        ALOGW("%u GPS reports were dropped or coalesced", q->dropped);
+
+    if (q->wakeup_fd >= 0) {
+        close(q->wakeup_fd);
+        q->wakeup_fd = -1;
+    }
+}
+
+
+/* producer side helpers, called from the GPS thread only */
+
+void update_gps_status(GpsStatusValue val)
+{
+    GpsState*  state = _gps_state;
+    GpsEvent*  e;
+
+    state->status.status=val;
+    e = gps_event_begin(_gps_events, GPS_EVENT_STATUS);
+    if (e) {
+        e->u.status = state->status;
+        gps_event_commit(_gps_events, e);
+    }
+}
+
+
+void update_gps_svstatus(GpsSvStatus *val)
+{
+    GpsEvent*  e = gps_event_begin(_gps_events, GPS_EVENT_SV_STATUS);
+
+    if (e) {
+        e->u.sv_status = *val;
+        gps_event_commit(_gps_events, e);
+    }
+}
+
+void update_gnss_svstatus(GnssSvStatus *val)
+{
+    GpsEvent*  e = gps_event_begin(_gps_events, GPS_EVENT_GNSS_SV_STATUS);
+
+    if (e) {
+        e->u.gnss_sv_status = *val;
+        gps_event_commit(_gps_events, e);
+    }
+}
+
+
+void update_gps_location(GpsLocation *fix, int64_t elapsed)
+{
+    GpsEvent*  e = gps_event_begin(_gps_events, GPS_EVENT_LOCATION);
+
+    if (e) {
+        e->elapsed    = elapsed;
+        e->u.location = *fix;
+        gps_event_commit(_gps_events, e);
     }
+}
 
-    r->in[r->pos] = (char)c;
-    r->pos       += 1;
 
-    if (c == '\n') {
-        nmea_reader_parse( r );
-        r->pos = 0;
+static void
+update_gps_nmea(GpsUtcTime timestamp, int64_t elapsed, const char *nmea, int length)
+{
+    GpsEvent*  e = gps_event_begin(_gps_events, GPS_EVENT_NMEA);
+
+    if (e) {
+        e->elapsed = elapsed;
+        if (length > NMEA_MAX_SIZE)
+            length = NMEA_MAX_SIZE;
+        e->u.nmea.timestamp = timestamp;
+        e->u.nmea.length    = length;
+        // even when delivered right away: the sentence is in the framer
+        // ring, and nmea_cb gets a C string
+        memcpy(e->u.nmea.data, nmea, length);
+        e->u.nmea.data[length] = '\0';
+        gps_event_commit(_gps_events, e);
     }
 }
 
@@ -735,474 +1054,4661 @@ nmea_reader_addc( NmeaReader*  r, int  c )
 /*****************************************************************/
 /*****************************************************************/
 /*****                                                       *****/
-/*****       C O N N E C T I O N   S T A T E                 *****/
+/*****       F I X   B A T C H                               *****/
 /*****                                                       *****/
 /*****************************************************************/
 /*****************************************************************/
 
-/* commands sent to the gps thread */
-enum {
-    CMD_QUIT  = 0,
-    CMD_START = 1,
-    CMD_STOP  = 2
-};
+/* batched fixes are kept packed in a ring allocated once, and expanded
+ * into GpsLocation only when delivered. storing one is a copy, without
+ * callback, so that the framework is not woken up.
+ *
+ * there are two delivery buffers, so that a ring that fills up while the
+ * previous batch is with the dispatch thread is expanded into the other
+ * one, to be posted next, and its fixes are kept. only if the ring fills
+ * up again before then are fixes dropped.
+ */
+#define  GPS_BATCH_SIZE  600    /* default: 10 minutes of 1 Hz fixes */
+#define  GPS_BATCH_RETRY_MS  10 /* while the previous batch is being delivered */
 
+typedef struct {
+    GpsUtcTime  timestamp;
+    int32_t     latitude;   // 1e-7 degrees
+    int32_t     longitude;  // 1e-7 degrees
+    int32_t     altitude;   // cm
+    uint16_t    speed;      // cm/s
+    uint16_t    bearing;    // 0.01 degrees
+    uint16_t    accuracy;   // dm
+    uint16_t    flags;
+} GpsBatchFix;
 
-static void
-gps_state_done( GpsState*  s )
+typedef struct {
+    GpsSerialBatchingCallbacks*  callbacks;
+    GpsBatchFix*  fixes;
+    GpsLocation*  locations[2]; // delivery buffers, one may be with the dispatch thread
+    int           spare;        // index of the one that is not
+    int           ready;        // fixes expanded into the spare buffer, to post next
+    int           capacity;
+    int           head;         // oldest fix
+    int           count;
+    uint32_t      flags;        // GPS_BATCH_*
+    unsigned      dropped;
+    int           pending;      // to deliver once the previous batch is
+} GpsBatch;
+
+static GpsBatch  _gps_batch[1];
+
+
+static uint16_t
+gps_batch_u16( double  v )
 {
-    // tell the thread to quit, and wait for it
-    char   cmd = CMD_QUIT;
-    void*  dummy;
-    write( s->control[0], &cmd, 1 );
-    pthread_join(s->thread, &dummy);
+    return (v <= 0) ? 0 : (v >= 65535) ? 65535 : (uint16_t) lrint(v);
+}
 
-    // close the control socket pair
-    close( s->control[0] ); s->control[0] = -1;
-    close( s->control[1] ); s->control[1] = -1;
 
-    // close connection to the QEMU GPS daemon
-    close( s->fd ); s->fd = -1;
-    s->init = 0;
+/* expand the ring into the spare delivery buffer, and empty it */
+static void
+gps_batch_expand( GpsBatch*  b )
+{
+    GpsLocation*  locations = b->locations[b->spare];
+    int           n;
+
+    for (n = 0; n < b->count; n++) {
+        const GpsBatchFix*  f = &b->fixes[ (b->head + n) % b->capacity ];
+        GpsLocation*        l = &locations[n];
+
+        l->size      = sizeof(*l);
+        l->flags     = f->flags;
+        l->latitude  = f->latitude * 1e-7;
+        l->longitude = f->longitude * 1e-7;
+        l->altitude  = f->altitude * 0.01;
+        l->speed     = f->speed * 0.01f;
+        l->bearing   = f->bearing * 0.01f;
+        l->accuracy  = f->accuracy * 0.1f;
+        l->timestamp = f->timestamp;
+    }
+    b->ready = b->count;
+    b->head  = 0;
+    b->count = 0;
 }
 
 
+/* post the batched fixes to the dispatch thread. a delivery buffer is
+ * the dispatch thread's until it has called back: while it is, the fixes
+ * are kept and pending is set, for the GPS thread to try again.
+ */
 static void
-gps_state_start( GpsState*  s )
+gps_batch_deliver( GpsBatch*  b )
 {
-    char  cmd = CMD_START;
-    int   ret;
+    b->pending = 0;
+    if (b->count == 0 && b->ready == 0)
+        return;
+    if (__atomic_load_n(&_gps_events->batch_count, __ATOMIC_ACQUIRE) != 0) {
+        b->pending = 1;
+        return;
+    }
 
-    do {
-        ret = write( s->control[0], &cmd, 1 );
-    } while (ret < 0 && errno == EINTR);
+    GPS_TRACE_BEGIN("batch deliver");
+    if (b->ready == 0)
+        gps_batch_expand(b);
+    gps_event_post_batch(_gps_events, b->callbacks, b->locations[b->spare], b->ready);
+    GPS_TRACE_END();
 
-    if (ret != 1)
-        D("%s: could not send CMD_START command: ret=%d: %s",
-                __FUNCTION__, ret, strerror(errno));
+    D("delivered a batch of %d fixes", b->ready);
+    b->spare ^= 1;
+    b->ready  = 0;
+
+    // the ring filled up again while the expanded fixes waited: they are next
+    if (b->count > 0)
+        b->pending = 1;
 }
 
 
 static void
-gps_state_stop( GpsState*  s )
+gps_batch_add( GpsBatch*  b, const GpsLocation*  l )
 {
-    char  cmd = CMD_STOP;
-    int   ret;
+    GpsBatchFix*  f;
 
-    do { ret=write( s->control[0], &cmd, 1 ); }
-    while (ret < 0 && errno == EINTR);
+    // the previous batch is still being delivered: keep the full ring in
+    // the spare buffer, if it is not already holding one
+    if (b->count == b->capacity && (b->flags & GPS_BATCH_WAKEUP_ON_FULL) && b->ready == 0)
+        gps_batch_expand(b);
 
-    if (ret != 1)
-        D("%s: could not send CMD_STOP command: ret=%d: %s",
-          __FUNCTION__, ret, strerror(errno));
+    if (b->count == b->capacity) {
+        b->dropped++;
+        if (b->flags & GPS_BATCH_KEEP_OLDEST)
+            return;
+        b->head   = (b->head + 1) % b->capacity;
+        b->count -= 1;
+    }
+
+    f = &b->fixes[ (b->head + b->count) % b->capacity ];
+    f->timestamp = l->timestamp;
+    f->latitude  = (int32_t) lrint(l->latitude * 1e7);
+    f->longitude = (int32_t) lrint(l->longitude * 1e7);
+    f->altitude  = (int32_t) lrint(l->altitude * 100);
+    f->speed     = gps_batch_u16(l->speed * 100);
+    f->bearing   = gps_batch_u16(l->bearing * 100);
+    f->accuracy  = gps_batch_u16(l->accuracy * 10);
+    f->flags     = l->flags;
+    b->count    += 1;
+
+    if (b->count == b->capacity && (b->flags & GPS_BATCH_WAKEUP_ON_FULL))
+        gps_batch_deliver(b);
 }
 
 
+/*****************************************************************/
+/*****************************************************************/
+/*****                                                       *****/
+/*****       F A N - O U T   S E R V E R                     *****/
+/*****                                                       *****/
+/*****************************************************************/
+/*****************************************************************/
+
+/* local daemons (loggers, telemetry) read the GNSS data from a unix socket
+ * served by the GPS thread, instead of opening the device a second time.
+ * every client gets the NMEA sentences and/or the fixes, the latter as a
+ * proprietary $PSGPS,FIX sentence, so the stream is NMEA either way.
+ *
+ * data is written to a client right away, and only what its socket does
+ * not take is kept in the client ring, sent on EPOLLOUT. a message that
+ * does not fit in the ring is skipped for that client only, so that the
+ * stream stays made of whole sentences, and a client that reads nothing
+ * for GPS_SERVER_STALL_MS is dropped. the reader never waits for one.
+ */
+#define  GPS_SERVER_CLIENTS   8
+#define  GPS_SERVER_RING      16384    /* bytes per client, must be a power of 2 */
+#define  GPS_SERVER_MASK      (GPS_SERVER_RING-1)
+#define  GPS_SERVER_STALL_MS  30000
+#define  GPS_SERVER_MODE      0660     /* of a socket the HAL creates */
+
+#define  GPS_SERVER_NMEA  1
+#define  GPS_SERVER_FIX   2
+
+typedef struct {
+    int       fd;           // -1 if the slot is free
+    char*     ring;
+    unsigned  head;         // free running positions in ring
+    unsigned  tail;
+    int       polling;      // EPOLLOUT is enabled
+    int64_t   progress;     // CLOCK_BOOTTIME (ns) of the last write that went through
+    unsigned  skipped;      // messages that did not fit
+} GpsServerClient;
+
+typedef struct {
+    int   fd;               // listening socket, -1 if not serving
+    int   epoll_fd;         // of the GPS thread
+    int   feeds;            // GPS_SERVER_* sent to the clients
+    int   count;            // clients connected
+    GpsServerClient  clients[ GPS_SERVER_CLIENTS ];
+} GpsServer;
+
+static GpsServer  _gps_server[1] = {{ .fd = -1, .epoll_fd = -1 }};
+
+
+/* the fixes are precise locations: the socket must be one only the
+ * allowed clients can connect to. a name starting with '/' is a
+ * filesystem path, created with mode GPS_SERVER_MODE whatever the umask,
+ * anything else must be a socket created by init, with the owner and
+ * mode of its service definition. abstract sockets, which anybody may
+ * connect to, are never used.
+ */
 static int
-epoll_register( int  epoll_fd, int  fd )
+gps_server_open( GpsServer*  s, const char*  name, int  feeds )
 {
-    struct epoll_event  ev;
-    int                 ret, flags;
+    int  n;
 
-    /* important: make the fd non-blocking */
-    flags = fcntl(fd, F_GETFL);
-    fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+    if (name[0] == '/') {
+        struct sockaddr_un  addr;
 
-    ev.events  = EPOLLIN;
-    ev.data.fd = fd;
-    do {
-        ret = epoll_ctl( epoll_fd, EPOLL_CTL_ADD, fd, &ev );
-    } while (ret < 0 && errno == EINTR);
-    return ret;
+        if (strlen(name) >= sizeof(addr.sun_path)) {
+            ALOGE("server socket path too long: %s", name);
+            return -1;
+        }
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_LOCAL;
+        strcpy(addr.sun_path, name);
+
+        s->fd = socket(AF_LOCAL, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (s->fd >= 0) {
+            unlink(name);
+            // nobody can connect before listen(), so chmod() is not late
+            if (bind(s->fd, (struct sockaddr*) &addr, sizeof(addr)) < 0 ||
+                chmod(name, GPS_SERVER_MODE) < 0) {
+                close(s->fd);
+                s->fd = -1;
+            }
+        }
+    } else {
+        s->fd = android_get_control_socket(name);
+        if (s->fd < 0) {
+            ALOGE("no socket '%s' from init, declare it in the HAL service", name);
+            return -1;
+        }
+    }
+
+    if (s->fd < 0 || listen(s->fd, GPS_SERVER_CLIENTS) < 0) {
+        ALOGE("could not serve GPS data on %s: %s", name, strerror(errno));
+        if (s->fd >= 0)
+            close(s->fd);
+        s->fd = -1;
+        return -1;
+    }
+
+    s->feeds    = feeds;
+    s->count    = 0;
+    s->epoll_fd = -1;
+    for (n = 0; n < GPS_SERVER_CLIENTS; n++)
+        s->clients[n].fd = -1;
+
+    D("serving GPS data on %s", name);
+    return 0;
 }
 
 
-/* this is the main thread, it waits for commands from gps_state_start/stop and,
- * when started, messages from the QEMU GPS daemon. these are simple NMEA sentences
- * that must be parsed to be converted into GPS fixes sent to the framework
- */
 static void
-gps_state_thread( void*  arg )
+gps_server_drop( GpsServer*  s, GpsServerClient*  c, const char*  why )
 {
-    GpsState*   state = (GpsState*) arg;
-    NmeaReader  reader[1];
-    int         epoll_fd   = epoll_create(2);
-    int         started    = 0;
-    int         gps_fd     = state->fd;
-    int         control_fd = state->control[1];
+    D("server client %d dropped: %s, %u messages skipped", c->fd, why, c->skipped);
+    if (s->epoll_fd >= 0)
+        epoll_ctl(s->epoll_fd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    free(c->ring);
+    c->fd   = -1;
+    c->ring = NULL;
+    s->count -= 1;
+}
 
-    nmea_reader_init( reader );
 
-    // register control file descriptors for polling
-    epoll_register( epoll_fd, control_fd );
-    epoll_register( epoll_fd, gps_fd );
+static void
+gps_server_close( GpsServer*  s )
+{
+    int  n;
 
-    D("GPS thread running");
+    if (s->fd < 0)
+        return;
 
-    // now loop
-    for (;;) {
-        struct epoll_event   events[2];
-        int                  ne, nevents;
+    for (n = 0; n < GPS_SERVER_CLIENTS; n++)
+        if (s->clients[n].fd >= 0)
+            gps_server_drop(s, &s->clients[n], "closing");
 
-        nevents = epoll_wait( epoll_fd, events, 2, -1 );
-        if (nevents < 0) {
-            if (errno != EINTR)
-                ALOGE("epoll_wait() unexpected error: %s", strerror(errno));
-            continue;
-        }
-        for (ne = 0; ne < nevents; ne++) {
-            if ((events[ne].events & (EPOLLERR|EPOLLHUP)) != 0) {
-                ALOGE("EPOLLERR or EPOLLHUP after epoll_wait() !?");
-                return;
-            }
-            if ((events[ne].events & EPOLLIN) != 0) {
-                int  fd = events[ne].data.fd;
+    close(s->fd);
+    s->fd       = -1;
+    s->epoll_fd = -1;
+}
 
-                if (fd == control_fd) {
-                    char  cmd = 255;
-                    int   ret;
-                    D("GPS control fd event");
-                    do {
-                        ret = read( fd, &cmd, 1 );
-                    } while (ret < 0 && errno == EINTR);
 
-                    if (cmd == CMD_QUIT) {
-                        D("GPS thread quitting on demand");
-                        return;
-                    } else if (cmd == CMD_START) {
-                        if (!started) {
-                            D("GPS thread starting  location_cb=%p", state->callbacks->location_cb);
-                            started = 1;
-                            update_gps_status(GPS_STATUS_SESSION_BEGIN);
-                            gps_dev_set_meas_rate(state->fd, period_in_ms);
-                        }
+static void
+gps_server_poll( GpsServer*  s, GpsServerClient*  c, int  polling )
+{
+    struct epoll_event  ev;
+
+    if (c->polling == polling)
+        return;
+
+    ev.events  = EPOLLIN | (polling ? EPOLLOUT : 0);
+    ev.data.fd = c->fd;
+    epoll_ctl(s->epoll_fd, EPOLL_CTL_MOD, c->fd, &ev);
+    c->polling = polling;
+}
+
+
+/* write what the client ring holds, returns -1 if the client is gone */
+static int
+gps_server_flush( GpsServer*  s, GpsServerClient*  c, int64_t  now )
+{
+    while (c->head != c->tail) {
+        unsigned  from = c->tail & GPS_SERVER_MASK;
+        unsigned  len  = c->head - c->tail;
+        int       ret;
+
+        if (len > GPS_SERVER_RING - from)
+            len = GPS_SERVER_RING - from;
+
+        ret = send(c->fd, c->ring + from, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            gps_server_drop(s, c, strerror(errno));
+            return -1;
+        }
+        c->tail    += ret;
+        c->progress = now;
+    }
+
+    gps_server_poll(s, c, c->head != c->tail);
+    return 0;
+}
+
+
+static void
+gps_server_send( GpsServer*  s, GpsServerClient*  c, const char*  data, unsigned  len, int64_t  now )
+{
+    unsigned  pos, part;
+
+    // nothing waiting: try the socket first
+    while (c->head == c->tail && len > 0) {
+        int  ret = send(c->fd, data, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            gps_server_drop(s, c, strerror(errno));
+            return;
+        }
+        c->progress = now;
+        data += ret;
+        len  -= ret;
+    }
+    if (len == 0)
+        return;
+
+    if (len > GPS_SERVER_RING - (c->head - c->tail)) {
+        c->skipped += 1;
+        if (now - c->progress > GPS_SERVER_STALL_MS * 1000000LL)
+            gps_server_drop(s, c, "not reading");
+        return;
+    }
+
+    pos  = c->head & GPS_SERVER_MASK;
+    part = (len < GPS_SERVER_RING - pos) ? len : GPS_SERVER_RING - pos;
+    memcpy(c->ring + pos, data, part);
+    memcpy(c->ring, data + part, len - part);
+    c->head += len;
+
+    gps_server_poll(s, c, 1);
+}
+
+
+/* send a message to every client, from the GPS thread */
+static void
+gps_server_publish( GpsServer*  s, const char*  data, int  len, int64_t  now )
+{
+    int  n;
+
+    for (n = 0; n < GPS_SERVER_CLIENTS; n++)
+        if (s->clients[n].fd >= 0)
+            gps_server_send(s, &s->clients[n], data, (unsigned) len, now);
+}
+
+
+static void
+gps_server_publish_fix( GpsServer*  s, const GpsLocation*  l, int64_t  now )
+{
+    char           msg[160];
+    char*          p   = msg;
+    char*          end = msg + sizeof(msg) - 5;     // room for the checksum
+    unsigned char  sum = 0;
+    const char*    q;
+
+    p += snprintf(p, end-p, "$PSGPS,FIX,%lld,%.7f,%.7f,",
+                  (long long) l->timestamp, l->latitude, l->longitude);
+    if (l->flags & GPS_LOCATION_HAS_ALTITUDE)
+        p += snprintf(p, end-p, "%.1f", l->altitude);
+    p += snprintf(p, end-p, ",");
+    if (l->flags & GPS_LOCATION_HAS_SPEED)
+        p += snprintf(p, end-p, "%.2f", l->speed);
+    p += snprintf(p, end-p, ",");
+    if (l->flags & GPS_LOCATION_HAS_BEARING)
+        p += snprintf(p, end-p, "%.1f", l->bearing);
+    p += snprintf(p, end-p, ",");
+    if (l->flags & GPS_LOCATION_HAS_ACCURACY)
+        p += snprintf(p, end-p, "%.1f", l->accuracy);
+
+    for (q = msg + 1; q < p; q++)
+        sum ^= (unsigned char) *q;
+    p += snprintf(p, msg + sizeof(msg) - p, "*%02X\r\n", sum);
+
+    gps_server_publish(s, msg, p - msg, now);
+}
+
+
+static void
+gps_server_accept( GpsServer*  s, int64_t  now )
+{
+    GpsServerClient*  c = NULL;
+    struct epoll_event  ev;
+    int  fd, n;
+
+    do {
+        fd = accept(s->fd, NULL, NULL);
+    } while (fd < 0 && errno == EINTR);
+    if (fd < 0)
+        return;
+    fcntl(fd, F_SETFD, FD_CLOEXEC);     // all the i/o is MSG_DONTWAIT
+
+    for (n = 0; n < GPS_SERVER_CLIENTS && c == NULL; n++)
+        if (s->clients[n].fd < 0)
+            c = &s->clients[n];
+
+    if (c == NULL) {
+        ALOGW("too many server clients, %d refused", fd);
+        close(fd);
+        return;
+    }
+
+    memset(c, 0, sizeof(*c));
+    c->ring = malloc(GPS_SERVER_RING);
+    ev.events  = EPOLLIN;
+    ev.data.fd = fd;
+    if (c->ring == NULL || epoll_ctl(s->epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        ALOGE("could not add server client: %s", strerror(errno));
+        free(c->ring);
+        c->ring = NULL;
+        c->fd   = -1;
+        close(fd);
+        return;
+    }
+    c->fd       = fd;
+    c->progress = now;
+    s->count   += 1;
+    D("server client %d connected, %d clients", fd, s->count);
+}
+
+
+/* handle an epoll event of the GPS thread, returns 0 if the file
+ * descriptor is not one of the server.
+ */
+static int
+gps_server_event( GpsServer*  s, int  fd, unsigned  events, int64_t  now )
+{
+    GpsServerClient*  c = NULL;
+    int  n;
+
+    if (s->fd < 0)
+        return 0;
+
+    if (fd == s->fd) {
+        gps_server_accept(s, now);
+        return 1;
+    }
+
+    for (n = 0; n < GPS_SERVER_CLIENTS && c == NULL; n++)
+        if (s->clients[n].fd == fd)
+            c = &s->clients[n];
+    if (c == NULL)
+        return 0;
+
+    if (events & EPOLLIN) {
+        // clients have nothing to say, only the end of the stream matters
+        char  buff[64];
+        int   ret;
+
+        do {
+            ret = recv(fd, buff, sizeof(buff), MSG_DONTWAIT);
+        } while (ret > 0 || (ret < 0 && errno == EINTR));
+
+        if (ret == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+            gps_server_drop(s, c, "disconnected");
+            return 1;
+        }
+    }
+    if (events & (EPOLLERR | EPOLLHUP)) {
+        gps_server_drop(s, c, "hung up");
+        return 1;
+    }
+    if (events & EPOLLOUT)
+        gps_server_flush(s, c, now);
+
+    return 1;
+}
+
+
+/*****************************************************************/
+/*****************************************************************/
+/*****                                                       *****/
+/*****       N M E A   P A R S E R                           *****/
+/*****                                                       *****/
+/*****************************************************************/
+/*****************************************************************/
+
+/* UBX frames: sync chars, class, id, 16-bit length, payload, 2 checksum
+ * bytes. the payload limit leaves room for a NAV-SAT with 84 satellites.
+ */
+#define  UBX_SYNC_CHAR1    0xB5
+#define  UBX_SYNC_CHAR2    0x62
+#define  UBX_HEADER_SIZE   6
+#define  UBX_MAX_PAYLOAD   1024
+#define  UBX_MAX_SIZE      (UBX_HEADER_SIZE + UBX_MAX_PAYLOAD + 2)
+
+/* the sentences of one measurement epoch are merged into a single fix,
+ * reported when the epoch closes: when a sentence with another UTC time
+ * arrives, after the configured end-of-epoch sentence, or when the
+ * receiver has sent nothing for GPS_EPOCH_IDLE_MS after it.
+ */
+typedef struct {
+    int     time;       // UTC time of day (ms) of the open epoch, or -1
+    int     closed;     // UTC time of day (ms) of the last closed epoch
+    int     mode;       // GSA fix mode: 1=none, 2=2D, 3=3D, 0=unknown
+    float   hdop;       // HDOP of a valid fix, 0 if unknown
+    float   accuracy;   // GST horizontal error (m), 0 if unknown
+    int64_t stamp;      // read time of the first sentence of the epoch, or -1
+} NmeaEpoch;
+
+/* the satellites are kept per constellation, in slots numbered from 1
+ * (see gnss_sv_slot()), with a bit per slot for the satellites in view and
+ * those used in the fix. the used set is merged from all the GSA of an
+ * epoch, whatever their talker, and the status is reported when the epoch
+ * closes.
+ *
+ * there are two sets: the one last reported, and the one the epoch fills.
+ * the new set is only reported if it differs from the last one, or when
+ * the refresh interval is over, and then becomes the reference set.
+ */
+#define  GNSS_CONSTELLATIONS  (GNSS_CONSTELLATION_GALILEO+1)
+#define  GNSS_SLOTS           64
+
+typedef struct {
+    float   snr;
+    float   elevation;
+    float   azimuth;
+} NmeaSv;
+
+typedef struct {
+    uint64_t  view[ GNSS_CONSTELLATIONS ];    // in view
+    uint64_t  used[ GNSS_CONSTELLATIONS ];    // used in the fix, when reported
+    NmeaSv    sv[ GNSS_CONSTELLATIONS ][ GNSS_SLOTS ];
+} NmeaSvSet;
+
+typedef struct {
+    NmeaSvSet  set[2];    // set[front] was reported last, the other one is filled
+    int        front;
+    uint64_t   used[ GNSS_CONSTELLATIONS ];    // used in the last fix
+    uint64_t   fixing[ GNSS_CONSTELLATIONS ];  // in the GSA of this epoch
+    int        gsa;       // a GSA was seen in this epoch
+    int        gsv;       // a GSV was seen in this epoch
+    unsigned   cycles;    // talkers whose GSV cycle was seen in this epoch
+    int64_t    reported;  // read time (ns) of the last report, or -1
+} NmeaSvTable;
+
+#define  SV_FILL(t)   (&(t)->set[ (t)->front ^ 1 ])
+
+/* with ro.kernel.android.gps.rate_tiers, the receiver measures faster when
+ * the device moves, and slower when it stays still. a faster tier is taken
+ * as soon as the fixes call for it, a slower one only once they did for a
+ * while.
+ */
+enum {
+    GPS_RATE_FAST = 0,
+    GPS_RATE_NORMAL,
+    GPS_RATE_STILL,
+    GPS_RATE_TIERS
+};
+
+#define  MOTION_FAST_SPEED        5.0f    /* m/s to move to the fast tier */
+#define  MOTION_FAST_TURN         15.0f   /* deg/s to move to the fast tier */
+#define  MOTION_FAST_KEEP_SPEED   3.0f    /* m/s to stay in the fast tier */
+#define  MOTION_FAST_KEEP_TURN    10.0f   /* deg/s to stay in the fast tier */
+#define  MOTION_TURN_MIN_SPEED    1.0f    /* m/s for the bearing to be meaningful */
+#define  MOTION_STILL_SPEED       0.5f    /* m/s to move to the still tier */
+#define  MOTION_STILL_KEEP_SPEED  1.0f    /* m/s to stay in the still tier */
+#define  MOTION_STILL_ACCURACY    25.0f   /* m, worse fixes do not tell still */
+
+static const int  motion_dwell_ms[ GPS_RATE_TIERS ] = {
+    10000,  /* fast, before slowing down */
+    30000,  /* normal, before going still */
+    0,
+};
+
+typedef struct {
+    int      tier;          // GPS_RATE_* the fixes call for
+    int      changed;       // tier changed since the GPS thread applied it
+    int64_t  slower;        // UTC time (ms) since which a slower tier is wanted, or -1
+    float    bearing;       // of the last fix moving fast enough to have one
+    int64_t  bearing_time;  // UTC time (ms) of that fix, or -1
+} NmeaMotion;
+
+typedef struct {
+    int     utc_date;   // current UTC date as yyyymmdd, 0 if unknown
+    int     utc_tod;    // UTC time of day (ms) of the last time field
+    int64_t utc_base;   // UTC time (ms) of the midnight starting utc_date
+    NmeaEpoch  epoch;
+    unsigned  bad_checksum; // sentences rejected by the checksum test
+    int64_t   stamp;        // CLOCK_BOOTTIME (ns) at which the current sentence was read
+    int64_t   wall_offset;  // CLOCK_REALTIME - CLOCK_BOOTTIME (ns) at that read
+    int       fix_interval; // ms between the fixes reported, 0 to report them all
+    int       fix_slack;    // ms a fix may come early and still be reported
+    int64_t   fix_last;     // UTC time (ms) of the last fix reported, or -1
+    int       adaptive;     // the rate follows motion.tier
+    GpsBatch* batch;        // stores the fixes when batching, or NULL
+    int       batch_only;   // batching outside a session: fixes are only stored
+    GpsServer* server;      // local clients to copy the data to, or NULL
+    NmeaMotion   motion;
+    GpsLocation  fix;
+    NmeaSvTable  svs;
+    int     system;     // GNSS_CONSTELLATION_* of the talker of the current sentence
+    gps_location_callback  callback;
+    char    in[ NMEA_MAX_SIZE+1 ];          // a sentence that wraps the framer ring
+    unsigned char  ubx[ UBX_MAX_SIZE ];     // a UBX frame that wraps the framer ring
+} NmeaReader;
+
+
+/* days since 1970-01-01 of a proleptic gregorian date */
+static int64_t
+utc_days_from_civil( int  year, int  mon, int  day )
+{
+    int       y   = year - (mon <= 2);
+    int       era = (y >= 0 ? y : y - 399) / 400;
+    unsigned  yoe = (unsigned)(y - era * 400);
+    unsigned  doy = (153 * (mon + (mon > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+    unsigned  doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+
+    return (int64_t) era * 146097 + (int64_t) doe - 719468;
+}
+
+
+static void
+nmea_reader_init( NmeaReader*  r )
+{
+    memset( r, 0, sizeof(*r) );
+
+    r->utc_date = 0;
+    r->utc_tod  = -1;
+    r->epoch.time   = -1;
+    r->epoch.closed = -1;
+    r->epoch.stamp  = -1;
+    r->stamp        = -1;
+    r->svs.reported = -1;
+    r->fix_last     = -1;
+    r->motion.tier         = GPS_RATE_NORMAL;
+    r->motion.slower       = -1;
+    r->motion.bearing_time = -1;
+    r->callback = NULL;
+    r->fix.size = sizeof(r->fix);
+
+    //nmea_reader_update_utc_diff( r );
+}
+
+
+/* set the UTC date of the following time fields. the day base is only
+ * recomputed when the date actually changes.
+ */
+static void
+nmea_reader_set_date( NmeaReader*  r, int  year, int  mon, int  day )
+{
+    int  date = (year * 100 + mon) * 100 + day;
+
+    if (date == r->utc_date)
+        return;
+
+    r->utc_date = date;
+    r->utc_base = utc_days_from_civil(year, mon, day) * 86400000LL;
+    r->utc_tod  = -1;   // the new day is already counted, not a wrap
+}
+
+
+/* set the fix timestamp from a hhmmss[.sss] field and the current date */
+static int
+nmea_reader_update_time( NmeaReader*  r, Token  tok, int64_t*  ms )
+{
+    int  tod = str2tod(tok.p, tok.end);
+
+    if (tod < 0)
+        return -1;
+
+    if (r->utc_date == 0) {
+        // no date yet, get current one
+        struct tm  tm;
+        time_t     now = time(NULL);
+        gmtime_r( &now, &tm );
+        nmea_reader_set_date(r, tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday);
+    } else if (tod + 43200000 < r->utc_tod) {
+        // the time of day wrapped before the next date: midnight passed
+        r->utc_date  = -1;
+        r->utc_base += 86400000LL;
+    }
+
+    r->utc_tod       = tod;
+    *ms              = r->utc_base + tod;
+    r->fix.timestamp = *ms;
+    return 0;
+}
+
+
+static void
+nmea_reader_sync_time( int64_t  ms )
+{
+    if (0 < time_sync)
+    {
+        time_t gmt = (time_t) (ms / 1000);
+        long dif = (long) (time(NULL) - gmt);
+        if (dif < -time_sync || time_sync < dif)
+        {
+            D("System time synchronized with the GPS");
+            struct timeval tv = { gmt, (ms % 1000) * 1000 };
+            settimeofday(&tv, NULL);
+        }
+    }
+}
+
+
+static int
+nmea_reader_update_date( NmeaReader*  r, Token  date_tok, Token  time_tok )
+{
+    Token  tok = date_tok;
+    int    day, mon, year;
+
+    if (tok.p + 6 != tok.end) {
+        D("Date not properly formatted: '%.*s'", tok.end-tok.p, tok.p);
+        return -1;
+    }
+    day  = str2int(tok.p, tok.p+2);
+    mon  = str2int(tok.p+2, tok.p+4);
+    year = str2int(tok.p+4, tok.p+6) + 2000;
+
+    if ((day|mon|year) < 0) {
+        D("Date not properly formatted: '%.*s'", tok.end-tok.p, tok.p);
+        return -1;
+    }
+
+    nmea_reader_set_date(r, year, mon, day);
+
+    int64_t ms;
+    int result = nmea_reader_update_time( r, time_tok, &ms );
+
+    if (result == 0)
+        nmea_reader_sync_time( ms );
+
+    return result;
+}
+
+
+/* convert a ddmm.mmmm (or dddmm.mmmm) field into nano-degrees, using
+ * integer arithmetic only.
+ */
+static int
+convert_from_hhmm( Token  tok, int64_t*  nanodeg )
+{
+    NmeaFixed  f;
+    int64_t    minutes, degrees;
+
+    if (str2fixed(tok.p, tok.end, &f) < 0 || f.mant < 0)
+        return -1;
+
+    // minutes in 10^-9 units. a degree count too large for them is garbage
+    if (fixed_rescale(f, 9, &minutes) < 0)
+        return -1;
+    degrees  = minutes / 100000000000LL;
+    minutes -= degrees * 100000000000LL;
+
+    *nanodeg = degrees * 1000000000LL + (minutes + 30) / 60;
+    return 0;
+}
+
+
+static int
+nmea_reader_update_latlong( NmeaReader*  r,
+                            Token        latitude,
+                            char         latitudeHemi,
+                            Token        longitude,
+                            char         longitudeHemi )
+{
+    int64_t  lat, lon;
+    Token    tok;
+
+    tok = latitude;
+    if (tok.p + 6 > tok.end || convert_from_hhmm(tok, &lat) < 0) {
+        D("Latitude is too short: '%.*s'", tok.end-tok.p, tok.p);
+        return -1;
+    }
+    if (latitudeHemi == 'S')
+        lat = -lat;
+
+    tok = longitude;
+    if (tok.p + 6 > tok.end || convert_from_hhmm(tok, &lon) < 0) {
+        D("Longitude is too short: '%.*s'", tok.end-tok.p, tok.p);
+        return -1;
+    }
+    if (longitudeHemi == 'W')
+        lon = -lon;
+
+    r->fix.flags    |= GPS_LOCATION_HAS_LAT_LONG;
+    r->fix.latitude  = lat / 1e9;
+    r->fix.longitude = lon / 1e9;
+    return 0;
+}
+
+
+static int
+nmea_reader_update_altitude( NmeaReader*  r,
+                             Token        altitude,
+                             Token        units )
+{
+    //double  alt;
+    Token   tok = altitude;
+
+    if (tok.p >= tok.end)
+        return -1;
+
+    r->fix.flags   |= GPS_LOCATION_HAS_ALTITUDE;
+    r->fix.altitude = str2float(tok.p, tok.end);
+    return 0;
+}
+
+
+static int nmea_reader_update_accuracy(NmeaReader* r, Token accuracy, bool is_fix)
+{
+    //double  acc;
+    Token   tok = accuracy;
+    float   hdop;
+
+    if (tok.p >= tok.end)
+        return -1;
+
+    hdop = (float) str2float(tok.p, tok.end);
+    if (99.0f < hdop || !is_fix)
+        return 0;
+
+    r->epoch.hdop = hdop;
+    return 0;
+}
+
+
+static int
+nmea_reader_update_bearing( NmeaReader*  r,
+                            Token        bearing )
+{
+    //double  alt;
+    Token   tok = bearing;
+
+    if (tok.p >= tok.end)
+        return -1;
+
+    r->fix.flags   |= GPS_LOCATION_HAS_BEARING;
+    r->fix.bearing  = str2float(tok.p, tok.end);
+    return 0;
+}
+
+
+static int
+nmea_reader_update_speed( NmeaReader*  r,
+                          Token        speed )
+{
+    //double  alt;
+    Token   tok = speed;
+
+    if (tok.p >= tok.end)
+        return -1;
+
+    r->fix.flags |= GPS_LOCATION_HAS_SPEED;
+    r->fix.speed = (float) (str2float(tok.p, tok.end) * (1.852 / 3.6));
+    return 0;
+}
+
+
+/* slot of a satellite in its constellation table, 0 if out of range */
+static int
+gnss_sv_slot( int  constellation, int  svid )
+{
+    switch (constellation) {
+    case GNSS_CONSTELLATION_SBAS:   svid -= 119; break;     // 120-158
+    case GNSS_CONSTELLATION_QZSS:   svid -= 192; break;     // 193-200
+    case GNSS_CONSTELLATION_GPS:
+    case GNSS_CONSTELLATION_GLONASS:
+    case GNSS_CONSTELLATION_BEIDOU:
+    case GNSS_CONSTELLATION_GALILEO: break;
+    default: return 0;
+    }
+    return (0 < svid && svid < GNSS_SLOTS) ? svid : 0;
+}
+
+
+/* inverse of gnss_sv_slot() */
+static int
+gnss_slot_svid( int  constellation, int  slot )
+{
+    switch (constellation) {
+    case GNSS_CONSTELLATION_SBAS:   return slot + 119;
+    case GNSS_CONSTELLATION_QZSS:   return slot + 192;
+    }
+    return slot;
+}
+
+
+/* the satellite number used by the legacy GpsSvInfo (NMEA 4.0 ranges) */
+static int
+gnss_slot_prn( int  constellation, int  slot )
+{
+    switch (constellation) {
+    case GNSS_CONSTELLATION_SBAS:    return slot + 32;      // 33-64
+    case GNSS_CONSTELLATION_GLONASS: return slot + 64;      // 65-96
+    case GNSS_CONSTELLATION_QZSS:    return slot + 192;     // 193-200
+    case GNSS_CONSTELLATION_BEIDOU:  return slot + 200;     // 201-263
+    case GNSS_CONSTELLATION_GALILEO: return slot + 300;     // 301-363
+    }
+    return slot;
+}
+
+
+/* constellation of an NMEA talker, 0 for GP/GN which mix them */
+static int
+nmea_talker_system( const char*  talker )
+{
+    switch (talker[0] << 8 | talker[1]) {
+    case 'G' << 8 | 'L':    return GNSS_CONSTELLATION_GLONASS;
+    case 'G' << 8 | 'A':    return GNSS_CONSTELLATION_GALILEO;
+    case 'G' << 8 | 'B':
+    case 'B' << 8 | 'D':    return GNSS_CONSTELLATION_BEIDOU;
+    case 'G' << 8 | 'Q':
+    case 'Q' << 8 | 'Z':    return GNSS_CONSTELLATION_QZSS;
+    }
+    return GNSS_CONSTELLATION_UNKNOWN;
+}
+
+
+/* map an NMEA satellite number to its constellation and slot. 'system'
+ * is the constellation of the talker, which the NMEA 4.10 numbering
+ * (1-based in each system) needs; GP and GN talkers use the NMEA 4.0
+ * ranges. returns the constellation, or 0 when the number is unknown.
+ */
+static int
+nmea_sv_lookup( int  system, int  prn, int*  slot )
+{
+    int  c = GNSS_CONSTELLATION_UNKNOWN, svid = prn;
+
+    if (prn <= 0)
+        return 0;
+
+    switch (system) {
+    case GNSS_CONSTELLATION_GLONASS:
+        if (prn <= 32) c = system;
+        break;
+    case GNSS_CONSTELLATION_GALILEO:
+    case GNSS_CONSTELLATION_BEIDOU:
+        if (prn < GNSS_SLOTS) c = system;
+        break;
+    case GNSS_CONSTELLATION_QZSS:
+        if (prn <= 10) c = system, svid = prn + 192;
+        break;
+    }
+
+    if (c == GNSS_CONSTELLATION_UNKNOWN) {
+        if (prn <= 32)                      c = GNSS_CONSTELLATION_GPS;
+        else if (prn <= 64)                 c = GNSS_CONSTELLATION_SBAS,    svid = prn + 87;
+        else if (prn <= 96)                 c = GNSS_CONSTELLATION_GLONASS, svid = prn - 64;
+        else if (120 <= prn && prn <= 158)  c = GNSS_CONSTELLATION_SBAS;
+        else if (193 <= prn && prn <= 200)  c = GNSS_CONSTELLATION_QZSS;
+        else if (201 <= prn && prn <= 263)  c = GNSS_CONSTELLATION_BEIDOU,  svid = prn - 200;
+        else if (301 <= prn && prn <= 363)  c = GNSS_CONSTELLATION_GALILEO, svid = prn - 300;
+        else if (401 <= prn && prn <= 463)  c = GNSS_CONSTELLATION_BEIDOU,  svid = prn - 400;
+        else return 0;
+    }
+
+    *slot = gnss_sv_slot(c, svid);
+    return (*slot) ? c : 0;
+}
+
+
+/* tell whether a satellite set differs from the one last reported: other
+ * satellites in view or used in the fix, or a signal strength that moved
+ * by more than the configured tolerance.
+ */
+static int
+nmea_sv_set_changed( const NmeaSvSet*  s, const NmeaSvSet*  last )
+{
+    int  c;
+
+    for (c = 1; c < GNSS_CONSTELLATIONS; c++) {
+        uint64_t  bits;
+
+        if (s->view[c] != last->view[c] || s->used[c] != last->used[c])
+            return 1;
+
+        for (bits = s->view[c]; bits; bits &= bits - 1) {
+            int  slot = __builtin_ctzll(bits);
+
+            if (fabsf(s->sv[c][slot].snr - last->sv[c][slot].snr) > sv_snr_tolerance)
+                return 1;
+        }
+    }
+    return 0;
+}
+
+
+/* report the satellites seen in this epoch, and start a new set */
+static void
+nmea_reader_report_svs( NmeaReader*  r )
+{
+    NmeaSvTable*    t  = &r->svs;
+    NmeaSvSet*      s  = SV_FILL(t);
+    GpsCallbacks*   cb = _gps_state->callbacks;
+    int             c;
+
+    if (t->gsa) {
+        memcpy(t->used, t->fixing, sizeof(t->used));
+        memset(t->fixing, 0, sizeof(t->fixing));
+        t->gsa = 0;
+    }
+
+    if (!t->gsv)
+        return;
+
+    memcpy(s->used, t->used, sizeof(s->used));
+    if (sv_refresh_ms > 0 && t->reported >= 0 &&
+        r->stamp - t->reported < sv_refresh_ms * 1000000LL &&
+        !nmea_sv_set_changed(s, &t->set[t->front]))
+        goto next;
+
+    if (cb && cb->size >= sizeof(GpsCallbacks) && cb->gnss_sv_status_cb) {
+        GnssSvStatus  status;
+
+        status.size    = sizeof(status);
+        status.num_svs = 0;
+        for (c = 1; c < GNSS_CONSTELLATIONS; c++) {
+            uint64_t  bits;
+
+            for (bits = s->view[c]; bits && status.num_svs < GNSS_MAX_SVS; bits &= bits - 1) {
+                int          slot = __builtin_ctzll(bits);
+                GnssSvInfo*  info = &status.gnss_sv_list[status.num_svs++];
+
+                info->size          = sizeof(*info);
+                info->svid          = gnss_slot_svid(c, slot);
+                info->constellation = c;
+                info->c_n0_dbhz     = s->sv[c][slot].snr;
+                info->elevation     = s->sv[c][slot].elevation;
+                info->azimuth       = s->sv[c][slot].azimuth;
+                info->flags         = (s->used[c] >> slot & 1) ? GNSS_SV_FLAGS_USED_IN_FIX
+                                                               : GNSS_SV_FLAGS_NONE;
+            }
+        }
+        update_gnss_svstatus(&status);
+    } else {
+        GpsSvStatus  status;
+
+        memset(&status, 0, sizeof(status));
+        status.size = sizeof(status);
+        for (c = 1; c < GNSS_CONSTELLATIONS; c++) {
+            uint64_t  bits;
+
+            for (bits = s->view[c]; bits && status.num_svs < GPS_MAX_SVS; bits &= bits - 1) {
+                int         slot = __builtin_ctzll(bits);
+                GpsSvInfo*  info = &status.sv_list[status.num_svs++];
+
+                info->size      = sizeof(*info);
+                info->prn       = gnss_slot_prn(c, slot);
+                info->snr       = s->sv[c][slot].snr;
+                info->elevation = s->sv[c][slot].elevation;
+                info->azimuth   = s->sv[c][slot].azimuth;
+            }
+        }
+        // the legacy mask has a bit per GPS satellite, slot 1 in bit 0
+        status.used_in_fix_mask = (uint32_t)(s->used[GNSS_CONSTELLATION_GPS] >> 1);
+        update_gps_svstatus(&status);
+    }
+
+    // the set just reported is the reference for the next ones
+    t->front   ^= 1;
+    t->reported = r->stamp;
+    s = SV_FILL(t);
+
+next:
+    memset(s->view, 0, sizeof(s->view));
+    t->gsv    = 0;
+    t->cycles = 0;
+}
+
+
+/* pick the rate tier from the speed, turn rate and accuracy of a fix */
+static void
+nmea_reader_update_motion( NmeaReader*  r )
+{
+    NmeaMotion*         m = &r->motion;
+    const GpsLocation*  f = &r->fix;
+    float               turn = 0;
+    int                 want;
+
+    if (!(f->flags & GPS_LOCATION_HAS_SPEED))
+        return;
+
+    if ((f->flags & GPS_LOCATION_HAS_BEARING) && f->speed >= MOTION_TURN_MIN_SPEED) {
+        if (m->bearing_time >= 0 && f->timestamp > m->bearing_time) {
+            float  d = fabsf(f->bearing - m->bearing);
+
+            if (d > 180)
+                d = 360 - d;
+            turn = d * 1000 / (f->timestamp - m->bearing_time);
+        }
+        m->bearing      = f->bearing;
+        m->bearing_time = f->timestamp;
+    } else {
+        m->bearing_time = -1;
+    }
+
+    if (f->speed >= MOTION_FAST_SPEED || turn >= MOTION_FAST_TURN ||
+        (m->tier == GPS_RATE_FAST &&
+         (f->speed >= MOTION_FAST_KEEP_SPEED || turn >= MOTION_FAST_KEEP_TURN)))
+        want = GPS_RATE_FAST;
+    else if ((f->speed < MOTION_STILL_SPEED && (f->flags & GPS_LOCATION_HAS_ACCURACY) &&
+              f->accuracy <= MOTION_STILL_ACCURACY) ||
+             (m->tier == GPS_RATE_STILL && f->speed < MOTION_STILL_KEEP_SPEED))
+        want = GPS_RATE_STILL;
+    else
+        want = GPS_RATE_NORMAL;
+
+    if (want < m->tier) {
+        m->tier    = want;
+        m->changed = 1;
+        m->slower  = -1;
+    } else if (want == m->tier) {
+        m->slower  = -1;
+    } else if (m->slower < 0 || f->timestamp < m->slower) {
+        m->slower  = f->timestamp;
+    } else if (f->timestamp - m->slower >= motion_dwell_ms[m->tier]) {
+        // one tier at a time
+        m->tier   += 1;
+        m->changed = 1;
+        m->slower  = f->timestamp;
+    }
+}
+
+
+static void
+nmea_reader_report_fix( NmeaReader*  r )
+{
+    if (r->adaptive)
+        nmea_reader_update_motion(r);
+
+    // the receiver may not follow the requested rate, or not exactly
+    if (r->fix_interval > 0 && r->fix_last >= 0 && r->fix.timestamp >= r->fix_last &&
+        r->fix.timestamp - r->fix_last < r->fix_interval - r->fix_slack) {
+        r->fix.flags = 0;
+        return;
+    }
+    r->fix_last = r->fix.timestamp;
+
+    if (r->server && r->server->count && (r->server->feeds & GPS_SERVER_FIX) &&
+        (r->fix.flags & GPS_LOCATION_HAS_LAT_LONG))
+        gps_server_publish_fix(r->server, &r->fix, r->stamp);
+
+    if (r->batch) {
+        gps_batch_add(r->batch, &r->fix);
+        if (r->batch_only) {
+            r->fix.flags = 0;
+            return;
+        }
+    }
+
+#if GPS_DEBUG
+    if (r->fix.flags) {
+
+        char   temp[256];
+        char*  p   = temp;
+        char*  end = p + sizeof(temp);
+        struct tm   utc;
+
+        p += snprintf( p, end-p, "Sending fix" );
+        if (r->fix.flags & GPS_LOCATION_HAS_LAT_LONG) {
+            p += snprintf(p, end-p, " lat=%g lon=%g", r->fix.latitude, r->fix.longitude);
+        }
+        if (r->fix.flags & GPS_LOCATION_HAS_ALTITUDE) {
+            p += snprintf(p, end-p, " altitude=%g", r->fix.altitude);
+        }
+        if (r->fix.flags & GPS_LOCATION_HAS_SPEED) {
+            p += snprintf(p, end-p, " speed=%g", r->fix.speed);
+        }
+        if (r->fix.flags & GPS_LOCATION_HAS_BEARING) {
+            p += snprintf(p, end-p, " bearing=%g", r->fix.bearing);
+        }
+        if (r->fix.flags & GPS_LOCATION_HAS_ACCURACY) {
+            p += snprintf(p,end-p, " accuracy=%g", r->fix.accuracy);
+        }
+        gmtime_r( (time_t*) &r->fix.timestamp, &utc );
+        p += snprintf(p, end-p, " time=%s", asctime( &utc ) );
+        D("%s\n", temp);
+    }
+#endif
+    if (_gps_state->callbacks->location_cb)
+        update_gps_location(&r->fix, (r->epoch.stamp >= 0) ? r->epoch.stamp : r->stamp);
+    else
+        D("No callback, fix dropped !");
+
+    r->fix.flags = 0;
+}
+
+
+/* report the fix assembled for the current epoch, and start a new one */
+static void
+nmea_reader_close_epoch( NmeaReader*  r )
+{
+    NmeaEpoch*  e = &r->epoch;
+
+    GPS_TRACE_BEGIN("epoch close");
+
+    if (e->mode == 2)
+        r->fix.flags &= ~GPS_LOCATION_HAS_ALTITUDE;
+
+    // GST reports the accuracy in meters, prefer it over the HDOP
+    if (e->accuracy > 0) {
+        r->fix.flags   |= GPS_LOCATION_HAS_ACCURACY;
+        r->fix.accuracy = e->accuracy;
+    } else if (e->hdop > 0) {
+        r->fix.flags   |= GPS_LOCATION_HAS_ACCURACY;
+        r->fix.accuracy = e->hdop;
+    }
+
+    if (r->fix.flags & GPS_LOCATION_HAS_LAT_LONG)
+        nmea_reader_report_fix(r);
+    r->fix.flags = 0;
+
+    nmea_reader_report_svs(r);
+
+    if (e->time >= 0)
+        e->closed = e->time;
+    e->time     = -1;
+    e->mode     = 0;
+    e->hdop     = 0;
+    e->accuracy = 0;
+    e->stamp    = -1;
+    GPS_TRACE_END();
+}
+
+
+/* called with the UTC time of each sentence that carries one. closes the
+ * open epoch when the time changes. returns -1 for a late sentence of an
+ * epoch that was already reported, which must then be ignored.
+ */
+static int
+nmea_reader_epoch( NmeaReader*  r, Token  tok )
+{
+    int  t = str2tod(tok.p, tok.end);
+
+    if (t < 0)
+        return 0;
+
+    if (t == r->epoch.closed && r->epoch.time < 0)
+        return -1;
+
+    if (r->epoch.time >= 0 && t != r->epoch.time)
+        nmea_reader_close_epoch(r);
+
+    if (r->epoch.stamp < 0)
+        r->epoch.stamp = r->stamp;
+    r->epoch.time = t;
+    return 0;
+}
+
+
+/* sentence handlers. each one receives the fields listed for it in the
+ * sentence table below, in the order given there, and merges them into
+ * the fix of the current epoch.
+ */
+typedef void (*NmeaHandler)( NmeaReader*  r, const Token*  f );
+
+enum { GGA_TIME, GGA_LAT, GGA_LAT_HEMI, GGA_LON, GGA_LON_HEMI, GGA_FIX,
+       GGA_HDOP, GGA_ALT, GGA_ALT_UNITS };
+
+static void
+nmea_parse_gga( NmeaReader*  r, const Token*  f )
+{
+    int fix = str2int(f[GGA_FIX].p, f[GGA_FIX].end);
+
+    if (nmea_reader_epoch(r, f[GGA_TIME]) < 0)
+        return;
+
+    if (0 < fix)
+    {
+        int64_t ms;
+        nmea_reader_update_time(r, f[GGA_TIME], &ms);
+        nmea_reader_update_latlong(r, f[GGA_LAT], f[GGA_LAT_HEMI].p[0], f[GGA_LON], f[GGA_LON_HEMI].p[0]);
+        nmea_reader_update_altitude(r, f[GGA_ALT], f[GGA_ALT_UNITS]);
+    }
+
+    // GSA reports the HDOP as well, keep the one it gives
+    if (r->epoch.hdop == 0)
+        nmea_reader_update_accuracy(r, f[GGA_HDOP], 0 < fix);
+}
+
+
+/*
+  1    = Mode:
+         M=Manual, forced to operate in 2D or 3D
+         A=Automatic, 3D/2D
+  2    = Mode:
+         1=Fix not available
+         2=2D
+         3=3D
+  3-14 = IDs of SVs used in position fix (null for unused fields)
+  15   = PDOP
+  16   = HDOP
+  17   = VDOP
+  18   = System ID (NMEA 4.10): 1=GPS, 2=GLONASS, 3=Galileo, 4=BeiDou, 5=QZSS
+*/
+enum { GSA_FIX, GSA_HDOP, GSA_SYSTEM, GSA_ID };
+
+static void
+nmea_parse_gsa( NmeaReader*  r, const Token*  f )
+{
+    static const unsigned char  systems[] = {
+        GNSS_CONSTELLATION_UNKNOWN, GNSS_CONSTELLATION_GPS, GNSS_CONSTELLATION_GLONASS,
+        GNSS_CONSTELLATION_GALILEO, GNSS_CONSTELLATION_BEIDOU, GNSS_CONSTELLATION_QZSS
+    };
+    int fix    = str2int(f[GSA_FIX].p, f[GSA_FIX].end);
+    int id     = str2int(f[GSA_SYSTEM].p, f[GSA_SYSTEM].end);
+    int system = (0 < id && id < (int) sizeof(systems)) ? systems[id] : r->system;
+    int i;
+
+    if (fix > r->epoch.mode)
+        r->epoch.mode = fix;
+
+    nmea_reader_update_accuracy(r, f[GSA_HDOP], 1 < fix);
+
+    // every GSA of the epoch adds to the used set
+    r->svs.gsa = 1;
+    for (i = 0; i < 12; i++) {
+        Token  tok_id = f[GSA_ID + i];
+        int    slot, c;
+
+        if (tok_id.end > tok_id.p) {
+            c = nmea_sv_lookup(system, str2int(tok_id.p, tok_id.end), &slot);
+            if (c)
+                r->svs.fixing[c] |= 1ull << slot;
+            D("Satellite used '%.*s'", tok_id.end - tok_id.p, tok_id.p);
+        }
+    }
+}
+
+
+/*
+1    = Total number of messages of this type in this cycle
+2    = Message number
+3    = Total number of SVs in view
+4    = SV PRN number
+5    = Elevation in degrees, 90 maximum
+6    = Azimuth, degrees from true north, 000 to 359
+7    = SNR, 00-99 dB (null when not tracking)
+8-11 = Information about second SV, same as field 4-7
+12-15= Information about third SV, same as field 4-7
+16-19= Information about fourth SV, same as field 4-7
+*/
+enum { GSV_NUM_MESSAGES, GSV_MSG_NUMBER, GSV_SVS_INVIEW, GSV_SV };
+
+static void
+nmea_parse_gsv( NmeaReader*  r, const Token*  f )
+{
+    NmeaSvTable*  t = &r->svs;
+    NmeaSvSet*    s;
+    int num_messages = str2int(f[GSV_NUM_MESSAGES].p, f[GSV_NUM_MESSAGES].end);
+    int msg_number   = str2int(f[GSV_MSG_NUMBER].p, f[GSV_MSG_NUMBER].end);
+    int svs_inview   = str2int(f[GSV_SVS_INVIEW].p, f[GSV_SVS_INVIEW].end);
+    int i;
+
+    D("GSV %d %d %d", num_messages, msg_number, svs_inview );
+    if (msg_number == 1) {
+        unsigned  talker = 1u << r->system;
+
+        // without a UTC time no epoch ever closes: a talker starting its
+        // cycle again marks the next one
+        if ((t->cycles & talker) && r->epoch.time < 0)
+            nmea_reader_report_svs(r);
+        t->cycles |= talker;
+    }
+    t->gsv = 1;
+    s = SV_FILL(t);
+
+    // the last message may have less than 4 satellites, followed by the
+    // NMEA 4.10 signal id
+    for (i = 0; i < 4 && (msg_number - 1)*4 + i < svs_inview; i++) {
+        const Token*  sv = f + GSV_SV + 4*i;
+        int           slot, c;
+
+        c = nmea_sv_lookup(r->system, str2int(sv[0].p, sv[0].end), &slot);
+        if (c == 0)
+            continue;
+
+        s->view[c] |= 1ull << slot;
+        s->sv[c][slot].elevation = (sv[1].p < sv[1].end) ? str2int(sv[1].p, sv[1].end) : 0;
+        s->sv[c][slot].azimuth   = (sv[2].p < sv[2].end) ? str2int(sv[2].p, sv[2].end) : 0;
+        s->sv[c][slot].snr       = (sv[3].p < sv[3].end) ? str2int(sv[3].p, sv[3].end) : 0;
+    }
+}
+
+
+enum { RMC_TIME, RMC_FIX_STATUS, RMC_LAT, RMC_LAT_HEMI, RMC_LON,
+       RMC_LON_HEMI, RMC_SPEED, RMC_BEARING, RMC_DATE };
+
+static void
+nmea_parse_rmc( NmeaReader*  r, const Token*  f )
+{
+    if (nmea_reader_epoch(r, f[RMC_TIME]) < 0)
+        return;
+
+    D("in RMC, fixStatus=%c", f[RMC_FIX_STATUS].p[0]);
+    if (f[RMC_FIX_STATUS].p[0] == 'A') {
+        nmea_reader_update_date( r, f[RMC_DATE], f[RMC_TIME] );
+
+        nmea_reader_update_latlong( r, f[RMC_LAT],
+                                       f[RMC_LAT_HEMI].p[0],
+                                       f[RMC_LON],
+                                       f[RMC_LON_HEMI].p[0] );
+
+        nmea_reader_update_bearing( r, f[RMC_BEARING] );
+        nmea_reader_update_speed  ( r, f[RMC_SPEED] );
+    }
+}
+
+
+enum { VTG_BEARING, VTG_SPEED, VTG_FIX_STATUS };
+
+static void
+nmea_parse_vtg( NmeaReader*  r, const Token*  f )
+{
+    if (f[VTG_FIX_STATUS].p[0] != '\0' && f[VTG_FIX_STATUS].p[0] != 'N') {
+        nmea_reader_update_bearing( r, f[VTG_BEARING] );
+        nmea_reader_update_speed  ( r, f[VTG_SPEED] );
+    }
+}
+
+
+/*
+1    = UTC time
+2-5  = Latitude, N/S, Longitude, E/W
+6    = Mode indicator, one character per constellation (N = no fix)
+7    = Number of SVs used
+8    = HDOP
+9    = Altitude above mean sea level
+*/
+enum { GNS_TIME, GNS_LAT, GNS_LAT_HEMI, GNS_LON, GNS_LON_HEMI, GNS_MODE,
+       GNS_HDOP, GNS_ALT };
+
+static void
+nmea_parse_gns( NmeaReader*  r, const Token*  f )
+{
+    const char*  m;
+    int          fix = 0;
+
+    if (nmea_reader_epoch(r, f[GNS_TIME]) < 0)
+        return;
+
+    for (m = f[GNS_MODE].p; m < f[GNS_MODE].end; m++)
+        fix |= (*m != 'N');
+
+    if (fix)
+    {
+        int64_t ms;
+        nmea_reader_update_time(r, f[GNS_TIME], &ms);
+        nmea_reader_update_latlong(r, f[GNS_LAT], f[GNS_LAT_HEMI].p[0], f[GNS_LON], f[GNS_LON_HEMI].p[0]);
+        // GNS has no units field, the altitude is always in meters
+        nmea_reader_update_altitude(r, f[GNS_ALT], f[GNS_ALT]);
+    }
+
+    if (r->epoch.hdop == 0)
+        nmea_reader_update_accuracy(r, f[GNS_HDOP], fix);
+}
+
+
+/*
+1-4  = Latitude, N/S, Longitude, E/W
+5    = UTC time
+6    = Status: A=valid, V=invalid
+*/
+enum { GLL_LAT, GLL_LAT_HEMI, GLL_LON, GLL_LON_HEMI, GLL_TIME, GLL_STATUS };
+
+static void
+nmea_parse_gll( NmeaReader*  r, const Token*  f )
+{
+    if (nmea_reader_epoch(r, f[GLL_TIME]) < 0)
+        return;
+
+    if (f[GLL_STATUS].p[0] == 'A')
+        nmea_reader_update_latlong(r, f[GLL_LAT], f[GLL_LAT_HEMI].p[0], f[GLL_LON], f[GLL_LON_HEMI].p[0]);
+}
+
+
+/*
+1    = UTC time
+2    = RMS value of the standard deviation of the ranges
+3-5  = Error ellipse: semi-major, semi-minor (m), orientation
+6    = Standard deviation of latitude error (m)
+7    = Standard deviation of longitude error (m)
+8    = Standard deviation of altitude error (m)
+*/
+enum { GST_TIME, GST_STD_LAT, GST_STD_LON };
+
+static void
+nmea_parse_gst( NmeaReader*  r, const Token*  f )
+{
+    Token  lat = f[GST_STD_LAT];
+    Token  lon = f[GST_STD_LON];
+
+    if (nmea_reader_epoch(r, f[GST_TIME]) < 0)
+        return;
+
+    if (lat.p >= lat.end || lon.p >= lon.end)
+        return;
+
+    r->epoch.accuracy = (float) hypot(str2float(lat.p, lat.end), str2float(lon.p, lon.end));
+}
+
+
+/*
+1    = UTC time
+2    = Day, 01 to 31
+3    = Month, 01 to 12
+4    = Year
+*/
+enum { ZDA_TIME, ZDA_DAY, ZDA_MONTH, ZDA_YEAR };
+
+static void
+nmea_parse_zda( NmeaReader*  r, const Token*  f )
+{
+    int    day  = str2int(f[ZDA_DAY].p, f[ZDA_DAY].end);
+    int    mon  = str2int(f[ZDA_MONTH].p, f[ZDA_MONTH].end);
+    int    year = str2int(f[ZDA_YEAR].p, f[ZDA_YEAR].end);
+    int64_t ms;
+
+    if (nmea_reader_epoch(r, f[ZDA_TIME]) < 0)
+        return;
+
+    if (day <= 0 || mon <= 0 || year < 1980) {
+        D("ZDA date not available");
+        return;
+    }
+
+    nmea_reader_set_date(r, year, mon, day);
+
+    if (nmea_reader_update_time(r, f[ZDA_TIME], &ms) == 0)
+        nmea_reader_sync_time(ms);
+}
+
+
+/* the sentence table: three letter sentence id (without the talker),
+ * number of tokens to split (highest field index + 1), handler, then the
+ * tokenizer index of each field given to the handler. supporting a new
+ * sentence type only needs a new line here.
+ */
+#define  NMEA_SENTENCES(X) \
+    X( 'G','G','A', 11, nmea_parse_gga, [GGA_TIME] = 1, [GGA_LAT] = 2, [GGA_LAT_HEMI] = 3, \
+                                        [GGA_LON] = 4, [GGA_LON_HEMI] = 5, [GGA_FIX] = 6, \
+                                        [GGA_HDOP] = 8, [GGA_ALT] = 9, [GGA_ALT_UNITS] = 10 ) \
+    X( 'G','S','A', 19, nmea_parse_gsa, [GSA_FIX] = 2, [GSA_HDOP] = 16, [GSA_SYSTEM] = 18, \
+                                        [GSA_ID] = 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14 ) \
+    X( 'G','S','V', 20, nmea_parse_gsv, [GSV_NUM_MESSAGES] = 1, [GSV_MSG_NUMBER] = 2, \
+                                        [GSV_SVS_INVIEW] = 3, \
+                                        [GSV_SV] = 4, 5, 6, 7, 8, 9, 10, 11, \
+                                                   12, 13, 14, 15, 16, 17, 18, 19 ) \
+    X( 'R','M','C', 10, nmea_parse_rmc, [RMC_TIME] = 1, [RMC_FIX_STATUS] = 2, [RMC_LAT] = 3, \
+                                        [RMC_LAT_HEMI] = 4, [RMC_LON] = 5, [RMC_LON_HEMI] = 6, \
+                                        [RMC_SPEED] = 7, [RMC_BEARING] = 8, [RMC_DATE] = 9 ) \
+    X( 'V','T','G', 10, nmea_parse_vtg, [VTG_BEARING] = 1, [VTG_SPEED] = 5, [VTG_FIX_STATUS] = 9 ) \
+    X( 'G','N','S', 10, nmea_parse_gns, [GNS_TIME] = 1, [GNS_LAT] = 2, [GNS_LAT_HEMI] = 3, \
+                                        [GNS_LON] = 4, [GNS_LON_HEMI] = 5, [GNS_MODE] = 6, \
+                                        [GNS_HDOP] = 8, [GNS_ALT] = 9 ) \
+    X( 'G','L','L',  7, nmea_parse_gll, [GLL_LAT] = 1, [GLL_LAT_HEMI] = 2, [GLL_LON] = 3, \
+                                        [GLL_LON_HEMI] = 4, [GLL_TIME] = 5, [GLL_STATUS] = 6 ) \
+    X( 'G','S','T',  8, nmea_parse_gst, [GST_TIME] = 1, [GST_STD_LAT] = 6, [GST_STD_LON] = 7 ) \
+    X( 'Z','D','A',  5, nmea_parse_zda, [ZDA_TIME] = 1, [ZDA_DAY] = 2, [ZDA_MONTH] = 3, \
+                                        [ZDA_YEAR] = 4 )
+
+#define  NMEA_MAX_FIELDS  20
+#define  NMEA_ID(a,b,c)   (((a) << 16) | ((b) << 8) | (c))
+
+typedef struct {
+    NmeaHandler    handler;
+    unsigned char  count;                      // number of fields
+    unsigned char  limit;                      // number of tokens to split
+    unsigned char  fields[ NMEA_MAX_FIELDS ];
+} NmeaSentence;
+
+#define  NMEA_FIELDS(...)  ((const unsigned char[]){ __VA_ARGS__ })
+
+enum {
+#define  NMEA_INDEX(a,b,c,limit,handler,...)  NMEA_INDEX_ ## handler,
+    NMEA_SENTENCES(NMEA_INDEX)
+#undef   NMEA_INDEX
+};
+
+static const NmeaSentence  nmea_sentences[] = {
+#define  NMEA_ENTRY(a,b,c,limit,handler,...) \
+    { handler, sizeof(NMEA_FIELDS(__VA_ARGS__)), limit, { __VA_ARGS__ } },
+    NMEA_SENTENCES(NMEA_ENTRY)
+#undef   NMEA_ENTRY
+};
+
+
+static const NmeaSentence*
+nmea_sentence_find( const char*  id )
+{
+    switch (NMEA_ID(id[0], id[1], id[2])) {
+#define  NMEA_CASE(a,b,c,limit,handler,...) \
+    case NMEA_ID(a,b,c): return &nmea_sentences[ NMEA_INDEX_ ## handler ];
+    NMEA_SENTENCES(NMEA_CASE)
+#undef   NMEA_CASE
+    }
+    return NULL;
+}
+
+
+/* parse the complete sentence at 's', which is not NUL-terminated and
+ * usually still in the framer ring.
+ */
+static void
+nmea_reader_parse( NmeaReader*  r, const char*  s, int  len )
+{
+   /* we received a complete sentence, now parse it to generate
+    * a new GPS fix...
+    */
+    NmeaTokenizer        tzer[1];
+    Token                tok;
+    Token                fields[ NMEA_MAX_FIELDS ];
+    const NmeaSentence*  sentence;
+    const char*          id;
+    int64_t              stamp;
+    int                  n;
+
+    D("Received: '%.*s'", len, s);
+    if (len < 9) {
+        D("Too short. discarded.");
+        return;
+    }
+
+    // find the handler first, so that only the fields it needs get split
+    id = s + (s[0] == '$') + 2;
+    sentence = nmea_sentence_find(id);
+
+    if (nmea_tokenizer_init(tzer, s, s + len,
+                            sentence ? sentence->limit : 1) < 0) {
+        r->bad_checksum += 1;
+        D("Bad checksum (%u so far). discarded.", r->bad_checksum);
+        return;
+    }
+
+    // nmea_cb gets the time the sentence started to be read, on the
+    // wall clock unless the boot time clock was asked for
+    stamp = (nmea_boottime) ? r->stamp : r->stamp + r->wall_offset;
+    if (_gps_state->init)
+        update_gps_nmea(stamp / 1000000, r->stamp, s, len);
+    if (r->server && r->server->count && (r->server->feeds & GPS_SERVER_NMEA))
+        gps_server_publish(r->server, s, len, r->stamp);
+
+#if GPS_DEBUG
+    {
+        D("Found %d tokens", tzer->count);
+        for (n = 0; n < tzer->count; n++) {
+            Token  tok = nmea_tokenizer_get(tzer,n);
+            D("%2d: '%.*s'", n, tok.end-tok.p, tok.p);
+        }
+    }
+#endif
+
+    tok = nmea_tokenizer_get(tzer, 0);
+    if (tok.p + 5 > tok.end) {
+        D("Sentence id '%.*s' too short, ignored.", tok.end-tok.p, tok.p);
+        return;
+    }
+
+    if (sentence == NULL) {
+        D("Unknown sentence '%.*s", tok.end-tok.p, tok.p);
+        return;
+    }
+
+    for (n = 0; n < sentence->count; n++)
+        fields[n] = nmea_tokenizer_get(tzer, sentence->fields[n]);
+
+    r->system = nmea_talker_system(id - 2);
+    sentence->handler(r, fields);
+
+    if (epoch_end == NMEA_ID(id[0], id[1], id[2]))
+        nmea_reader_close_epoch(r);
+}
+
+
+/*****************************************************************/
+/*****************************************************************/
+/*****                                                       *****/
+/*****       U B X   D E C O D E R                           *****/
+/*****                                                       *****/
+/*****************************************************************/
+/*****************************************************************/
+
+/* in UBX mode the receiver sends binary NAV-PVT and NAV-SAT messages
+ * instead of NMEA. their payloads are little-endian packed structures,
+ * which map directly onto the ones below.
+ */
+#if __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+#error "the UBX decoder expects a little-endian target"
+#endif
+
+#define  UBX_CLASS_NAV     0x01
+#define  UBX_CLASS_ACK     0x05
+#define  UBX_CLASS_CFG     0x06
+#define  UBX_NAV_PVT       0x07
+#define  UBX_NAV_SAT       0x35
+#define  UBX_CFG_PRT       0x00
+#define  UBX_CFG_MSG       0x01
+#define  UBX_CFG_INF       0x02
+#define  UBX_ACK_NAK       0x00
+#define  UBX_ACK_ACK       0x01
+#define  UBX_CFG_RATE      0x08
+#define  UBX_CLASS_MGA     0x13
+#define  UBX_MGA_INI       0x40
+#define  UBX_MGA_ACK       0x60
+#define  UBX_MGA_DBD       0x80
+#define  UBX_CFG_RST       0x04
+
+typedef struct __attribute__((packed)) {
+    uint32_t  iTOW;
+    uint16_t  year;
+    uint8_t   month;
+    uint8_t   day;
+    uint8_t   hour;
+    uint8_t   min;
+    uint8_t   sec;
+    uint8_t   valid;
+    uint32_t  tAcc;
+    int32_t   nano;
+    uint8_t   fixType;
+    uint8_t   flags;
+    uint8_t   flags2;
+    uint8_t   numSV;
+    int32_t   lon;      // 1e-7 deg
+    int32_t   lat;      // 1e-7 deg
+    int32_t   height;   // mm above ellipsoid
+    int32_t   hMSL;     // mm above mean sea level
+    uint32_t  hAcc;     // mm
+    uint32_t  vAcc;     // mm
+    int32_t   velN;     // mm/s
+    int32_t   velE;
+    int32_t   velD;
+    int32_t   gSpeed;   // mm/s
+    int32_t   headMot;  // 1e-5 deg
+    uint32_t  sAcc;
+    uint32_t  headAcc;
+    uint16_t  pDOP;
+    uint8_t   reserved[6];
+} UbxNavPvt;            // u-blox 7 layout, later versions append fields
+
+#define  UBX_PVT_VALID_DATE   0x01
+#define  UBX_PVT_VALID_TIME   0x02
+#define  UBX_PVT_GNSS_FIX_OK  0x01
+
+typedef struct __attribute__((packed)) {
+    uint32_t  iTOW;
+    uint8_t   version;
+    uint8_t   numSvs;
+    uint8_t   reserved[2];
+} UbxNavSat;
+
+typedef struct __attribute__((packed)) {
+    uint8_t   gnssId;
+    uint8_t   svId;
+    uint8_t   cno;
+    int8_t    elev;
+    int16_t   azim;
+    int16_t   prRes;
+    uint32_t  flags;
+} UbxNavSatSv;
+
+#define  UBX_SAT_SV_USED      0x08
+
+enum { UBX_GNSS_GPS = 0, UBX_GNSS_SBAS = 1, UBX_GNSS_GALILEO = 2,
+       UBX_GNSS_BEIDOU = 3, UBX_GNSS_IMES = 4, UBX_GNSS_QZSS = 5,
+       UBX_GNSS_GLONASS = 6 };
+
+
+/* map a UBX satellite to its constellation and slot, 0 if unknown */
+static int
+ubx_sv_lookup( int  gnss, int  sv, int*  slot )
+{
+    int  c;
+
+    switch (gnss) {
+    case UBX_GNSS_GPS:      c = GNSS_CONSTELLATION_GPS; break;
+    case UBX_GNSS_SBAS:     c = GNSS_CONSTELLATION_SBAS; break;
+    case UBX_GNSS_GALILEO:  c = GNSS_CONSTELLATION_GALILEO; break;
+    case UBX_GNSS_BEIDOU:   c = GNSS_CONSTELLATION_BEIDOU; break;
+    case UBX_GNSS_QZSS:     c = GNSS_CONSTELLATION_QZSS; sv += 192; break;
+    case UBX_GNSS_GLONASS:  c = GNSS_CONSTELLATION_GLONASS; break;
+    default:                return 0;
+    }
+
+    *slot = gnss_sv_slot(c, sv);
+    return (*slot) ? c : 0;
+}
+
+
+static void
+ubx_reader_nav_pvt( NmeaReader*  r, const unsigned char*  payload, int  len )
+{
+    const UbxNavPvt*  pvt = (const UbxNavPvt*) payload;
+
+    if (len < (int) sizeof(*pvt)) {
+        D("NAV-PVT too short (%d bytes)", len);
+        return;
+    }
+
+    if ((pvt->valid & (UBX_PVT_VALID_DATE|UBX_PVT_VALID_TIME)) ==
+                      (UBX_PVT_VALID_DATE|UBX_PVT_VALID_TIME)) {
+        nmea_reader_set_date(r, pvt->year, pvt->month, pvt->day);
+        r->utc_tod       = (pvt->hour * 3600 + pvt->min * 60 + pvt->sec) * 1000
+                         + pvt->nano / 1000000;
+        r->fix.timestamp = r->utc_base + r->utc_tod;
+        nmea_reader_sync_time( r->fix.timestamp );
+    }
+
+    if (!(pvt->flags & UBX_PVT_GNSS_FIX_OK) || pvt->fixType < 2 || pvt->fixType > 4) {
+        D("NAV-PVT without fix (type %d)", pvt->fixType);
+        return;
+    }
+
+    r->fix.flags    |= GPS_LOCATION_HAS_LAT_LONG | GPS_LOCATION_HAS_SPEED |
+                       GPS_LOCATION_HAS_BEARING | GPS_LOCATION_HAS_ACCURACY;
+    r->fix.latitude  = pvt->lat / 1e7;
+    r->fix.longitude = pvt->lon / 1e7;
+    r->fix.speed     = pvt->gSpeed / 1000.0f;
+    r->fix.bearing   = pvt->headMot / 1e5f;
+    r->fix.accuracy  = pvt->hAcc / 1000.0f;
+
+    if (pvt->fixType != 2) {
+        r->fix.flags   |= GPS_LOCATION_HAS_ALTITUDE;
+        r->fix.altitude = pvt->hMSL / 1000.0;
+    }
+
+    // a NAV-PVT is a complete solution for its epoch
+    nmea_reader_report_fix(r);
+}
+
+
+static void
+ubx_reader_nav_sat( NmeaReader*  r, const unsigned char*  payload, int  len )
+{
+    const UbxNavSat*    sat = (const UbxNavSat*) payload;
+    const UbxNavSatSv*  sv  = (const UbxNavSatSv*)(sat + 1);
+    NmeaSvTable*        t   = &r->svs;
+    NmeaSvSet*          s   = SV_FILL(t);
+    int                 n;
+
+    if (len < (int) sizeof(*sat) ||
+        len < (int)(sizeof(*sat) + sat->numSvs * sizeof(*sv))) {
+        D("NAV-SAT too short (%d bytes)", len);
+        return;
+    }
+
+    // a NAV-SAT lists all the satellites of its epoch
+    memset(s->view, 0, sizeof(s->view));
+    memset(t->fixing, 0, sizeof(t->fixing));
+    for (n = 0; n < sat->numSvs; n++, sv++) {
+        int  slot, c = ubx_sv_lookup(sv->gnssId, sv->svId, &slot);
+
+        if (c == 0)
+            continue;
+
+        s->view[c] |= 1ull << slot;
+        s->sv[c][slot].snr       = sv->cno;
+        s->sv[c][slot].elevation = sv->elev;
+        s->sv[c][slot].azimuth   = sv->azim;
+        if (sv->flags & UBX_SAT_SV_USED)
+            t->fixing[c] |= 1ull << slot;
+    }
+    t->gsa = 1;
+    t->gsv = 1;
+
+    nmea_reader_report_svs(r);
+}
+
+
+/* parse a complete UBX frame, whose checksum has been verified */
+static void
+ubx_reader_parse( NmeaReader*  r, const unsigned char*  msg, int  size )
+{
+    const unsigned char*  payload = msg + UBX_HEADER_SIZE;
+    int                   len     = size - UBX_HEADER_SIZE - 2;
+
+    D("Received UBX %02x-%02x, %d bytes", msg[2], msg[3], len);
+
+    if (msg[2] == UBX_CLASS_NAV && msg[3] == UBX_NAV_PVT)
+        ubx_reader_nav_pvt(r, payload, len);
+    else if (msg[2] == UBX_CLASS_NAV && msg[3] == UBX_NAV_SAT)
+        ubx_reader_nav_sat(r, payload, len);
+    else if (msg[2] == UBX_CLASS_ACK && len == 2)
+        gps_dev_tx_ack(payload[0], payload[1], msg[3] == UBX_ACK_ACK, r->stamp);
+    else if (msg[2] == UBX_CLASS_MGA)
+        gps_dev_mga(msg[3], payload, len, r->stamp);
+}
+
+
+/*****************************************************************/
+/*****************************************************************/
+/*****                                                       *****/
+/*****       N M E A   F R A M E R                           *****/
+/*****                                                       *****/
+/*****************************************************************/
+/*****************************************************************/
+
+/* the serial data is read in large chunks into a ring buffer, which is
+ * then scanned for sentence boundaries with memchr(). complete sentences
+ * are handed to the parser in one block, partial ones stay in the ring
+ * until the rest of them arrives. binary UBX frames, recognized by their
+ * sync characters, are framed by their length field instead.
+ *
+ * the time of each read() is kept with the chunk it returned, so that a
+ * sentence is stamped with the time its first byte was read.
+ */
+#define  NMEA_RING_SIZE  4096   /* must be a power of 2 */
+#define  NMEA_RING_MASK  (NMEA_RING_SIZE-1)
+
+#define  NMEA_STAMPS     16     /* must be a power of 2 */
+#define  NMEA_STAMP_MASK (NMEA_STAMPS-1)
+
+#define  RING(f,i)  ((unsigned char)(f)->ring[ (i) & NMEA_RING_MASK ])
+
+typedef struct {
+    unsigned  head;      // write position (free running)
+    unsigned  tail;      // start of the current sentence
+    unsigned  scan;      // first byte not yet searched for a newline
+    int       overflow;  // discarding an overlong sentence
+    unsigned  stamp_head;
+    unsigned  stamp_tail;
+    unsigned  stamp_end[ NMEA_STAMPS ];  // ring position after each chunk
+    int64_t   stamp[ NMEA_STAMPS ];      // CLOCK_BOOTTIME (ns) it was read at
+    char      ring[ NMEA_RING_SIZE ];
+} NmeaFramer;
+
+
+static void
+nmea_framer_init( NmeaFramer*  f )
+{
+    f->head     = 0;
+    f->tail     = 0;
+    f->scan     = 0;
+    f->overflow = 0;
+    f->stamp_head = 0;
+    f->stamp_tail = 0;
+}
+
+
+/* return the read time of the byte at ring position 'pos' */
+static int64_t
+nmea_framer_stamp_at( NmeaFramer*  f, unsigned  pos )
+{
+    while (f->stamp_tail != f->stamp_head &&
+           (int)(f->stamp_end[ f->stamp_tail & NMEA_STAMP_MASK ] - pos) <= 0)
+        f->stamp_tail++;
+
+    if (f->stamp_tail == f->stamp_head)
+        return -1;
+    return f->stamp[ f->stamp_tail & NMEA_STAMP_MASK ];
+}
+
+
+/* remember the read time of the 'count' bytes just stored. when many
+ * short reads are pending, the two newest chunks are merged to make room:
+ * the oldest one holds the start of the pending sentence, and the next
+ * sentence most likely starts in the newest one.
+ */
+static void
+nmea_framer_stamp( NmeaFramer*  f, int  count, int64_t  stamp )
+{
+    unsigned  end = f->head + (unsigned) count;
+
+    // forget the chunks that were completely parsed
+    nmea_framer_stamp_at( f, f->tail );
+
+    if (f->stamp_head - f->stamp_tail == NMEA_STAMPS) {
+        f->stamp_head--;
+        f->stamp_end[ (f->stamp_head-1) & NMEA_STAMP_MASK ] =
+            f->stamp_end[ f->stamp_head & NMEA_STAMP_MASK ];
+    }
+
+    f->stamp_end[ f->stamp_head & NMEA_STAMP_MASK ] = end;
+    f->stamp[ f->stamp_head & NMEA_STAMP_MASK ]     = stamp;
+    f->stamp_head++;
+}
+
+
+/* return the contiguous free area of the ring, where the next read()
+ * can store its data.
+ */
+static int
+nmea_framer_space( NmeaFramer*  f, char**  p )
+{
+    unsigned  h    = f->head & NMEA_RING_MASK;
+    unsigned  room = NMEA_RING_SIZE - (f->head - f->tail);
+
+    if (room > NMEA_RING_SIZE - h)
+        room = NMEA_RING_SIZE - h;
+
+    *p = f->ring + h;
+    return (int) room;
+}
+
+
+/* return the 'len' bytes at ring position 'from' in one block: in place,
+ * unless they wrap around the end of the ring and are copied to 'buf'.
+ */
+static const char*
+nmea_framer_peek( NmeaFramer*  f, void*  buf, unsigned  from, unsigned  len )
+{
+    unsigned  t = from & NMEA_RING_MASK;
+    unsigned  n = NMEA_RING_SIZE - t;
+
+    if (n >= len)
+        return f->ring + t;
+
+    memcpy( buf, f->ring + t, n );
+    memcpy( (char*) buf + n, f->ring, len - n );
+    return buf;
+}
+
+
+/* search the ring between 'from' and 'to' for a byte, return its
+ * position or 'to' when not found.
+ */
+static unsigned
+nmea_framer_find( NmeaFramer*  f, unsigned  from, unsigned  to, int  c )
+{
+    while (from != to) {
+        unsigned     s = from & NMEA_RING_MASK;
+        unsigned     n = to - from;
+        const char*  q;
+
+        if (n > NMEA_RING_SIZE - s)
+            n = NMEA_RING_SIZE - s;
+
+        q = memchr( f->ring + s, c, n );
+        if (q != NULL)
+            return from + (unsigned)(q - (f->ring + s));
+        from += n;
+    }
+    return to;
+}
+
+
+/* try to frame a UBX message at the tail of the ring. returns its size
+ * once it has been parsed, 0 if more data is needed, 1 to skip a false
+ * sync character, or -1 if this is not a UBX frame at all.
+ */
+static int
+nmea_framer_ubx( NmeaFramer*  f, NmeaReader*  r )
+{
+    unsigned       avail = f->head - f->tail;
+    unsigned       len, size;
+    unsigned char  ck_a = 0, ck_b = 0;
+    unsigned       n;
+    const unsigned char*  msg;
+
+    if (avail < 2)
+        return 0;
+    if (RING(f, f->tail+1) != UBX_SYNC_CHAR2)
+        return -1;
+    if (avail < UBX_HEADER_SIZE)
+        return 0;
+
+    len = RING(f, f->tail+4) | (RING(f, f->tail+5) << 8);
+    if (len > UBX_MAX_PAYLOAD) {
+        D("UBX frame too long (%u bytes), resyncing", len);
+        return 1;
+    }
+
+    size = UBX_HEADER_SIZE + len + 2;
+    if (avail < size)
+        return 0;
+
+    msg = (const unsigned char*) nmea_framer_peek( f, r->ubx, f->tail, size );
+    for (n = 2; n < size - 2; n++) {
+        ck_a += msg[n];
+        ck_b += ck_a;
+    }
+    if (ck_a != msg[size-2] || ck_b != msg[size-1]) {
+        r->bad_checksum += 1;
+        D("Bad UBX checksum (%u so far). resyncing", r->bad_checksum);
+        return 1;
+    }
+
+    r->stamp = nmea_framer_stamp_at( f, f->tail );
+    GPS_TRACE_BEGIN("ubx %02x-%02x", msg[2], msg[3]);
+    ubx_reader_parse( r, msg, (int) size );
+    GPS_TRACE_END();
+    return (int) size;
+}
+
+
+/* account for 'count' bytes just stored at the position returned by
+ * nmea_framer_space(), read at 'stamp' (CLOCK_BOOTTIME, ns), and parse
+ * every sentence and frame they complete.
+ */
+static void
+nmea_framer_commit( NmeaFramer*  f, NmeaReader*  r, int  count, int64_t  stamp )
+{
+    nmea_framer_stamp( f, count, stamp );
+    f->head += (unsigned) count;
+
+    while (f->tail != f->head) {
+        unsigned  nl, sync;
+
+        if (!f->overflow && RING(f, f->tail) == UBX_SYNC_CHAR1) {
+            int  ret = nmea_framer_ubx( f, r );
+            if (ret == 0)
+                break;
+            if (ret > 0) {
+                f->tail += (unsigned) ret;
+                f->scan  = f->tail;
+                continue;
+            }
+        }
+
+        nl = nmea_framer_find( f, f->scan, f->head, '\n' );
+        if (nl == f->head) {
+            f->scan = f->head;
+            if (f->overflow || f->scan - f->tail > NMEA_MAX_SIZE) {
+                // drop the junk, but not a UBX frame that starts in it
+                sync = nmea_framer_find( f, f->tail+1, f->head, UBX_SYNC_CHAR1 );
+                if (sync != f->head) {
+                    f->overflow = 0;
+                    f->tail = f->scan = sync;
+                    continue;
+                }
+                if (!f->overflow)
+                    D("Sentence overflow, discarded.");
+                f->overflow = 1;
+                f->tail     = f->head;
+            }
+            break;
+        }
+
+        f->scan = nl + 1;
+        if (f->overflow) {
+            f->overflow = 0;
+        } else if (RING(f, f->tail) != '$' &&
+                   (sync = nmea_framer_find( f, f->tail+1, f->scan, UBX_SYNC_CHAR1 )) != f->scan) {
+            // garbage in front of a UBX frame
+            f->tail = f->scan = sync;
+            continue;
+        } else if (f->scan - f->tail > NMEA_MAX_SIZE) {
+            D("Sentence overflow, discarded.");
+        } else {
+            unsigned     len = f->scan - f->tail;
+            const char*  s   = nmea_framer_peek( f, r->in, f->tail, len );
+
+            r->stamp = nmea_framer_stamp_at( f, f->tail );
+            GPS_TRACE_BEGIN("nmea %.5s", s + 1);
+            nmea_reader_parse( r, s, (int) len );
+            GPS_TRACE_END();
+        }
+
+        f->tail = f->scan;
+    }
+}
+
+
+/*****************************************************************/
+/*****************************************************************/
+/*****                                                       *****/
+/*****       C O N N E C T I O N   S T A T E                 *****/
+/*****                                                       *****/
+/*****************************************************************/
+/*****************************************************************/
+
+/* commands sent to the gps thread */
+enum {
+    CMD_QUIT  = 0,
+    CMD_START = 1,
+    CMD_STOP  = 2,
+    CMD_MODE  = 3,
+    CMD_BATCH_START = 4,
+    CMD_BATCH_STOP  = 5,
+    CMD_BATCH_FLUSH = 6,
+    CMD_AID_TIME    = 7,
+    CMD_AID_POS     = 8,
+    CMD_DELETE_AIDING = 9
+};
+
+
+static void
+gps_state_done( GpsState*  s )
+{
+    // tell the thread to quit, and wait for it
+    char   cmd = CMD_QUIT;
+    void*  dummy;
+    write( s->control[0], &cmd, 1 );
+    pthread_join(s->thread, &dummy);
+
+    // stop delivering events to the framework
+    gps_event_queue_done( _gps_events );
+
+    // release the batch buffer, the thread is gone
+    free( _gps_batch->fixes );
+    free( _gps_batch->locations[0] );
+    free( _gps_batch->locations[1] );
+    memset( _gps_batch, 0, sizeof(*_gps_batch) );
+
+    // disconnect the local clients
+    gps_server_close( _gps_server );
+
+    // forget the messages still queued for the receiver
+    gps_dev_tx_reset();
+    gps_dev_dbd_reset();
+
+    // close the control socket pair
+    close( s->control[0] ); s->control[0] = -1;
+    close( s->control[1] ); s->control[1] = -1;
+
+    // close connection to the QEMU GPS daemon
+    close( s->fd ); s->fd = -1;
+    s->init = 0;
+}
+
+
+static void
+gps_state_start( GpsState*  s )
+{
+    char  cmd = CMD_START;
+    int   ret;
+
+    do {
+        ret = write( s->control[0], &cmd, 1 );
+    } while (ret < 0 && errno == EINTR);
+
+    if (ret != 1)
+        D("%s: could not send CMD_START command: ret=%d: %s",
+                __FUNCTION__, ret, strerror(errno));
+}
+
+
+static void
+gps_state_stop( GpsState*  s )
+{
+    char  cmd = CMD_STOP;
+    int   ret;
+
+    do { ret=write( s->control[0], &cmd, 1 ); }
+    while (ret < 0 && errno == EINTR);
+
+    if (ret != 1)
+        D("%s: could not send CMD_STOP command: ret=%d: %s",
+          __FUNCTION__, ret, strerror(errno));
+}
+
+
+static void
+gps_state_command( GpsState*  s, char  cmd )
+{
+    int   ret;
+
+    do { ret=write( s->control[0], &cmd, 1 ); }
+    while (ret < 0 && errno == EINTR);
+
+    if (ret != 1)
+        D("%s: could not send command %d: ret=%d: %s",
+          __FUNCTION__, cmd, ret, strerror(errno));
+}
+
+
+/* split the fix interval requested by the framework (the shortest of the
+ * session and batch ones) into a receiver measurement period and a number
+ * of measurements per navigation solution: the receiver keeps tracking at
+ * about 1 Hz, but only computes and sends the solutions wanted. the reader
+ * drops the fixes that still come too early. returns 1 if the first fix
+ * should come at the measurement rate, to be sooner than the interval.
+ */
+static int
+gps_state_plan_rate( GpsState*  s, NmeaReader*  r, int  started, int  batching,
+                     unsigned short*  meas, unsigned short*  nav )
+{
+    unsigned  interval = (started || !batching) ? __atomic_load_n(&s->fix_interval, __ATOMIC_RELAXED)
+                                                : 0xffffffffu;
+    unsigned  ttff     = __atomic_load_n(&s->fix_ttff, __ATOMIC_RELAXED);
+    unsigned  longest  = (period_in_ms > GPS_DEV_MAX_MEAS_PERIOD) ? period_in_ms : GPS_DEV_MAX_MEAS_PERIOD;
+    unsigned  n, period;
+
+    if (batching && __atomic_load_n(&s->batch_interval, __ATOMIC_RELAXED) < interval)
+        interval = __atomic_load_n(&s->batch_interval, __ATOMIC_RELAXED);
+
+    // a client content with the normal tier gets the tier of the motion
+    r->adaptive = rate_tier_ms[GPS_RATE_NORMAL] > 0 && interval <= rate_tier_ms[GPS_RATE_NORMAL];
+    if (r->adaptive) {
+        period = rate_tier_ms[r->motion.tier];
+        *meas  = (period > period_in_ms) ? period : period_in_ms;
+        *nav   = 1;
+        r->fix_interval = 0;
+        r->motion.changed = 0;
+        D("adaptive rate, tier %d: %u ms measurements", r->motion.tier, *meas);
+        return 0;
+    }
+
+    if (interval <= period_in_ms) {
+        *meas = period_in_ms;
+        *nav  = 1;
+        r->fix_interval = 0;
+        return 0;
+    }
+
+    n = (interval + longest - 1) / longest;
+    if (n > GPS_DEV_MAX_NAV_RATE)
+        n = GPS_DEV_MAX_NAV_RATE;
+    while (n > 1 && interval / n < period_in_ms)
+        n--;
+    period = interval / n;
+    if (period > 65535)
+        period = 65535;
+
+    *meas = (unsigned short) period;
+    *nav  = (unsigned short) n;
+    r->fix_interval = interval;
+    r->fix_slack    = period / 2;
+
+    D("fix interval %u ms: %u ms measurements, %u per solution", interval, period, n);
+
+    return n > 1 && (ttff == 0 || ttff < interval);
+}
+
+
+static int
+epoll_register( int  epoll_fd, int  fd )
+{
+    struct epoll_event  ev;
+    int                 ret, flags;
+
+    /* important: make the fd non-blocking */
+    flags = fcntl(fd, F_GETFL);
+    fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+
+    ev.events  = EPOLLIN;
+    ev.data.fd = fd;
+    do {
+        ret = epoll_ctl( epoll_fd, EPOLL_CTL_ADD, fd, &ev );
+    } while (ret < 0 && errno == EINTR);
+    return ret;
+}
+
+
+static int64_t
+gps_clock_ns( clockid_t  clock )
+{
+    struct timespec  ts;
+
+    clock_gettime( clock, &ts );
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+
+/* open and set up the serial device, and configure the receiver. this is
+ * done by the GPS thread, so that a slow device never holds init() back.
+ */
+static int
+gps_state_open( GpsState*  state )
+{
+    char   prop[PROPERTY_VALUE_MAX];
+
+    do {
+        state->fd = open( state->device, O_RDWR );
+    } while (state->fd < 0 && errno == EINTR);
+
+    if (state->fd < 0) {
+        ALOGE("could not open gps serial device %s: %s", state->device, strerror(errno) );
+        return -1;
+    }
+
+    // Disable echo on serial lines
+    if ( isatty( state->fd ) ) {
+        struct termios  ios;
+        unsigned long   baud, max_baud;
+
+        // leave the port alone if its rate is wrong
+        property_get("ro.kernel.android.gpsttybaud",prop,"9600");
+        baud = strtoul(prop, NULL, 10);
+        if (!gps_dev_baud_supported(baud)) {
+            ALOGE("GPS baud rate unknown: '%s'", prop);
+            goto Fail;
+        }
+
+        tcgetattr( state->fd, &ios );
+        ios.c_lflag = 0;  /* disable ECHO, ICANON, etc... */
+        ios.c_oflag &= (~ONLCR); /* Stop \n -> \r\n translation on output */
+        ios.c_iflag &= (~(ICRNL | INLCR | IGNCR)); /* Stop \r -> \n & \n -> \r translation on input */
+        ios.c_iflag &= (~(IXON | IXANY | ISTRIP)); /* UBX frames are binary: received bytes */
+        ios.c_iflag |= IXOFF;  /* are never flow control, keep \r and the 8th bit */
+        /* keep the current speed until it is set below: B0 would hang up */
+        ios.c_cflag = (ios.c_cflag & CBAUD) | CRTSCTS | CS8 | CLOCAL | CREAD;
+        tcsetattr( state->fd, TCSANOW, &ios );
+
+        // Set baud rate
+        if (gps_dev_set_baud(state->fd, baud) < 0) {
+            ALOGE("could not set the GPS baud rate to %lu: %s", baud, strerror(errno));
+            goto Fail;
+        }
+        ALOGE("Setting gps baud rate to %lu", baud);
+
+        // Move the receiver to a faster rate, if one is configured
+        if (property_get("ro.kernel.android.gps.max_baud", prop, "") != 0)
+        {
+            max_baud = strtoul(prop, NULL, 10);
+            if (max_baud != baud)
+                baud = gps_dev_negotiate_baud(state->fd, baud, max_baud);
+        }
+
+        D("gps baud rate is %lu", baud);
+    }
+
+    gps_dev_set_output(state->fd);
+
+    gps_dev_set_meas_rate(state->fd, GPS_DEV_SLOW_UPDATE_RATE * 1000, 1);
+
+    return 0;
+
+Fail:
+    close( state->fd );
+    state->fd = -1;
+    return -1;
+}
+
+
+/* the commands that cannot wait for a device which is not there yet are
+ * kept by what they change: only the last of each kind is kept, START and
+ * STOP being one kind, as are BATCH_START and BATCH_STOP. there is nothing
+ * to flush.
+ */
+static int
+gps_state_cmd_keep( char*  kept, int  count, char  cmd )
+{
+    int  kind = (cmd == CMD_STOP) ? CMD_START : (cmd == CMD_BATCH_STOP) ? CMD_BATCH_START : cmd;
+    int  nn, mm;
+
+    if (cmd == CMD_BATCH_FLUSH)
+        return count;
+
+    for (nn = mm = 0; nn < count; nn++) {
+        int  k = (kept[nn] == CMD_STOP) ? CMD_START :
+                 (kept[nn] == CMD_BATCH_STOP) ? CMD_BATCH_START : kept[nn];
+        if (k != kind)
+            kept[mm++] = kept[nn];
+    }
+    kept[mm++] = cmd;
+    return mm;
+}
+
+
+/* open the device, and try again while it is missing, e.g. until a USB
+ * receiver is plugged in. the commands sent meanwhile are read, so that
+ * cleanup() is not kept waiting, and kept in 'kept' to be handled once the
+ * device is up. returns -1 if asked to quit first.
+ */
+static int
+gps_state_open_wait( GpsState*  state, char*  kept, int*  count )
+{
+    int  control_fd = state->control[1];
+    int  retry_ms   = GPS_DEV_OPEN_RETRY;
+
+    *count = 0;
+    while (gps_state_open( state ) < 0) {
+        struct pollfd  pfd;
+        int64_t        deadline;
+
+        if (retry_ms == GPS_DEV_OPEN_RETRY)
+            update_gps_status(GPS_STATUS_ENGINE_OFF);
+        ALOGW("GPS device %s not ready, trying again in %d ms", state->device, retry_ms);
+
+        deadline = gps_clock_ns( CLOCK_BOOTTIME ) + retry_ms * 1000000LL;
+        for (;;) {
+            int64_t  left = deadline - gps_clock_ns( CLOCK_BOOTTIME );
+            char     cmd;
+            int      ret;
+
+            if (left <= 0)
+                break;
+            pfd.fd      = control_fd;
+            pfd.events  = POLLIN;
+            pfd.revents = 0;
+            ret = poll( &pfd, 1, (int)((left + 999999) / 1000000) );
+            if (ret <= 0)
+                continue;
+            if ((pfd.revents & (POLLERR|POLLHUP)) != 0)
+                return -1;
+
+            while ((ret = recv( control_fd, &cmd, 1, MSG_DONTWAIT )) == 1 ||
+                   (ret < 0 && errno == EINTR)) {
+                if (ret < 0)
+                    continue;
+                if (cmd == CMD_QUIT) {
+                    D("GPS thread quitting on demand");
+                    return -1;
+                }
+                *count = gps_state_cmd_keep( kept, *count, cmd );
+            }
+        }
+
+        if (retry_ms < GPS_DEV_OPEN_RETRY_MAX)
+            retry_ms = (retry_ms * 2 < GPS_DEV_OPEN_RETRY_MAX) ? retry_ms * 2 : GPS_DEV_OPEN_RETRY_MAX;
+    }
+    return 0;
+}
+
+
+/* this is the main thread, it waits for commands from gps_state_start/stop and,
+ * when started, messages from the QEMU GPS daemon. these are simple NMEA sentences
+ * that must be parsed to be converted into GPS fixes sent to the framework
+ */
+static void
+gps_state_thread( void*  arg )
+{
+    GpsState*   state = (GpsState*) arg;
+    NmeaReader  reader[1];
+    NmeaFramer  framer[1];
+    int         epoll_fd   = epoll_create(2);
+    int         started    = 0;
+    int         batching   = 0;
+    int         first_fix  = 0;     // solutions at the measurement rate until a fix
+    unsigned short  meas_ms, nav_rate;
+    int64_t     batch_period   = 0; // ns between batch deliveries, 0 for none
+    int64_t     batch_deadline = 0; // CLOCK_BOOTTIME (ns) of the next delivery
+    int         gps_fd;
+    int         control_fd = state->control[1];
+    int         tx_polling = 0;     // waiting for the device to take queued messages
+    int64_t     ttff_start = -1;    // CLOCK_BOOTTIME (ns) of the start waiting for a fix
+    int         aided_time = 0;     // the receiver was given the time
+    int         aided_pos  = 0;     // the receiver was given a position
+    int64_t     quit_deadline = 0;  // CLOCK_BOOTTIME (ns) until which to wait for the last dump
+    int64_t     epoch_deadline = 0; // CLOCK_BOOTTIME (ns) at which the open epoch is complete
+    char        kept[CMD_DELETE_AIDING + 1]; // commands sent while the device was missing
+    int         kept_count = 0, kept_pos = 0;
+
+    // bring the device up. the commands sent meanwhile wait in the control
+    // socket, or in 'kept' if it was missing, and are handled in order once
+    // it is ready
+    if (gps_state_open_wait( state, kept, &kept_count ) < 0) {
+        close( epoll_fd );
+        return;
+    }
+    gps_fd = state->fd;
+    update_gps_status(GPS_STATUS_ENGINE_ON);
+
+    nmea_reader_init( reader );
+    nmea_framer_init( framer );
+    gps_state_plan_rate( state, reader, 0, 0, &meas_ms, &nav_rate );
+
+    // register control file descriptors for polling
+    epoll_register( epoll_fd, control_fd );
+    epoll_register( epoll_fd, gps_fd );
+
+    // the local server is served from this thread too
+    if (_gps_server->fd >= 0) {
+        _gps_server->epoll_fd = epoll_fd;
+        epoll_register( epoll_fd, _gps_server->fd );
+        reader->server = _gps_server;
+    }
+
+    // send back the navigation database of the previous run
+    gps_dev_dbd_load();
+
+    D("GPS thread running");
+
+    // now loop
+    for (;;) {
+        struct epoll_event   events[4];
+        int                  ne, nevents;
+        int64_t              now = gps_clock_ns( CLOCK_BOOTTIME );
+        int                  timeout, dbd_timeout, tx_queued;
+
+        // send again the messages the receiver did not answer
+        timeout     = gps_dev_tx_check( now );
+        dbd_timeout = gps_dev_dbd_step( state->fd, now, started || batching );
+
+        // the navigation database was saved before quitting, or it is too late
+        if (quit_deadline > 0 && (!gps_dev_dbd_busy() || now >= quit_deadline)) {
+            D("GPS thread quitting on demand");
+            return;
+        }
+        if (dbd_timeout >= 0 && (timeout < 0 || dbd_timeout < timeout))
+            timeout = dbd_timeout;
+
+        // a batch waits for the framework to be done with the previous one
+        if (_gps_batch->pending) {
+            gps_batch_deliver( _gps_batch );
+            if (_gps_batch->pending && (timeout < 0 || GPS_BATCH_RETRY_MS < timeout))
+                timeout = GPS_BATCH_RETRY_MS;
+        }
+
+        // the receiver went quiet: the open epoch has all its sentences
+        if (epoch_deadline > 0) {
+            if (now >= epoch_deadline) {
+                if (reader->epoch.time >= 0)
+                    nmea_reader_close_epoch( reader );
+                epoch_deadline = 0;
+            } else {
+                int  ms = (int)((epoch_deadline - now + 999999) / 1000000);
+
+                if (timeout < 0 || ms < timeout)
+                    timeout = ms;
+            }
+        }
+        tx_queued = gps_dev_tx_drain( now );
+        if (tx_queued != tx_polling) {
+            struct epoll_event  ev;
+
+            ev.events  = EPOLLIN | (tx_queued ? EPOLLOUT : 0);
+            ev.data.fd = gps_fd;
+            epoll_ctl( epoll_fd, EPOLL_CTL_MOD, gps_fd, &ev );
+            tx_polling = tx_queued;
+        }
+
+        if (batching && batch_period > 0) {
+            int64_t  left = batch_deadline - now;
+            int      ms   = (left > 0) ? (int)((left + 999999) / 1000000) : 0;
+
+            if (timeout < 0 || ms < timeout)
+                timeout = ms;
+        }
+
+        if (kept_pos < kept_count)
+            timeout = 0;
+
+        nevents = epoll_wait( epoll_fd, events, 4, timeout );
+        if (nevents < 0) {
+            if (errno != EINTR)
+                ALOGE("epoll_wait() unexpected error: %s", strerror(errno));
+            continue;
+        }
+
+        // the kept commands come first, as if read from the control socket
+        if (kept_pos < kept_count && nevents < 4) {
+            events[nevents].events  = EPOLLIN;
+            events[nevents].data.fd = control_fd;
+            nevents++;
+        }
+
+        if (batching && batch_period > 0 && gps_clock_ns( CLOCK_BOOTTIME ) >= batch_deadline) {
+            gps_batch_deliver( _gps_batch );
+            batch_deadline = gps_clock_ns( CLOCK_BOOTTIME ) + batch_period;
+        }
+
+        for (ne = 0; ne < nevents; ne++) {
+            // server clients come and go, their hangups are not ours
+            if (gps_server_event( _gps_server, events[ne].data.fd, events[ne].events,
+                                  gps_clock_ns( CLOCK_BOOTTIME ) ))
+                continue;
+            if ((events[ne].events & (EPOLLERR|EPOLLHUP)) != 0) {
+                ALOGE("EPOLLERR or EPOLLHUP after epoll_wait() !?");
+                return;
+            }
+            if ((events[ne].events & EPOLLIN) != 0) {
+                int  fd = events[ne].data.fd;
+
+                if (fd == control_fd) {
+                    char  cmd = 255;
+                    int   ret;
+                    D("GPS control fd event");
+                    if (kept_pos < kept_count) {
+                        cmd = kept[kept_pos++];
+                    } else do {
+                        ret = read( fd, &cmd, 1 );
+                    } while (ret < 0 && errno == EINTR);
+
+                    if (cmd == CMD_QUIT) {
+                        // save the navigation database first, unless it was just done
+                        if (!gps_dev_dbd_quit( state->fd, now )) {
+                            D("GPS thread quitting on demand");
+                            return;
+                        }
+                        quit_deadline = now + GPS_DEV_DBD_QUIT * 1000000LL;
+                    } else if (cmd == CMD_START) {
+                        if (!started) {
+                            D("GPS thread starting  location_cb=%p", state->callbacks->location_cb);
+                            started = 1;
+                            gps_trace_update();
+                            update_gps_status(GPS_STATUS_SESSION_BEGIN);
+                            reader->fix_last   = -1;
+                            reader->batch_only = 0;
+                            reader->motion.tier   = GPS_RATE_NORMAL;
+                            reader->motion.slower = -1;
+                            ttff_start = gps_clock_ns( CLOCK_BOOTTIME );
+                            if (!batching)
+                                gps_dev_set_output(state->fd);
+                            first_fix = gps_state_plan_rate(state, reader, started, batching, &meas_ms, &nav_rate);
+                            gps_dev_set_meas_rate(state->fd, meas_ms, first_fix ? 1 : nav_rate);
+                        }
                     } else if (cmd == CMD_STOP) {
                         if (started) {
                             D("GPS thread stopping");
                             started = 0;
+                            if (reader->bad_checksum)
+                                ALOGW("%u NMEA sentences with a bad checksum were discarded",
+                                      reader->bad_checksum);
+                            if (reader->epoch.time >= 0)
+                                nmea_reader_close_epoch( reader );
+                            epoch_deadline = 0;
                             update_gps_status(GPS_STATUS_SESSION_END);
-                            gps_dev_set_meas_rate(state->fd, GPS_DEV_SLOW_UPDATE_RATE * 1000);
+                            if (!batching)
+                                gps_dev_dbd_poll(state->fd, now);
+                            if (ttff_start >= 0 && !batching) {
+                                ALOGI("no fix %lld ms after the start",
+                                      (long long) (gps_clock_ns( CLOCK_BOOTTIME ) - ttff_start) / 1000000);
+                                ttff_start = -1;
+                            }
+                            reader->batch_only = batching;
+                            if (batching) {
+                                gps_state_plan_rate(state, reader, started, batching, &meas_ms, &nav_rate);
+                                gps_dev_set_meas_rate(state->fd, meas_ms, nav_rate);
+                            } else {
+                                gps_dev_set_meas_rate(state->fd, GPS_DEV_SLOW_UPDATE_RATE * 1000, 1);
+                            }
+                        }
+                    } else if (cmd == CMD_MODE) {
+                        first_fix = gps_state_plan_rate(state, reader, started, batching, &meas_ms, &nav_rate) &&
+                                    reader->fix_last < 0;
+                        if (started || batching)
+                            gps_dev_set_meas_rate(state->fd, meas_ms, first_fix ? 1 : nav_rate);
+                    } else if (cmd == CMD_BATCH_START) {
+                        if (!batching) {
+                            D("GPS thread batching");
+                            batching = 1;
+                            reader->batch      = _gps_batch;
+                            reader->batch_only = !started;
+                            if (!started) {
+                                reader->fix_last = -1;
+                                ttff_start = gps_clock_ns( CLOCK_BOOTTIME );
+                                gps_dev_set_output(state->fd);
+                            }
                         }
+                        _gps_batch->flags = __atomic_load_n(&state->batch_flags, __ATOMIC_RELAXED);
+                        batch_period   = __atomic_load_n(&state->batch_period, __ATOMIC_RELAXED) * 1000000LL;
+                        batch_deadline = gps_clock_ns( CLOCK_BOOTTIME ) + batch_period;
+                        first_fix = gps_state_plan_rate(state, reader, started, batching, &meas_ms, &nav_rate) &&
+                                    reader->fix_last < 0;
+                        gps_dev_set_meas_rate(state->fd, meas_ms, first_fix ? 1 : nav_rate);
+                    } else if (cmd == CMD_BATCH_STOP) {
+                        if (batching) {
+                            D("GPS thread batching stops");
+                            gps_batch_deliver( _gps_batch );
+                            if (_gps_batch->dropped)
+                                ALOGW("%u batched fixes were dropped", _gps_batch->dropped);
+                            _gps_batch->dropped = 0;
+                            batching = 0;
+                            reader->batch      = NULL;
+                            reader->batch_only = 0;
+                            if (started) {
+                                gps_state_plan_rate(state, reader, started, batching, &meas_ms, &nav_rate);
+                                gps_dev_set_meas_rate(state->fd, meas_ms, nav_rate);
+                            } else {
+                                gps_dev_set_meas_rate(state->fd, GPS_DEV_SLOW_UPDATE_RATE * 1000, 1);
+                            }
+                        }
+                    } else if (cmd == CMD_BATCH_FLUSH) {
+                        gps_batch_deliver( _gps_batch );
+                    } else if (cmd == CMD_AID_TIME) {
+                        // carry the injected time over to now
+                        int64_t  now = gps_clock_ns( CLOCK_BOOTTIME ) / 1000000;
+                        int64_t  ref = __atomic_load_n(&state->aid_time_ref, __ATOMIC_RELAXED);
+                        int64_t  utc = __atomic_load_n(&state->aid_time, __ATOMIC_RELAXED);
+
+                        if (0 < ref && ref <= now)
+                            utc += now - ref;
+                        gps_dev_aid_time(state->fd, utc,
+                                         __atomic_load_n(&state->aid_time_acc, __ATOMIC_RELAXED));
+                        aided_time = 1;
+                    } else if (cmd == CMD_AID_POS) {
+                        gps_dev_aid_pos(state->fd,
+                                        __atomic_load_n(&state->aid_lat, __ATOMIC_RELAXED),
+                                        __atomic_load_n(&state->aid_lon, __ATOMIC_RELAXED),
+                                        __atomic_load_n(&state->aid_pos_acc, __ATOMIC_RELAXED));
+                        aided_pos = 1;
+                    } else if (cmd == CMD_DELETE_AIDING) {
+                        gps_dev_delete_aiding(state->fd,
+                                              __atomic_exchange_n(&state->aid_delete, 0, __ATOMIC_RELAXED));
+                        if (started || batching)
+                            ttff_start = gps_clock_ns( CLOCK_BOOTTIME );
+                        aided_time = aided_pos = 0;
                     }
                 } else if (fd == gps_fd) {
-                    char  buff[32];
+                    int  total = 0;
+
+                    GPS_TRACE_BEGIN("gps read");
                     for (;;) {
-                        int  nn, ret;
+                        char*    buff;
+                        int      size, ret;
+                        int64_t  stamp;
+
+                        size = nmea_framer_space( framer, &buff );
+                        ret  = read( fd, buff, size );
+                        if (ret < 0) {
+                            if (errno == EINTR)
+                                continue;
+                            if (errno != EWOULDBLOCK)
+                                ALOGE("Error while reading from GPS daemon socket: %s:", strerror(errno));
+                            break;
+                        }
+                        if (ret == 0)
+                            break;
+
+                        stamp = gps_clock_ns( CLOCK_BOOTTIME );
+                        if (total == 0)
+                            reader->wall_offset = gps_clock_ns( CLOCK_REALTIME ) - stamp;
+                        total += ret;
+                        nmea_framer_commit( framer, reader, ret, stamp );
+                    }
+                    GPS_TRACE_COUNTER("gps read bytes", total);
+                    GPS_TRACE_END();
+
+                    if (reader->epoch.time >= 0)
+                        epoch_deadline = gps_clock_ns( CLOCK_BOOTTIME ) + GPS_EPOCH_IDLE_MS * 1000000LL;
+
+                    if (ttff_start >= 0 && reader->fix_last >= 0) {
+                        int64_t  ttff = (gps_clock_ns( CLOCK_BOOTTIME ) - ttff_start) / 1000000;
+
+                        ALOGI("time to first fix: %lld ms, %s", (long long) ttff,
+                              (aided_time && aided_pos) ? "time and position aiding" :
+                              aided_time ? "time aiding" : aided_pos ? "position aiding" : "no aiding");
+                        GPS_TRACE_COUNTER("gps ttff ms", ttff);
+                        ttff_start = -1;
+                    }
+
+                    // got the first fix, slow down to the requested interval
+                    if (first_fix && (started || batching) && reader->fix_last >= 0) {
+                        first_fix = 0;
+                        gps_dev_set_meas_rate(state->fd, meas_ms, nav_rate);
+                    }
+
+                    // the motion calls for another rate tier
+                    if (reader->adaptive && reader->motion.changed && (started || batching)) {
+                        gps_state_plan_rate(state, reader, started, batching, &meas_ms, &nav_rate);
+                        gps_dev_set_meas_rate(state->fd, meas_ms, nav_rate);
+                    }
+                } else {
+                    ALOGE("epoll_wait() returned unkown fd %d ?", fd);
+                }
+            }
+        }
+    }
+}
+
+
+static void
+gps_state_init( GpsState*  state, GpsCallbacks* callbacks )
+{
+    char   prop[PROPERTY_VALUE_MAX];
+    int    ret;
+    int    done = 0;
+
+    struct sigevent tmr_event;
+
+    state->init       = 1;
+    state->control[0] = -1;
+    state->control[1] = -1;
+    state->fd         = -1;
+    state->callbacks  = callbacks;
+    D("gps_state_init");
+
+    // Look for a kernel-provided device name
+    if (property_get("ro.kernel.android.gps",prop,"") == 0) {
+        D("no kernel-provided gps device name");
+        return;
+    }
+
+    snprintf(state->device, sizeof(state->device), "/dev/%s",prop);
+    D("GPS will read from %s", state->device);
+
+    period_in_ms = GPS_DEV_HIGH_UPDATE_RATE * 1000;
+    if (property_get("ro.kernel.android.gps.max_rate", prop, "") != 0)
+    {
+        unsigned long rate = strtoul(prop, NULL, 10);
+        if (0 < rate && rate < 66)
+            period_in_ms = (unsigned short) (rate * 1000);
+        else if (250 <= rate && rate < 65536)
+            period_in_ms = (unsigned short) rate;
+    }
+
+    D("measure rate is set to %u ms", period_in_ms);
+
+    time_sync = false;
+    if (property_get("ro.kernel.android.gps.time_sync", prop, "") != 0)
+    {
+        time_sync = atol(prop);
+    }
+
+    D("time_sync is %s", (time_sync) ? "enabled" : "disabled");
+
+    ubx_mode = 0;
+    if (property_get("ro.kernel.android.gps.protocol", prop, "") != 0)
+    {
+        ubx_mode = (strcmp(prop, "ubx") == 0);
+    }
+
+    D("receiver protocol is %s", (ubx_mode) ? "UBX" : "NMEA");
+
+    epoch_end = 0;
+    if (property_get("ro.kernel.android.gps.epoch_end", prop, "") == 3)
+    {
+        epoch_end = NMEA_ID(prop[0], prop[1], prop[2]);
+    }
+
+    D("epochs end %s%s, or after %d ms without data", (epoch_end) ? "after " : "on the next UTC time",
+      (epoch_end) ? prop : "", GPS_EPOCH_IDLE_MS);
+
+    nmea_boottime = 0;
+    if (property_get("ro.kernel.android.gps.nmea_clock", prop, "") != 0)
+    {
+        nmea_boottime = (strcmp(prop, "boottime") == 0);
+    }
+
+    D("nmea_cb timestamps use %s", (nmea_boottime) ? "CLOCK_BOOTTIME" : "the wall clock");
+
+    // an unchanged satellite status is only reported again after
+    // sv_refresh ms, 0 reports it every epoch
+    sv_snr_tolerance = 1.0f;
+    if (property_get("ro.kernel.android.gps.sv_snr_tolerance", prop, "") != 0)
+    {
+        sv_snr_tolerance = strtof(prop, NULL);
+    }
+
+    sv_refresh_ms = 5000;
+    if (property_get("ro.kernel.android.gps.sv_refresh", prop, "") != 0)
+    {
+        sv_refresh_ms = atoi(prop);
+    }
+
+    if (sv_refresh_ms > 0)
+        D("satellite status is reported on changes over %.1f dB-Hz, or every %d ms",
+          sv_snr_tolerance, sv_refresh_ms);
+    else
+        D("satellite status is reported every epoch");
+
+    // fast,normal,still measurement periods (ms) for the adaptive rate
+    memset(rate_tier_ms, 0, sizeof(rate_tier_ms));
+    if (property_get("ro.kernel.android.gps.rate_tiers", prop, "") != 0)
+    {
+        unsigned  fast, normal, still;
+
+        if (sscanf(prop, "%u,%u,%u", &fast, &normal, &still) == 3 &&
+            0 < fast && fast <= normal && normal <= still && still < 65536) {
+            rate_tier_ms[GPS_RATE_FAST]   = fast;
+            rate_tier_ms[GPS_RATE_NORMAL] = normal;
+            rate_tier_ms[GPS_RATE_STILL]  = still;
+        } else {
+            ALOGE("invalid GPS rate tiers '%s'", prop);
+        }
+    }
+
+    D("adaptive rate is %s", rate_tier_ms[GPS_RATE_NORMAL] ? "enabled" : "disabled");
+
+    nmea_filter = 1;
+    if (property_get("ro.kernel.android.gps.nmea_filter", prop, "") != 0)
+    {
+        nmea_filter = atoi(prop);
+    }
+
+    D("receiver NMEA output is %s", (nmea_filter) ? "filtered" : "left as is");
+
+    sv_divisor = 1;
+    if (property_get("ro.kernel.android.gps.sv_divisor", prop, "") != 0)
+    {
+        int divisor = atoi(prop);
+        if (0 < divisor && divisor < 256)
+            sv_divisor = (unsigned char) divisor;
+    }
+
+    D("satellites are sent every %u solutions", sv_divisor);
+
+    aiding = 1;
+    if (property_get("ro.kernel.android.gps.aiding", prop, "") != 0)
+    {
+        aiding = atoi(prop);
+    }
+
+    D("injected time and location are %s", (aiding) ? "sent to the receiver" : "ignored");
+
+    property_get("ro.kernel.android.gps.dbd_file", dbd_path, "/data/vendor/gps/ubx_dbd.bin");
+    if (strcmp(dbd_path, "off") == 0)
+        dbd_path[0] = '\0';
+
+    dbd_period_ms = 1800 * 1000;
+    if (property_get("ro.kernel.android.gps.dbd_period", prop, "") != 0)
+    {
+        dbd_period_ms = atoi(prop) * 1000;
+    }
+
+    D("navigation database %s %s, saved every %d s", (dbd_path[0]) ? "kept in" : "not kept",
+      dbd_path, dbd_period_ms / 1000);
+
+    // Serve the data to local clients, if a socket is configured
+    if (property_get("ro.kernel.android.gps.server", prop, "") != 0)
+    {
+        char  feed[PROPERTY_VALUE_MAX];
+        int   feeds = 0;
+
+        property_get("ro.kernel.android.gps.server_feed", feed, "nmea,fix");
+        if (strstr(feed, "nmea"))
+            feeds |= GPS_SERVER_NMEA;
+        if (strstr(feed, "fix"))
+            feeds |= GPS_SERVER_FIX;
+        if (feeds == 0)
+            ALOGE("invalid GPS server feed '%s'", feed);
+        else
+            gps_server_open(_gps_server, prop, feeds);
+    }
+
+    if ( socketpair( AF_LOCAL, SOCK_STREAM, 0, state->control ) < 0 ) {
+        ALOGE("Could not create thread control socket pair: %s", strerror(errno));
+        goto Fail;
+    }
+
+    gps_event_queue_init( _gps_events, callbacks );
+
+    state->thread = callbacks->create_thread_cb( "gps_state_thread", gps_state_thread, state );
+
+    if ( !state->thread ) {
+        ALOGE("Could not create GPS thread: %s", strerror(errno));
+        goto Fail;
+    }
+
+    D("GPS state initialized");
+
+    return;
+
+Fail:
+    gps_state_done( state );
+}
+
+
+/*****************************************************************/
+/*****************************************************************/
+/*****                                                       *****/
+/*****       I N T E R F A C E                               *****/
+/*****                                                       *****/
+/*****************************************************************/
+/*****************************************************************/
+
+static int
+serial_gps_init(GpsCallbacks* callbacks)
+{
+    D("serial_gps_init");
+    GpsState*  s = _gps_state;
+
+    if (!s->init)
+        gps_state_init(s, callbacks);
+
+    // the device is opened by the GPS thread, which reports GPS_STATUS_ENGINE_ON
+    // or GPS_STATUS_ENGINE_OFF through status_cb once it knows
+    if (s->control[0] < 0)
+        return -1;
+
+    // the fix interval of set_position_mode() is honored
+    if (callbacks->set_capabilities_cb)
+        callbacks->set_capabilities_cb(GPS_CAPABILITY_SCHEDULING);
+
+    return 0;
+}
+
+
+static void
+serial_gps_cleanup(void)
+{
+    GpsState*  s = _gps_state;
+
+    if (s->init)
+        gps_state_done(s);
+}
+
+
+static int
+serial_gps_start()
+{
+    GpsState*  s = _gps_state;
+
+    if (!s->init) {
+        DFR("%s: called with uninitialized state !!", __FUNCTION__);
+        return -1;
+    }
+
+    D("%s: called", __FUNCTION__);
+    gps_state_start(s);
+    return 0;
+}
+
+
+static int
+serial_gps_stop()
+{
+    GpsState*  s = _gps_state;
+
+    if (!s->init) {
+        DFR("%s: called with uninitialized state !!", __FUNCTION__);
+        return -1;
+    }
+
+    D("%s: called", __FUNCTION__);
+    gps_state_stop(s);
+    return 0;
+}
+
+
+static int
+serial_gps_inject_time(GpsUtcTime time, int64_t timeReference, int uncertainty)
+{
+    GpsState*  s = _gps_state;
+
+    if (!s->init) {
+        D("%s: called with uninitialized state !!", __FUNCTION__);
+        return -1;
+    }
+
+    D("inject_time: time=%lld reference=%lld uncertainty=%d",
+      (long long) time, (long long) timeReference, uncertainty);
+    if (!aiding)
+        return 0;
+
+    __atomic_store_n(&s->aid_time, time, __ATOMIC_RELAXED);
+    __atomic_store_n(&s->aid_time_ref, timeReference, __ATOMIC_RELAXED);
+    __atomic_store_n(&s->aid_time_acc, (uncertainty > 0) ? (uint32_t) uncertainty : 0, __ATOMIC_RELAXED);
+    gps_state_command(s, CMD_AID_TIME);
+    return 0;
+}
+
+
+static int
+serial_gps_inject_location(double latitude, double longitude, float accuracy)
+{
+    GpsState*  s = _gps_state;
+
+    if (!s->init) {
+        D("%s: called with uninitialized state !!", __FUNCTION__);
+        return -1;
+    }
+
+    D("inject_location: lat=%g lon=%g accuracy=%g", latitude, longitude, accuracy);
+    if (!aiding)
+        return 0;
+    if (!(fabs(latitude) <= 90 && fabs(longitude) <= 180)) {
+        ALOGE("%s: invalid location %g, %g", __FUNCTION__, latitude, longitude);
+        return -1;
+    }
+
+    __atomic_store_n(&s->aid_lat, (int32_t) lrint(latitude * 1e7), __ATOMIC_RELAXED);
+    __atomic_store_n(&s->aid_lon, (int32_t) lrint(longitude * 1e7), __ATOMIC_RELAXED);
+    __atomic_store_n(&s->aid_pos_acc, (accuracy > 0 && accuracy < 4e7f) ? (uint32_t) lrintf(accuracy * 100) : 0,
+                     __ATOMIC_RELAXED);
+    gps_state_command(s, CMD_AID_POS);
+    return 0;
+}
+
+static void
+serial_gps_delete_aiding_data(GpsAidingData flags)
+{
+    GpsState*  s = _gps_state;
+
+    if (!s->init) {
+        D("%s: called with uninitialized state !!", __FUNCTION__);
+        return;
+    }
+
+    D("delete_aiding_data: flags=%04x", flags);
+    __atomic_fetch_or(&s->aid_delete, (uint32_t) flags, __ATOMIC_RELAXED);
+    gps_state_command(s, CMD_DELETE_AIDING);
+}
+
+static int serial_gps_set_position_mode(GpsPositionMode mode, GpsPositionRecurrence recurrence,
+        uint32_t min_interval, uint32_t preferred_accuracy, uint32_t preferred_time)
+{
+    GpsState*  s = _gps_state;
+
+    if (!s->init) {
+        D("%s: called with uninitialized state !!", __FUNCTION__);
+        return -1;
+    }
+
+    D("set_position_mode: mode=%d recurrence=%d min_interval=%d preferred_accuracy=%d preferred_time=%d",
+            mode, recurrence, min_interval, preferred_accuracy, preferred_time);
+
+    __atomic_store_n(&s->fix_interval, min_interval, __ATOMIC_RELAXED);
+    __atomic_store_n(&s->fix_ttff, preferred_time, __ATOMIC_RELAXED);
+    gps_state_command(s, CMD_MODE);
+
+    return 0;
+}
+
+
+/* the extension below is only valid from within the callbacks */
+static int64_t
+serial_gps_location_elapsed(const GpsLocation* location)
+{
+    const GpsEvent*  e = _gps_events->current;
+
+    if (e == NULL || e->type != GPS_EVENT_LOCATION || location != &e->u.location)
+        return -1;
+
+    return e->elapsed;
+}
+
+
+static int64_t
+serial_gps_nmea_elapsed(const char* nmea)
+{
+    const GpsEvent*  e = _gps_events->current;
+
+    if (e == NULL || e->type != GPS_EVENT_NMEA || nmea != e->u.nmea.data)
+        return -1;
+
+    return e->elapsed;
+}
+
+
+static const GpsSerialTimingInterface  serialGpsTimingInterface = {
+    sizeof(GpsSerialTimingInterface),
+    serial_gps_location_elapsed,
+    serial_gps_nmea_elapsed,
+};
+
+
+static int
+serial_gps_batch_init(GpsSerialBatchingCallbacks* callbacks)
+{
+    GpsState*  s = _gps_state;
+    GpsBatch*  b = _gps_batch;
+    char       prop[PROPERTY_VALUE_MAX];
+    int        size = GPS_BATCH_SIZE;
+
+    if (!s->init) {
+        D("%s: called with uninitialized state !!", __FUNCTION__);
+        return -1;
+    }
+
+    b->callbacks = callbacks;
+    if (b->fixes != NULL)
+        return 0;
+
+    if (property_get("ro.kernel.android.gps.batch_size", prop, "") != 0)
+    {
+        size = atoi(prop);
+        if (size <= 0) {
+            ALOGE("invalid GPS batch size '%s'", prop);
+            size = GPS_BATCH_SIZE;
+        }
+    }
+
+    b->fixes     = calloc(size, sizeof(*b->fixes));
+    b->locations[0] = calloc(size, sizeof(*b->locations[0]));
+    b->locations[1] = calloc(size, sizeof(*b->locations[1]));
+    if (b->fixes == NULL || b->locations[0] == NULL || b->locations[1] == NULL) {
+        ALOGE("Could not allocate a batch of %d fixes", size);
+        free(b->fixes);
+        free(b->locations[0]);
+        free(b->locations[1]);
+        b->fixes        = NULL;
+        b->locations[0] = NULL;
+        b->locations[1] = NULL;
+        return -1;
+    }
+    b->capacity = size;
+
+    D("batch buffer holds %d fixes", size);
+    return 0;
+}
+
+
+static int
+serial_gps_batch_size(void)
+{
+    return _gps_batch->capacity;
+}
+
+
+static int
+serial_gps_batch_start(const GpsSerialBatchOptions* options)
+{
+    GpsState*  s = _gps_state;
+
+    if (!s->init || _gps_batch->fixes == NULL) {
+        D("%s: called with uninitialized state !!", __FUNCTION__);
+        return -1;
+    }
+
+    D("batch start: flags=%x min_interval=%u flush_period=%u",
+      options->flags, options->min_interval, options->flush_period);
+
+    __atomic_store_n(&s->batch_flags, options->flags, __ATOMIC_RELAXED);
+    __atomic_store_n(&s->batch_interval, options->min_interval, __ATOMIC_RELAXED);
+    __atomic_store_n(&s->batch_period, options->flush_period, __ATOMIC_RELAXED);
+    gps_state_command(s, CMD_BATCH_START);
+    return 0;
+}
+
+
+static void
+serial_gps_batch_flush(void)
+{
+    GpsState*  s = _gps_state;
+
+    if (s->init)
+        gps_state_command(s, CMD_BATCH_FLUSH);
+}
+
+
+static int
+serial_gps_batch_stop(void)
+{
+    GpsState*  s = _gps_state;
+
+    if (!s->init) {
+        D("%s: called with uninitialized state !!", __FUNCTION__);
+        return -1;
+    }
+
+    gps_state_command(s, CMD_BATCH_STOP);
+    return 0;
+}
+
+
+static void
+serial_gps_batch_cleanup(void)
+{
+    serial_gps_batch_stop();
+}
+
+
+static const GpsSerialBatchingInterface  serialGpsBatchingInterface = {
+    sizeof(GpsSerialBatchingInterface),
+    serial_gps_batch_init,
+    serial_gps_batch_size,
+    serial_gps_batch_start,
+    serial_gps_batch_flush,
+    serial_gps_batch_stop,
+    serial_gps_batch_cleanup,
+};
+
+
+static const void*
+serial_gps_get_extension(const char* name)
+{
+    if (strcmp(name, GPS_SERIAL_TIMING_INTERFACE) == 0)
+        return &serialGpsTimingInterface;
+
+    if (strcmp(name, GPS_SERIAL_BATCHING_INTERFACE) == 0)
+        return &serialGpsBatchingInterface;
+
+    return NULL;
+}
+
+
+static const GpsInterface  serialGpsInterface = {
+    sizeof(GpsInterface),
+    serial_gps_init,
+    serial_gps_start,
+    serial_gps_stop,
+    serial_gps_cleanup,
+    serial_gps_inject_time,
+    serial_gps_inject_location,
+    serial_gps_delete_aiding_data,
+    serial_gps_set_position_mode,
+    serial_gps_get_extension,
+};
 
-                        ret = read( fd, buff, sizeof(buff) );
-                        if (ret < 0) {
-                            if (errno == EINTR)
-                                continue;
-                            if (errno != EWOULDBLOCK)
-                                ALOGE("Error while reading from GPS daemon socket: %s:", strerror(errno));
-                            break;
-                        }
-                        for (nn = 0; nn < ret; nn++)
-                            nmea_reader_addc( reader, buff[nn] );
-                    }
-                } else {
-                    ALOGE("epoll_wait() returned unkown fd %d ?", fd);
-                }
+
+const GpsInterface* gps_get_hardware_interface()
+{
+    D("GPS dev get_hardware_interface");
+    return &serialGpsInterface;
+}
+
+
+/*****************************************************************/
+/*****************************************************************/
+/*****                                                       *****/
+/*****       D E V I C E                                     *****/
+/*****                                                       *****/
+/*****************************************************************/
+/*****************************************************************/
+
+/* write a message during the device bring-up in the GPS thread, before
+ * the fd is made non-blocking and the epoll loop starts
+ */
+static int gps_dev_write(int fd, const char *msg, int size)
+{
+    int n = 0;
+
+    while (n < size) {
+        int ret = write(fd, msg + n, size - n);
+
+        if (ret < 0) {
+            struct pollfd pfd = { fd, POLLOUT, 0 };
+
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                ALOGE("could not write to the GPS device: %s", strerror(errno));
+                return -1;
+            }
+            if (poll(&pfd, 1, GPS_DEV_TX_ACK_TIMEOUT) <= 0) {
+                ALOGE("GPS device does not take data");
+                return -1;
             }
+            continue;
         }
+        n += ret;
     }
+    return 0;
 }
 
 
-static void
-gps_state_init( GpsState*  state, GpsCallbacks* callbacks )
+static void gps_dev_calc_ubx_csum(unsigned char *msg, int size, unsigned char *ck_a, unsigned char *ck_b)
 {
-    char   prop[PROPERTY_VALUE_MAX];
-    char   device[256];
-    int    ret;
-    int    done = 0;
+    *ck_a = *ck_b = 0;
+    for (int i = 0; i < size; ++i)
+    {
+        *ck_a += msg[i];
+        *ck_b += *ck_a;
+    }
+}
 
-    struct sigevent tmr_event;
 
-    state->init       = 1;
-    state->control[0] = -1;
-    state->control[1] = -1;
-    state->fd         = -1;
-    state->callbacks  = callbacks;
-    D("gps_state_init");
+/* build a UBX frame in buff, returns its size or -1 */
+static int gps_dev_frame_ubx(unsigned char *buff, unsigned char cls, unsigned char id, const void *payload, int len)
+{
+    if (len > UBX_MAX_PAYLOAD)
+        return -1;
+
+    buff[0] = UBX_SYNC_CHAR1;
+    buff[1] = UBX_SYNC_CHAR2;
+    buff[2] = cls;
+    buff[3] = id;
+    buff[4] = (unsigned char) len;
+    buff[5] = (unsigned char) (len >> 8);
+    memcpy(buff + UBX_HEADER_SIZE, payload, len);
+
+    gps_dev_calc_ubx_csum(buff + 2, len + 4, buff + UBX_HEADER_SIZE + len, buff + UBX_HEADER_SIZE + len + 1);
+
+    return UBX_HEADER_SIZE + len + 2;
+}
+
+
+/* send a UBX message and wait for the port to take it. only for the polls
+ * of the baud rate negotiation, which read the answers themselves.
+ */
+static void gps_dev_write_ubx(int fd, unsigned char cls, unsigned char id, const void *payload, int len)
+{
+    unsigned char buff[UBX_MAX_SIZE];
+    int size = gps_dev_frame_ubx(buff, cls, id, payload, len);
+
+    if (size > 0)
+        gps_dev_write(fd, (char *)buff, size);
+}
+
+
+/* messages to the receiver are queued, and written as the port takes them:
+ * the GPS thread drains the queue on EPOLLOUT, so reconfiguring the receiver
+ * never stalls the reader. the receiver answers every CFG message with an
+ * ACK-ACK or ACK-NAK that only names its class and id, so a CFG message is
+ * held back while another of the same class and id waits for its answer,
+ * and a held message that sets the same as a newer one is replaced by it.
+ * a message left without answer GPS_DEV_TX_ACK_TIMEOUT ms after it was
+ * written is sent again, up to GPS_DEV_TX_RETRIES times, unless a later
+ * one has replaced it meanwhile.
+ */
+#define GPS_DEV_TX_RING         (2048)  /* must be a power of 2 */
+#define GPS_DEV_TX_MASK         (GPS_DEV_TX_RING-1)
+#define GPS_DEV_TX_PENDING      (32)
+#define GPS_DEV_TX_FRAME        (64)    /* larger messages are not tracked */
+#define GPS_DEV_TX_RETRIES      (2)
+
+typedef struct {
+    int used;
+    int held;                   /* waiting for the answer to the previous one */
+    unsigned char cls, id;
+    unsigned char key[2];       /* what the message sets, see gps_dev_tx_key() */
+    int keylen;
+    int superseded;             /* a later message sets the same: do not retry */
+    int tries;
+    unsigned order;             /* in which the messages were sent */
+    unsigned end;               /* ring position after the message */
+    int64_t deadline;           /* CLOCK_BOOTTIME (ns) for the answer, 0 until written */
+    int size;
+    unsigned char frame[GPS_DEV_TX_FRAME];
+} GpsDevPending;
+
+typedef struct {
+    int fd;
+    unsigned head, tail;        /* free running positions in ring */
+    unsigned order;
+    unsigned char ring[GPS_DEV_TX_RING];
+    GpsDevPending pending[GPS_DEV_TX_PENDING];
+} GpsDevTx;
+
+static GpsDevTx _gps_tx[1] = {{ .fd = -1 }};
+
+
+/* the part of a CFG payload that tells which setting it changes */
+static int gps_dev_tx_key(const unsigned char *frame, int size, unsigned char *key)
+{
+    int len = size - UBX_HEADER_SIZE - 2;
+    int keylen = (frame[3] == UBX_CFG_MSG) ? 2 :
+                 (frame[3] == UBX_CFG_PRT || frame[3] == UBX_CFG_INF) ? 1 : 0;
+
+    if (keylen > len)
+        keylen = len;
+    memcpy(key, frame + UBX_HEADER_SIZE, keylen);
+    return keylen;
+}
+
+
+static int gps_dev_tx_append(GpsDevTx *tx, const unsigned char *frame, int size)
+{
+    unsigned pos = tx->head & GPS_DEV_TX_MASK;
+    unsigned part = GPS_DEV_TX_RING - pos;
+
+    if ((unsigned) size > GPS_DEV_TX_RING - (tx->head - tx->tail))
+        return -1;
+
+    if (part > (unsigned) size)
+        part = size;
+    memcpy(tx->ring + pos, frame, part);
+    memcpy(tx->ring, frame + part, size - part);
+    tx->head += size;
+    return 0;
+}
+
+
+/* queue a tracked message, returns -1 and forgets it if it does not fit */
+static int gps_dev_tx_queue(GpsDevTx *tx, GpsDevPending *p)
+{
+    if (gps_dev_tx_append(tx, p->frame, p->size) < 0) {
+        ALOGE("GPS transmit queue full, UBX %02x-%02x dropped", p->cls, p->id);
+        p->used = 0;
+        return -1;
+    }
+    p->held = 0;
+    p->end = tx->head;
+    p->deadline = 0;
+    return 0;
+}
+
+
+/* the message of class cls and id is answered or given up: send the next */
+static void gps_dev_tx_next(GpsDevTx *tx, unsigned char cls, unsigned char id)
+{
+    GpsDevPending *p = NULL;
+    int i;
+
+    for (i = 0; i < GPS_DEV_TX_PENDING; ++i) {
+        GpsDevPending *q = &tx->pending[i];
+
+        if (q->used && q->held && q->cls == cls && q->id == id &&
+            (p == NULL || (int)(q->order - p->order) < 0))
+            p = q;
+    }
+    if (p != NULL)
+        gps_dev_tx_queue(tx, p);
+}
+
+
+/* write what the port takes of the queue. returns 1 if some is left */
+static int gps_dev_tx_drain(int64_t now)
+{
+    GpsDevTx *tx = _gps_tx;
+    int written = 0;
+    int i;
+
+    while (tx->head != tx->tail) {
+        unsigned from = tx->tail & GPS_DEV_TX_MASK;
+        unsigned len = tx->head - tx->tail;
+        int ret;
+
+        if (len > GPS_DEV_TX_RING - from)
+            len = GPS_DEV_TX_RING - from;
+
+        ret = write(tx->fd, tx->ring + from, len);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                // give the queue up, the messages will time out
+                ALOGE("could not write to the GPS device: %s", strerror(errno));
+                tx->tail = tx->head;
+                written = 1;
+            }
+            break;
+        }
+        tx->tail += ret;
+        written = 1;
+    }
+
+    // the answers can only come once the messages are out
+    if (written) {
+        for (i = 0; i < GPS_DEV_TX_PENDING; ++i) {
+            GpsDevPending *p = &tx->pending[i];
+
+            if (p->used && !p->held && p->deadline == 0 && (int)(tx->tail - p->end) >= 0)
+                p->deadline = now + GPS_DEV_TX_ACK_TIMEOUT * 1000000LL;
+        }
+    }
+
+    return tx->head != tx->tail;
+}
+
+
+static void gps_dev_send(int fd, const unsigned char *frame, int size, int64_t now)
+{
+    GpsDevTx *tx = _gps_tx;
+    GpsDevPending *p = NULL;
+    unsigned char key[2];
+    int keylen, busy = 0, i;
+
+    tx->fd = fd;
+    if (frame[2] != UBX_CLASS_CFG || frame[3] == UBX_CFG_RST || size > GPS_DEV_TX_FRAME) {
+        // no answer to wait for
+        if (gps_dev_tx_append(tx, frame, size) < 0)
+            ALOGE("GPS transmit queue full, UBX %02x-%02x dropped", frame[2], frame[3]);
+        gps_dev_tx_drain(now);
+        return;
+    }
+
+    keylen = gps_dev_tx_key(frame, size, key);
+    for (i = 0; i < GPS_DEV_TX_PENDING; ++i) {
+        GpsDevPending *q = &tx->pending[i];
+
+        if (!q->used) {
+            if (p == NULL)
+                p = q;
+            continue;
+        }
+        if (q->cls != frame[2] || q->id != frame[3])
+            continue;
+        busy = 1;
+        if (q->keylen == keylen && memcmp(q->key, key, keylen) == 0) {
+            if (q->held) {
+                // not sent yet: send the new setting instead
+                memcpy(q->frame, frame, size);
+                q->size = size;
+                return;
+            }
+            q->superseded = 1;
+        }
+    }
+
+    if (p == NULL) {
+        ALOGW("too many UBX messages waiting for an answer, %02x-%02x not tracked", frame[2], frame[3]);
+        if (gps_dev_tx_append(tx, frame, size) < 0)
+            ALOGE("GPS transmit queue full, UBX %02x-%02x dropped", frame[2], frame[3]);
+        gps_dev_tx_drain(now);
+        return;
+    }
+
+    memset(p, 0, sizeof(*p));
+    p->used = 1;
+    p->held = 1;
+    p->cls = frame[2];
+    p->id = frame[3];
+    p->keylen = keylen;
+    memcpy(p->key, key, keylen);
+    p->order = ++tx->order;
+    p->size = size;
+    memcpy(p->frame, frame, size);
+
+    if (!busy && gps_dev_tx_queue(tx, p) == 0)
+        gps_dev_tx_drain(now);
+}
+
+
+/* handle an ACK-ACK or ACK-NAK from the receiver */
+static void gps_dev_tx_ack(unsigned char cls, unsigned char id, int ack, int64_t now)
+{
+    GpsDevTx *tx = _gps_tx;
+    GpsDevPending *p = NULL;
+    int i;
+
+    for (i = 0; i < GPS_DEV_TX_PENDING && p == NULL; ++i) {
+        GpsDevPending *q = &tx->pending[i];
+
+        if (q->used && !q->held && q->deadline != 0 && q->cls == cls && q->id == id)
+            p = q;
+    }
+
+    if (p == NULL) {
+        D("unexpected %s for UBX %02x-%02x", ack ? "ACK" : "NAK", cls, id);
+        return;
+    }
+
+    if (ack)
+        D("receiver applied UBX %02x-%02x", cls, id);
+    else
+        ALOGE("receiver rejected UBX %02x-%02x%s", cls, id, p->superseded ? ", replaced since" : "");
+    p->used = 0;
+
+    gps_dev_tx_next(tx, cls, id);
+    gps_dev_tx_drain(now);
+}
+
+
+/* send again the messages left without answer, give up on the ones sent too
+ * many times. returns the ms until the next answer is due, or -1.
+ */
+static int gps_dev_tx_check(int64_t now)
+{
+    GpsDevTx *tx = _gps_tx;
+    int64_t next = -1;
+    int i;
+
+    for (i = 0; i < GPS_DEV_TX_PENDING; ++i) {
+        GpsDevPending *p = &tx->pending[i];
+
+        if (!p->used || p->held || p->deadline == 0 || now < p->deadline)
+            continue;
+
+        if (p->superseded) {
+            D("no answer to UBX %02x-%02x, replaced since", p->cls, p->id);
+            p->used = 0;
+            gps_dev_tx_next(tx, p->cls, p->id);
+        } else if (p->tries >= GPS_DEV_TX_RETRIES) {
+            ALOGE("receiver did not acknowledge UBX %02x-%02x after %d tries", p->cls, p->id, p->tries + 1);
+            p->used = 0;
+            gps_dev_tx_next(tx, p->cls, p->id);
+        } else {
+            D("no answer to UBX %02x-%02x, sending it again", p->cls, p->id);
+            p->tries += 1;
+            if (gps_dev_tx_queue(tx, p) < 0)
+                gps_dev_tx_next(tx, p->cls, p->id);
+        }
+    }
+
+    gps_dev_tx_drain(now);
+
+    for (i = 0; i < GPS_DEV_TX_PENDING; ++i) {
+        GpsDevPending *p = &tx->pending[i];
+
+        if (p->used && !p->held && p->deadline != 0 && (next < 0 || p->deadline - now < next))
+            next = p->deadline - now;
+    }
+
+    return (next < 0) ? -1 : (int)((next + 999999) / 1000000);
+}
+
+
+static void gps_dev_tx_reset(void)
+{
+    memset(_gps_tx, 0, sizeof(*_gps_tx));
+    _gps_tx->fd = -1;
+}
+
+
+static void gps_dev_send_ubx(int fd, unsigned char cls, unsigned char id, const void *payload, int len)
+{
+    unsigned char buff[UBX_MAX_SIZE];
+    int size = gps_dev_frame_ubx(buff, cls, id, payload, len);
+
+    if (size > 0)
+        gps_dev_send(fd, buff, size, gps_clock_ns(CLOCK_BOOTTIME));
+}
+
+
+static void gps_dev_set_meas_rate(int fd, unsigned short period_ms, unsigned short nav_rate)
+{
+    // B5 62 06 08 06 00 F4 01 01 00 01 00 0B 77
+    unsigned char payload[6];
+
+    *((unsigned short *)(payload + 0)) = period_ms;
+    *((unsigned short *)(payload + 2)) = nav_rate;
+    *((unsigned short *)(payload + 4)) = 1;
+
+    gps_dev_send_ubx(fd, UBX_CLASS_CFG, UBX_CFG_RATE, payload, sizeof(payload));
+}
+
+
+static void gps_dev_set_msg_rate(int fd, unsigned char cls, unsigned char id, unsigned char rate)
+{
+    unsigned char payload[3] = { cls, id, rate };
+
+    gps_dev_send_ubx(fd, UBX_CLASS_CFG, UBX_CFG_MSG, payload, sizeof(payload));
+}
+
+
+/* turn off the INF messages (NMEA TXT) on all the receiver ports */
+static void gps_dev_set_inf_off(int fd)
+{
+    unsigned char payload[10] = { 1 /* NMEA */ };
+
+    gps_dev_send_ubx(fd, UBX_CLASS_CFG, UBX_CFG_INF, payload, sizeof(payload));
+}
+
+
+enum {
+    NMEA_OUT_OFF = 0,   /* the reader has no use for it */
+    NMEA_OUT_FIX,       /* every navigation solution */
+    NMEA_OUT_SV,        /* every sv_divisor solutions */
+};
+
+/* standard NMEA messages (class 0xF0) the receiver may output, and which
+ * of them the reader wants: the fix comes from GGA, RMC and GST, and GSA,
+ * which alone tells a 2D fix from a 3D one, the satellites from GSV. the
+ * others repeat the same data.
+ */
+static const struct {
+    unsigned char  id;
+    int            nmea;    /* NMEA_ID() of the sentence */
+    int            output;  /* NMEA_OUT_* */
+} gps_dev_nmea_msgs[] = {
+    { 0x00, NMEA_ID('G','G','A'), NMEA_OUT_FIX },
+    { 0x01, NMEA_ID('G','L','L'), NMEA_OUT_OFF },
+    { 0x02, NMEA_ID('G','S','A'), NMEA_OUT_FIX },
+    { 0x03, NMEA_ID('G','S','V'), NMEA_OUT_SV  },
+    { 0x04, NMEA_ID('R','M','C'), NMEA_OUT_FIX },
+    { 0x05, NMEA_ID('V','T','G'), NMEA_OUT_OFF },
+    { 0x06, NMEA_ID('G','R','S'), NMEA_OUT_OFF },
+    { 0x07, NMEA_ID('G','S','T'), NMEA_OUT_FIX },
+    { 0x08, NMEA_ID('Z','D','A'), NMEA_OUT_OFF },
+    { 0x09, NMEA_ID('G','B','S'), NMEA_OUT_OFF },
+    { 0x0A, NMEA_ID('D','T','M'), NMEA_OUT_OFF },
+    { 0x0D, NMEA_ID('G','N','S'), NMEA_OUT_OFF },
+    { 0x0F, NMEA_ID('V','L','W'), NMEA_OUT_OFF },
+};
+
+
+/* switch the receiver output from NMEA to UBX NAV-PVT and NAV-SAT */
+static void gps_dev_set_ubx_output(int fd)
+{
+    unsigned int i;
+
+    for (i = 0; i < sizeof(gps_dev_nmea_msgs) / sizeof(gps_dev_nmea_msgs[0]); ++i)
+        gps_dev_set_msg_rate(fd, 0xF0, gps_dev_nmea_msgs[i].id, 0);
+    gps_dev_set_inf_off(fd);
+
+    gps_dev_set_msg_rate(fd, UBX_CLASS_NAV, UBX_NAV_PVT, 1);
+    gps_dev_set_msg_rate(fd, UBX_CLASS_NAV, UBX_NAV_SAT, sv_divisor);
+}
+
+
+/* only have the receiver send the NMEA sentences the reader uses, and the
+ * satellites every sv_divisor solutions. the sentence that ends the epochs
+ * is kept at every solution.
+ */
+static void gps_dev_set_nmea_output(int fd)
+{
+    unsigned int i;
+
+    for (i = 0; i < sizeof(gps_dev_nmea_msgs) / sizeof(gps_dev_nmea_msgs[0]); ++i) {
+        unsigned char rate = 0;
+
+        if (gps_dev_nmea_msgs[i].output == NMEA_OUT_FIX || gps_dev_nmea_msgs[i].nmea == epoch_end)
+            rate = 1;
+        else if (gps_dev_nmea_msgs[i].output == NMEA_OUT_SV)
+            rate = sv_divisor;
+
+        gps_dev_set_msg_rate(fd, 0xF0, gps_dev_nmea_msgs[i].id, rate);
+    }
+    gps_dev_set_inf_off(fd);
+}
+
+
+static void gps_dev_put_u32(unsigned char *p, uint32_t v)
+{
+    p[0] = (unsigned char) v;
+    p[1] = (unsigned char) (v >> 8);
+    p[2] = (unsigned char) (v >> 16);
+    p[3] = (unsigned char) (v >> 24);
+}
+
+
+/* give the receiver the UTC time with UBX MGA-INI-TIME_UTC. the time is
+ * the one at which the message is received, the leap seconds are left to
+ * the receiver.
+ */
+static void gps_dev_aid_time(int fd, int64_t utc_ms, uint32_t acc_ms)
+{
+    unsigned char payload[24];
+    time_t t = (time_t) (utc_ms / 1000);
+    struct tm utc;
+
+    if (utc_ms < 0 || gmtime_r(&t, &utc) == NULL)
+        return;
+
+    memset(payload, 0, sizeof(payload));
+    payload[0] = 0x10;                      /* type: TIME_UTC */
+    payload[3] = 0x80;                      /* leapSecs: unknown */
+    payload[4] = (unsigned char) (utc.tm_year + 1900);
+    payload[5] = (unsigned char) ((utc.tm_year + 1900) >> 8);
+    payload[6] = utc.tm_mon + 1;
+    payload[7] = utc.tm_mday;
+    payload[8] = utc.tm_hour;
+    payload[9] = utc.tm_min;
+    payload[10] = utc.tm_sec;
+    gps_dev_put_u32(payload + 12, (uint32_t) (utc_ms % 1000) * 1000000);
+    payload[16] = (unsigned char) (acc_ms / 1000);
+    payload[17] = (unsigned char) ((acc_ms / 1000) >> 8);
+    gps_dev_put_u32(payload + 20, (acc_ms % 1000) * 1000000);
+
+    D("aiding with the time %lld, +/- %u ms", (long long) utc_ms, acc_ms);
+    gps_dev_send_ubx(fd, UBX_CLASS_MGA, UBX_MGA_INI, payload, sizeof(payload));
+}
+
+
+/* give the receiver a coarse position with UBX MGA-INI-POS_LLH. the
+ * framework has no altitude for it: the ellipsoid is used instead.
+ */
+static void gps_dev_aid_pos(int fd, int32_t lat, int32_t lon, uint32_t acc_cm)
+{
+    unsigned char payload[20];
+
+    memset(payload, 0, sizeof(payload));
+    payload[0] = 0x01;                      /* type: POS_LLH */
+    gps_dev_put_u32(payload + 4, (uint32_t) lat);
+    gps_dev_put_u32(payload + 8, (uint32_t) lon);
+    gps_dev_put_u32(payload + 16, acc_cm);
+
+    D("aiding with the position %d, %d, +/- %u cm", lat, lon, acc_cm);
+    gps_dev_send_ubx(fd, UBX_CLASS_MGA, UBX_MGA_INI, payload, sizeof(payload));
+}
+
+
+/* the receiver's navigation database (ephemerides, almanacs, ionosphere,
+ * time and position) is dumped with UBX MGA-DBD when a session ends, every
+ * dbd_period_ms while it runs and before the HAL quits, and kept in dbd_path.
+ * at the next start, the entries are sent back as they came, a few at a time
+ * as the port drains, so that a receiver without backup power hot starts.
+ *
+ * the file is a header, all little-endian:
+ *   magic "UDBD", version, reserved, entry count (u16), data size (u32),
+ *   UBX checksum of the data (u32), UTC time of the dump (ms, i64)
+ * followed by the entries, each a u16 length and a MGA-DBD payload.
+ */
+#define GPS_DEV_DBD_VERSION     (1)
+#define GPS_DEV_DBD_HEADER      (24)
+#define GPS_DEV_DBD_MAX_SIZE    (65536)     /* bytes of entries */
+#define GPS_DEV_DBD_IDLE        (1000)      /* ms without entry that end a dump */
+#define GPS_DEV_DBD_FRESH       (60000)     /* ms a dump is recent enough at quit */
+#define GPS_DEV_DBD_MAX_AGE     (14 * 86400 * 1000LL)   /* ms, older files are ignored */
+#define GPS_DEV_DBD_WINDOW      (512)       /* bytes queued at most while restoring */
+#define GPS_DEV_DBD_ACK_WAIT    (1000)      /* ms for the answers to the last restored entries */
+
+typedef struct {
+    unsigned char *dump;        /* entries of the dump in progress */
+    int dump_size;
+    int dump_count;
+    int dumping;
+    int64_t dump_idle;          /* CLOCK_BOOTTIME (ns) at which the dump is over */
+    int64_t dump_last;          /* CLOCK_BOOTTIME (ns) of the last dump, 0 if none */
+    int64_t dump_due;           /* CLOCK_BOOTTIME (ns) of the next periodic dump, 0 if idle */
+    unsigned char *restore;     /* entries being sent back */
+    int restore_size;
+    int restore_pos;
+    int restore_count;
+    int rejected;
+    int64_t restore_end;        /* CLOCK_BOOTTIME (ns) of the last answer expected, 0 until all written */
+} GpsDevDbd;
+
+static GpsDevDbd _gps_dbd[1];
+
+
+static uint32_t gps_dev_dbd_checksum(const unsigned char *data, int size)
+{
+    unsigned char ck_a, ck_b;
+
+    gps_dev_calc_ubx_csum((unsigned char *)data, size, &ck_a, &ck_b);
+    return ck_a | (ck_b << 8);
+}
+
+
+/* the file is written by a thread of its own, as an fsync() on /data can
+ * take long enough for the receiver to overflow the UART meanwhile. the
+ * writes and deletions run one at a time, in order, and one overtaken by
+ * a later one (a dump saved after the aiding data was deleted) is skipped.
+ */
+typedef struct {
+    unsigned seq;
+    unsigned char *data;        /* header and entries, NULL to delete the file */
+    int size;
+    int count;
+    char path[PROPERTY_VALUE_MAX];
+} GpsDevDbdJob;
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t idle;
+    int running;                /* jobs not done yet */
+    unsigned seq;               /* of the last job queued */
+    unsigned done;              /* of the last job done */
+} _gps_dbd_writer = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0, 0, 0 };
+
+
+static void gps_dev_dbd_write(GpsDevDbdJob *job)
+{
+    char tmp[PROPERTY_VALUE_MAX + 8];
+    int fd, ret;
 
-    // Look for a kernel-provided device name
-    if (property_get("ro.kernel.android.gps",prop,"") == 0) {
-        D("no kernel-provided gps device name");
+    if (job->data == NULL) {
+        if (unlink(job->path) < 0 && errno != ENOENT)
+            ALOGE("could not delete %s: %s", job->path, strerror(errno));
         return;
     }
 
-    snprintf(device, sizeof(device), "/dev/%s",prop);
-    do {
-        state->fd = open( device, O_RDWR );
-    } while (state->fd < 0 && errno == EINTR);
-
-    if (state->fd < 0) {
-        ALOGE("could not open gps serial device %s: %s", device, strerror(errno) );
+    // never leave a partial file behind
+    snprintf(tmp, sizeof(tmp), "%s.tmp", job->path);
+    fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        ALOGE("could not create %s: %s", tmp, strerror(errno));
+        return;
+    }
+    ret = gps_dev_write(fd, (char *)job->data, job->size);
+    if (ret == 0)
+        ret = fsync(fd);
+    if (close(fd) < 0)
+        ret = -1;
+    if (ret < 0 || rename(tmp, job->path) < 0) {
+        ALOGE("could not save the navigation database: %s", strerror(errno));
+        unlink(tmp);
         return;
     }
 
-    D("GPS will read from %s", device);
+    D("navigation database saved: %d entries, %d bytes", job->count, job->size - GPS_DEV_DBD_HEADER);
+}
 
-    period_in_ms = GPS_DEV_HIGH_UPDATE_RATE * 1000;
-    if (property_get("ro.kernel.android.gps.max_rate", prop, "") != 0)
-    {
-        unsigned long rate = strtoul(prop, NULL, 10);
-        if (0 < rate && rate < 66)
-            period_in_ms = (unsigned short) (rate * 1000);
-        else if (250 <= rate && rate < 65536)
-            period_in_ms = (unsigned short) rate;
-    }
 
-    D("measure rate is set to %u ms", period_in_ms);
+static void *gps_dev_dbd_writer(void *arg)
+{
+    GpsDevDbdJob *job = arg;
 
-    time_sync = false;
-    if (property_get("ro.kernel.android.gps.time_sync", prop, "") != 0)
-    {
-        time_sync = atol(prop);
+    pthread_mutex_lock(&_gps_dbd_writer.lock);
+    if ((int)(job->seq - _gps_dbd_writer.done) > 0) {
+        gps_dev_dbd_write(job);
+        _gps_dbd_writer.done = job->seq;
     }
+    if (--_gps_dbd_writer.running == 0)
+        pthread_cond_broadcast(&_gps_dbd_writer.idle);
+    pthread_mutex_unlock(&_gps_dbd_writer.lock);
 
-    D("time_sync is %s", (time_sync) ? "enabled" : "disabled");
+    free(job->data);
+    free(job);
+    return NULL;
+}
 
-    // Disable echo on serial lines
-    if ( isatty( state->fd ) ) {
-        struct termios  ios;
-        tcgetattr( state->fd, &ios );
-        ios.c_lflag = 0;  /* disable ECHO, ICANON, etc... */
-        ios.c_oflag &= (~ONLCR); /* Stop \n -> \r\n translation on output */
-        ios.c_iflag &= (~(ICRNL | INLCR)); /* Stop \r -> \n & \n -> \r translation on input */
-        ios.c_iflag |= (IGNCR | IXOFF);  /* Ignore \r & XON/XOFF on input */
-        // Set baud rate and other flags
-        property_get("ro.kernel.android.gpsttybaud",prop,"9600");
-        if (strcmp(prop, "4800") == 0) {
-            ALOGE("Setting gps baud rate to 4800");
-            ios.c_cflag = B4800 | CRTSCTS | CS8 | CLOCAL | CREAD;
-        } else if (strcmp(prop, "9600") == 0) {
-            ALOGE("Setting gps baud rate to 9600");
-            ios.c_cflag = B9600 | CRTSCTS | CS8 | CLOCAL | CREAD;
-        } else if (strcmp(prop, "19200") == 0) {
-            ALOGE("Setting gps baud rate to 19200");
-            ios.c_cflag = B19200 | CRTSCTS | CS8 | CLOCAL | CREAD;
-        } else if (strcmp(prop, "38400") == 0) {
-            ALOGE("Setting gps baud rate to 38400");
-            ios.c_cflag = B38400 | CRTSCTS | CS8 | CLOCAL | CREAD;
-        } else if (strcmp(prop, "57600") == 0) {
-            ALOGE("Setting gps baud rate to 57600");
-            ios.c_cflag = B57600 | CRTSCTS | CS8 | CLOCAL | CREAD;
-        } else if (strcmp(prop, "115200") == 0) {
-            ALOGE("Setting gps baud rate to 115200");
-            ios.c_cflag = B115200 | CRTSCTS | CS8 | CLOCAL | CREAD;
-        } else {
-            ALOGE("GPS baud rate unknown: '%s'", prop);
-            return;
-        }
 
-        tcsetattr( state->fd, TCSANOW, &ios );
+/* hand data (header and entries, which the job then owns) to a writer
+ * thread, or have it delete the file if data is NULL
+ */
+static void gps_dev_dbd_job(unsigned char *data, int size, int count)
+{
+    GpsDevDbdJob *job = calloc(1, sizeof(*job));
+    pthread_attr_t attr;
+    pthread_t thread;
+    int ret;
+
+    if (job == NULL) {
+        free(data);
+        return;
     }
+    job->data = data;
+    job->size = size;
+    job->count = count;
+    strcpy(job->path, dbd_path);
+
+    pthread_mutex_lock(&_gps_dbd_writer.lock);
+    job->seq = ++_gps_dbd_writer.seq;
+    _gps_dbd_writer.running++;
+    pthread_mutex_unlock(&_gps_dbd_writer.lock);
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    ret = pthread_create(&thread, &attr, gps_dev_dbd_writer, job);
+    pthread_attr_destroy(&attr);
+    if (ret != 0) {
+        ALOGE("could not start the navigation database writer: %s", strerror(ret));
+        gps_dev_dbd_writer(job);
+    }
+}
 
-    gps_dev_set_meas_rate(state->fd, GPS_DEV_SLOW_UPDATE_RATE * 1000);
 
-    if ( socketpair( AF_LOCAL, SOCK_STREAM, 0, state->control ) < 0 ) {
-        ALOGE("Could not create thread control socket pair: %s", strerror(errno));
-        goto Fail;
-    }
+static void gps_dev_dbd_save(GpsDevDbd *d)
+{
+    unsigned char *data = malloc(GPS_DEV_DBD_HEADER + d->dump_size);
+    int64_t utc = gps_clock_ns(CLOCK_REALTIME) / 1000000;
 
-    state->thread = callbacks->create_thread_cb( "gps_state_thread", gps_state_thread, state );
+    if (data == NULL)
+        return;
 
-    if ( !state->thread ) {
-        ALOGE("Could not create GPS thread: %s", strerror(errno));
-        goto Fail;
+    memset(data, 0, GPS_DEV_DBD_HEADER);
+    memcpy(data, "UDBD", 4);
+    data[4] = GPS_DEV_DBD_VERSION;
+    data[6] = (unsigned char) d->dump_count;
+    data[7] = (unsigned char) (d->dump_count >> 8);
+    gps_dev_put_u32(data + 8, d->dump_size);
+    gps_dev_put_u32(data + 12, gps_dev_dbd_checksum(d->dump, d->dump_size));
+    gps_dev_put_u32(data + 16, (uint32_t) utc);
+    gps_dev_put_u32(data + 20, (uint32_t) (utc >> 32));
+    memcpy(data + GPS_DEV_DBD_HEADER, d->dump, d->dump_size);
+
+    gps_dev_dbd_job(data, GPS_DEV_DBD_HEADER + d->dump_size, d->dump_count);
+}
+
+
+/* load the file of the previous run, to send it back to the receiver */
+static void gps_dev_dbd_load(void)
+{
+    GpsDevDbd *d = _gps_dbd;
+    unsigned char header[GPS_DEV_DBD_HEADER];
+    int64_t utc, now = gps_clock_ns(CLOCK_REALTIME) / 1000000;
+    uint32_t size;
+    int fd, ret, pos;
+
+    if (!dbd_path[0])
+        return;
+
+    fd = open(dbd_path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        D("no navigation database in %s: %s", dbd_path, strerror(errno));
+        return;
     }
 
-    D("GPS state initialized");
+    ret = read(fd, header, sizeof(header));
+    size = header[8] | (header[9] << 8) | (header[10] << 16) | ((uint32_t) header[11] << 24);
+    utc = (header[16] | (header[17] << 8) | (header[18] << 16) | ((uint32_t) header[19] << 24)) |
+          (int64_t) (header[20] | (header[21] << 8) | (header[22] << 16) | ((uint32_t) header[23] << 24)) << 32;
+    if (ret != sizeof(header) || memcmp(header, "UDBD", 4) != 0 || header[4] != GPS_DEV_DBD_VERSION ||
+        size == 0 || size > GPS_DEV_DBD_MAX_SIZE) {
+        ALOGW("ignoring %s: not a navigation database of version %d", dbd_path, GPS_DEV_DBD_VERSION);
+        close(fd);
+        return;
+    }
+    if (utc <= now - GPS_DEV_DBD_MAX_AGE) {
+        D("navigation database too old, ignored");
+        close(fd);
+        return;
+    }
 
-    return;
+    d->restore = malloc(size);
+    if (d->restore == NULL) {
+        close(fd);
+        return;
+    }
+    for (pos = 0; pos < (int) size; pos += ret) {
+        ret = read(fd, d->restore + pos, size - pos);
+        if (ret <= 0)
+            break;
+    }
+    close(fd);
 
-Fail:
-    gps_state_done( state );
-}
+    if (pos != (int) size || gps_dev_dbd_checksum(d->restore, size) !=
+        (header[12] | (header[13] << 8) | (header[14] << 16) | ((uint32_t) header[15] << 24))) {
+        ALOGW("ignoring %s: corrupted", dbd_path);
+        free(d->restore);
+        d->restore = NULL;
+        return;
+    }
 
+    d->restore_size = size;
+    d->restore_pos = 0;
+    d->restore_count = 0;
+    d->rejected = 0;
+    d->restore_end = 0;
+    D("navigation database of %lld s ago to restore, %u bytes", (long long) (now - utc) / 1000, size);
+}
 
-/*****************************************************************/
-/*****************************************************************/
-/*****                                                       *****/
-/*****       I N T E R F A C E                               *****/
-/*****                                                       *****/
-/*****************************************************************/
-/*****************************************************************/
 
-static int
-serial_gps_init(GpsCallbacks* callbacks)
+/* ask the receiver for its database. returns 0 if no dump is under way.
+ * none is asked for while restoring: the end of a dump is told by the same
+ * acknowledgement as the restored entries get.
+ */
+static int gps_dev_dbd_poll(int fd, int64_t now)
 {
-    D("serial_gps_init");
-    GpsState*  s = _gps_state;
-
-    if (!s->init)
-        gps_state_init(s, callbacks);
+    GpsDevDbd *d = _gps_dbd;
 
-    if (s->fd < 0)
-        return -1;
+    if (!dbd_path[0] || d->restore != NULL)
+        return 0;
 
-    return 0;
+    if (!d->dumping) {
+        if (d->dump == NULL)
+            d->dump = malloc(GPS_DEV_DBD_MAX_SIZE);
+        if (d->dump == NULL)
+            return 0;
+        d->dump_size = 0;
+        d->dump_count = 0;
+        d->dumping = 1;
+        gps_dev_send_ubx(fd, UBX_CLASS_MGA, UBX_MGA_DBD, NULL, 0);
+    }
+    d->dump_idle = now + GPS_DEV_DBD_IDLE * 1000000LL;
+    d->dump_last = now;
+    return 1;
 }
 
 
-static void
-serial_gps_cleanup(void)
+static void gps_dev_dbd_done(GpsDevDbd *d)
 {
-    GpsState*  s = _gps_state;
-
-    if (s->init)
-        gps_state_done(s);
+    if (d->dump_count > 0)
+        gps_dev_dbd_save(d);
+    else
+        D("the receiver has no navigation database to dump");
+    d->dumping = 0;
 }
 
 
-static int
-serial_gps_start()
+/* handle the MGA messages of the receiver: database entries, and the
+ * acknowledgements that tell a restored entry was rejected, or end a dump
+ */
+static void gps_dev_mga(unsigned char id, const unsigned char *payload, int len, int64_t now)
 {
-    GpsState*  s = _gps_state;
+    GpsDevDbd *d = _gps_dbd;
 
-    if (!s->init) {
-        DFR("%s: called with uninitialized state !!", __FUNCTION__);
-        return -1;
+    if (id == UBX_MGA_DBD && d->dumping) {
+        if (d->dump_size + 2 + len > GPS_DEV_DBD_MAX_SIZE) {
+            ALOGE("navigation database larger than %d bytes, not saved", GPS_DEV_DBD_MAX_SIZE);
+            d->dump_count = 0;
+            d->dumping = 0;
+            return;
+        }
+        d->dump[d->dump_size++] = (unsigned char) len;
+        d->dump[d->dump_size++] = (unsigned char) (len >> 8);
+        memcpy(d->dump + d->dump_size, payload, len);
+        d->dump_size += len;
+        d->dump_count += 1;
+        d->dump_idle = now + GPS_DEV_DBD_IDLE * 1000000LL;
+    } else if (id == UBX_MGA_ACK && len >= 4 && payload[3] == UBX_MGA_DBD) {
+        if (d->restore != NULL) {
+            if (payload[0] == 0)
+                d->rejected += 1;
+        } else if (d->dumping) {
+            gps_dev_dbd_done(d);
+        }
     }
-
-    D("%s: called", __FUNCTION__);
-    gps_state_start(s);
-    return 0;
 }
 
 
-static int
-serial_gps_stop()
+/* restore the database, end the dumps the receiver does not end itself and
+ * poll it periodically while active. returns the ms until it is due again,
+ * or -1.
+ */
+static int gps_dev_dbd_step(int fd, int64_t now, int active)
 {
-    GpsState*  s = _gps_state;
+    GpsDevDbd *d = _gps_dbd;
+    GpsDevTx *tx = _gps_tx;
 
-    if (!s->init) {
-        DFR("%s: called with uninitialized state !!", __FUNCTION__);
+    if (!dbd_path[0])
         return -1;
+
+    while (d->restore != NULL && tx->head - tx->tail < GPS_DEV_DBD_WINDOW &&
+           d->restore_pos + 2 <= d->restore_size) {
+        int len;
+
+        len = d->restore[d->restore_pos] | (d->restore[d->restore_pos + 1] << 8);
+        if (d->restore_pos + 2 + len > d->restore_size) {
+            d->restore_pos = d->restore_size;
+            continue;
+        }
+        gps_dev_send_ubx(fd, UBX_CLASS_MGA, UBX_MGA_DBD, d->restore + d->restore_pos + 2, len);
+        d->restore_pos += 2 + len;
+        d->restore_count += 1;
     }
 
-    D("%s: called", __FUNCTION__);
-    gps_state_stop(s);
-    return 0;
+    // the restore is over once all is written, and the receiver had time to
+    // answer the last entries. no dump is asked for until then
+    if (d->restore != NULL) {
+        if (d->restore_pos + 2 <= d->restore_size || tx->head != tx->tail)
+            return GPS_DEV_DBD_ACK_WAIT;
+        if (d->restore_end == 0)
+            d->restore_end = now + GPS_DEV_DBD_ACK_WAIT * 1000000LL;
+        if (now < d->restore_end)
+            return (int) ((d->restore_end - now + 999999) / 1000000);
+        D("navigation database restored: %d entries, %d rejected", d->restore_count, d->rejected);
+        free(d->restore);
+        d->restore = NULL;
+    }
+
+    if (d->dumping && now >= d->dump_idle)
+        gps_dev_dbd_done(d);
+    if (d->dumping)
+        return (int) ((d->dump_idle - now + 999999) / 1000000);
+
+    if (!active || dbd_period_ms <= 0) {
+        d->dump_due = 0;
+        return -1;
+    }
+    if (d->dump_due == 0)
+        d->dump_due = now + dbd_period_ms * 1000000LL;
+    if (now >= d->dump_due) {
+        d->dump_due = now + dbd_period_ms * 1000000LL;
+        if (gps_dev_dbd_poll(fd, now))
+            return GPS_DEV_DBD_IDLE;
+    }
+    return (int) ((d->dump_due - now + 999999) / 1000000);
 }
 
 
-static int
-serial_gps_inject_time(GpsUtcTime time, int64_t timeReference, int uncertainty)
+/* quitting: dump the database, unless a recent one was saved.
+ * returns 1 if a dump is under way.
+ */
+static int gps_dev_dbd_quit(int fd, int64_t now)
 {
-    return 0;
+    GpsDevDbd *d = _gps_dbd;
+
+    if (d->dumping)
+        return 1;
+    if (d->dump_last != 0 && now - d->dump_last < GPS_DEV_DBD_FRESH * 1000000LL)
+        return 0;
+    return gps_dev_dbd_poll(fd, now);
 }
 
 
-static int
-serial_gps_inject_location(double latitude, double longitude, float accuracy)
+static int gps_dev_dbd_busy(void)
 {
-    return 0;
+    return _gps_dbd->dumping;
 }
 
-static void
-serial_gps_delete_aiding_data(GpsAidingData flags)
+
+static void gps_dev_dbd_reset(void)
 {
+    // the last dump is on disk before cleanup() returns
+    pthread_mutex_lock(&_gps_dbd_writer.lock);
+    while (_gps_dbd_writer.running > 0)
+        pthread_cond_wait(&_gps_dbd_writer.idle, &_gps_dbd_writer.lock);
+    pthread_mutex_unlock(&_gps_dbd_writer.lock);
+
+    free(_gps_dbd->dump);
+    free(_gps_dbd->restore);
+    memset(_gps_dbd, 0, sizeof(*_gps_dbd));
 }
 
-static int serial_gps_set_position_mode(GpsPositionMode mode, GpsPositionRecurrence recurrence,
-        uint32_t min_interval, uint32_t preferred_accuracy, uint32_t preferred_time)
-{
-    GpsState*  s = _gps_state;
 
-    if (!s->init) {
-        D("%s: called with uninitialized state !!", __FUNCTION__);
-        return -1;
+/* delete the aiding data with a GNSS-only reset, which keeps the
+ * configuration and the link, and forget the saved database.
+ */
+static void gps_dev_delete_aiding(int fd, uint32_t flags)
+{
+    static const struct {
+        uint32_t aiding;        /* GPS_DELETE_* */
+        uint16_t bbr;           /* CFG-RST navBbrMask */
+    } map[] = {
+        { GPS_DELETE_EPHEMERIS, 0x0001 },
+        { GPS_DELETE_ALMANAC,   0x0002 },
+        { GPS_DELETE_HEALTH,    0x0004 },
+        { GPS_DELETE_IONO,      0x0008 },
+        { GPS_DELETE_POSITION,  0x0010 },
+        { GPS_DELETE_UTC,       0x0080 },
+        { GPS_DELETE_TIME,      0x0100 },
+        { GPS_DELETE_SVDIR,     0x8000 },   /* AssistNow Autonomous */
+        { GPS_DELETE_SVSTEER,   0x8000 },
+        { GPS_DELETE_SADATA,    0x8000 },
+    };
+    unsigned char payload[4];
+    uint16_t bbr = 0;
+    unsigned int i;
+
+    if (flags == GPS_DELETE_ALL) {
+        bbr = 0xFFFF;   /* cold start */
+    } else {
+        for (i = 0; i < sizeof(map) / sizeof(map[0]); ++i)
+            if (flags & map[i].aiding)
+                bbr |= map[i].bbr;
     }
+    if (bbr == 0)
+        return;
 
-    D("set_position_mode: mode=%d recurrence=%d min_interval=%d preferred_accuracy=%d preferred_time=%d",
-            mode, recurrence, min_interval, preferred_accuracy, preferred_time);
+    payload[0] = (unsigned char) bbr;
+    payload[1] = (unsigned char) (bbr >> 8);
+    payload[2] = 0x02;      /* controlled software reset, GNSS only */
+    payload[3] = 0;
 
-    return 0;
+    D("deleting aiding data %04x: navBbrMask %04x", flags, bbr);
+    gps_dev_send_ubx(fd, UBX_CLASS_CFG, UBX_CFG_RST, payload, sizeof(payload));
+
+    // the saved database would bring it all back
+    free(_gps_dbd->restore);
+    _gps_dbd->restore = NULL;
+    _gps_dbd->dumping = 0;
+    if (dbd_path[0])
+        gps_dev_dbd_job(NULL, 0, 0);
 }
 
 
-static const void*
-serial_gps_get_extension(const char* name)
+/* configure what the receiver sends, at init and when a session starts,
+ * as the receiver may have been reset meanwhile
+ */
+static void gps_dev_set_output(int fd)
 {
-    return NULL;
+    if (ubx_mode)
+        gps_dev_set_ubx_output(fd);
+    else if (nmea_filter)
+        gps_dev_set_nmea_output(fd);
 }
 
 
-static const GpsInterface  serialGpsInterface = {
-    sizeof(GpsInterface),
-    serial_gps_init,
-    serial_gps_start,
-    serial_gps_stop,
-    serial_gps_cleanup,
-    serial_gps_inject_time,
-    serial_gps_inject_location,
-    serial_gps_delete_aiding_data,
-    serial_gps_set_position_mode,
-    serial_gps_get_extension,
+/* baud rates the HAL can set on the serial port. faster rates than the
+ * receiver's power-up rate are negotiated with UBX CFG-PRT.
+ */
+static const struct {
+    unsigned long  rate;
+    speed_t        code;
+} gps_dev_bauds[] = {
+    {   4800, B4800   },
+    {   9600, B9600   },
+    {  19200, B19200  },
+    {  38400, B38400  },
+    {  57600, B57600  },
+    { 115200, B115200 },
+#ifdef B230400
+    { 230400, B230400 },
+#endif
+#ifdef B460800
+    { 460800, B460800 },
+#endif
+#ifdef B921600
+    { 921600, B921600 },
+#endif
 };
 
+#define GPS_DEV_PROBE_TIMEOUT   (300)   /* ms */
+#define GPS_DEV_PORT_UART1      (1)
+#define GPS_DEV_CFG_PRT_SIZE    (20)
 
-const GpsInterface* gps_get_hardware_interface()
+
+static int gps_dev_baud_supported(unsigned long baud)
 {
-    D("GPS dev get_hardware_interface");
-    return &serialGpsInterface;
+    unsigned int i;
+
+#if defined(__BIONIC__) && defined(BOTHER)
+    if (115200 < baud && baud <= 921600)
+        return 1;
+#endif
+    for (i = 0; i < sizeof(gps_dev_bauds) / sizeof(gps_dev_bauds[0]); ++i)
+    {
+        if (gps_dev_bauds[i].rate == baud)
+            return 1;
+    }
+    return 0;
 }
 
 
-/*****************************************************************/
-/*****************************************************************/
-/*****                                                       *****/
-/*****       D E V I C E                                     *****/
-/*****                                                       *****/
-/*****************************************************************/
-/*****************************************************************/
+static int gps_dev_set_baud(int fd, unsigned long baud)
+{
+    struct termios ios;
+    unsigned int i;
+
+#if defined(__BIONIC__) && defined(BOTHER)
+    // above 115200, program the exact rate through termios2
+    if (115200 < baud && baud <= 921600) {
+        struct termios2 ios2;
+
+        if (ioctl(fd, TCGETS2, &ios2) < 0)
+            return -1;
+        ios2.c_cflag &= ~CBAUD;
+        ios2.c_cflag |= BOTHER;
+        ios2.c_ispeed = baud;
+        ios2.c_ospeed = baud;
+        if (ioctl(fd, TCSETS2, &ios2) < 0)
+            return -1;
+        tcflush(fd, TCIOFLUSH);
+        return 0;
+    }
+#endif
+
+    for (i = 0; i < sizeof(gps_dev_bauds) / sizeof(gps_dev_bauds[0]); ++i)
+    {
+        if (gps_dev_bauds[i].rate == baud)
+            break;
+    }
+    if (i == sizeof(gps_dev_bauds) / sizeof(gps_dev_bauds[0]))
+        return -1;
+
+    if (tcgetattr(fd, &ios) < 0)
+        return -1;
+    cfsetispeed(&ios, gps_dev_bauds[i].code);
+    cfsetospeed(&ios, gps_dev_bauds[i].code);
+    if (tcsetattr(fd, TCSANOW, &ios) < 0)
+        return -1;
+    tcflush(fd, TCIOFLUSH);
+    return 0;
+}
 
-static void gps_dev_send(int fd, char *msg, int size)
+
+/* wait for the UBX answer to a poll of cls/id, followed by its ACK-ACK.
+ * this is only used during the device bring-up, before the fd is made
+ * non-blocking and the epoll loop starts.
+ * returns the answer's payload length, or -1 on NAK or timeout.
+ */
+static int gps_dev_wait_ubx(int fd, unsigned char cls, unsigned char id, unsigned char *payload, int size, int timeout_ms)
 {
-    int n = 0;
-    do {
+    unsigned char buff[UBX_MAX_SIZE * 2];
+    int len = 0, answer = -1;
+    struct timespec start, now;
 
-        int ret = write(fd, msg + n, size - n);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for (;;) {
+        struct pollfd pfd = { fd, POLLIN, 0 };
+        int elapsed, ret, n;
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        elapsed = (now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000;
+        if (elapsed >= timeout_ms)
+            return -1;
+
+        ret = poll(&pfd, 1, timeout_ms - elapsed);
+        if (ret < 0 && errno != EINTR)
+            return -1;
+        if (ret <= 0)
+            continue;
 
-        if (ret < 0 && errno == EINTR) {
+        if (len == sizeof(buff))
+            len = 0;
+        ret = read(fd, buff + len, sizeof(buff) - len);
+        if (ret <= 0)
             continue;
+        len += ret;
+
+        // look for complete frames, drop everything before them
+        for (n = 0; n + UBX_HEADER_SIZE + 2 <= len; ) {
+            unsigned char ck_a, ck_b;
+            int plen, fsize;
+
+            if (buff[n] != UBX_SYNC_CHAR1 || buff[n+1] != UBX_SYNC_CHAR2) {
+                n++;
+                continue;
+            }
+            plen  = buff[n+4] | (buff[n+5] << 8);
+            fsize = UBX_HEADER_SIZE + plen + 2;
+            if (plen > UBX_MAX_PAYLOAD) {
+                n++;
+                continue;
+            }
+            if (n + fsize > len)
+                break;
+
+            gps_dev_calc_ubx_csum(buff + n + 2, plen + 4, &ck_a, &ck_b);
+            if (ck_a != buff[n + fsize - 2] || ck_b != buff[n + fsize - 1]) {
+                n++;
+                continue;
+            }
+
+            if (buff[n+2] == cls && buff[n+3] == id) {
+                answer = (plen < size) ? plen : size;
+                memcpy(payload, buff + n + UBX_HEADER_SIZE, answer);
+            } else if (buff[n+2] == UBX_CLASS_ACK && plen == 2 &&
+                       buff[n+6] == cls && buff[n+7] == id) {
+                if (buff[n+3] == UBX_ACK_NAK)
+                    return -1;
+                if (answer >= 0)
+                    return answer;
+            }
+            n += fsize;
         }
+        memmove(buff, buff + n, len - n);
+        len -= n;
+    }
+}
 
-        n += ret;
 
-    } while (n < size);
+/* poll the configuration of the receiver's UART at the given baud rate */
+static int gps_dev_probe_baud(int fd, unsigned long baud, unsigned char *prt)
+{
+    unsigned char port = GPS_DEV_PORT_UART1;
+
+    if (gps_dev_set_baud(fd, baud) < 0)
+        return -1;
+
+    gps_dev_write_ubx(fd, UBX_CLASS_CFG, UBX_CFG_PRT, &port, 1);
+    if (gps_dev_wait_ubx(fd, UBX_CLASS_CFG, UBX_CFG_PRT, prt, GPS_DEV_CFG_PRT_SIZE, GPS_DEV_PROBE_TIMEOUT) != GPS_DEV_CFG_PRT_SIZE)
+        return -1;
+
+    D("receiver answers at %lu baud", baud);
+    return 0;
 }
 
 
-static void gps_dev_calc_ubx_csum(unsigned char *msg, int size, unsigned char *ck_a, unsigned char *ck_b)
+/* find the baud rate the receiver currently uses, trying 'baud' first.
+ * returns 0 if it does not answer at any rate.
+ */
+static unsigned long gps_dev_find_baud(int fd, unsigned long baud, unsigned char *prt)
 {
-    *ck_a = *ck_b = 0;
-    for (int i = 0; i < size; ++i)
+    unsigned int i;
+
+    if (gps_dev_probe_baud(fd, baud, prt) == 0)
+        return baud;
+
+    for (i = 0; i < sizeof(gps_dev_bauds) / sizeof(gps_dev_bauds[0]); ++i)
     {
-        *ck_a += msg[i];
-        *ck_b += *ck_a;
+        if (gps_dev_bauds[i].rate != baud &&
+            gps_dev_probe_baud(fd, gps_dev_bauds[i].rate, prt) == 0)
+            return gps_dev_bauds[i].rate;
     }
+    return 0;
 }
 
 
-static void gps_dev_set_meas_rate(int fd, unsigned short period_ms)
+/* move the receiver from its current baud rate, expected to be 'baud',
+ * to 'target' with CFG-PRT. returns the rate the link ends up using.
+ */
+static unsigned long gps_dev_negotiate_baud(int fd, unsigned long baud, unsigned long target)
 {
-    // B5 62 06 08 06 00 F4 01 01 00 01 00 0B 77
-    unsigned char buff[14] = "\xB5\x62\x06\x08\x06\x00";
+    unsigned char prt[GPS_DEV_CFG_PRT_SIZE];
+    unsigned long current;
+
+    current = gps_dev_find_baud(fd, baud, prt);
+    if (!current) {
+        ALOGE("GPS receiver does not answer UBX polls, keeping %lu baud", baud);
+        gps_dev_set_baud(fd, baud);
+        return baud;
+    }
 
-    *((unsigned short *)(buff + 6)) = period_ms;
-    *((unsigned short *)(buff + 8)) = 1;
-    *((unsigned short *)(buff + 10)) = 1;
+    if (current == target)
+        return current;
 
-    gps_dev_calc_ubx_csum(buff + 2, 10, buff + 12, buff + 13);
+    // make sure the serial port supports the new rate before asking for it
+    if (gps_dev_set_baud(fd, target) < 0) {
+        ALOGE("GPS baud rate %lu is not supported by the serial port", target);
+        gps_dev_set_baud(fd, current);
+        return current;
+    }
+    gps_dev_set_baud(fd, current);
+
+    // change the rate, keeping the port mode and protocol masks
+    prt[8]  = (unsigned char) target;
+    prt[9]  = (unsigned char) (target >> 8);
+    prt[10] = (unsigned char) (target >> 16);
+    prt[11] = (unsigned char) (target >> 24);
+    gps_dev_write_ubx(fd, UBX_CLASS_CFG, UBX_CFG_PRT, prt, sizeof(prt));
+    tcdrain(fd);
+    usleep(100 * 1000);
+
+    if (gps_dev_probe_baud(fd, target, prt) == 0) {
+        ALOGI("GPS receiver switched from %lu to %lu baud", current, target);
+        return target;
+    }
 
-    gps_dev_send(fd, (char *)buff, sizeof(buff));
+    ALOGE("GPS receiver did not switch to %lu baud, falling back", target);
+    current = gps_dev_find_baud(fd, current, prt);
+    if (!current) {
+        ALOGE("GPS receiver lost, keeping %lu baud", baud);
+        gps_dev_set_baud(fd, baud);
+        return baud;
+    }
+    return current;
 }
 
-
 static int open_gps(const struct hw_module_t* module, char const* name, struct hw_device_t** device)
 {
     D("GPS dev open_gps");
@@ -0,0 +1,110 @@
+/*
+ * Extensions of the serial GPS HAL, returned by get_extension().
+ */
+#ifndef GPS_SERIAL_H
+#define GPS_SERIAL_H
+
+#include <stdint.h>
+#include <hardware/gps.h>
+
+__BEGIN_DECLS
+
+/**
+ * Name for the read-time interface.
+ */
+#define GPS_SERIAL_TIMING_INTERFACE  "serial-gps-timing"
+
+/**
+ * Gives the CLOCK_BOOTTIME time, in nanoseconds, at which the data of a
+ * report was read from the serial line, so that consumers can account for
+ * the receiver, UART and HAL latency (like elapsedRealtimeNanos).
+ *
+ * For a location, this is the time at which the first byte of the first
+ * sentence of its epoch (or of its UBX NAV-PVT message) was read; for an
+ * NMEA sentence, the time at which its first byte was read.
+ *
+ * Both functions may only be called from within the location_cb or
+ * nmea_cb the report is passed to, with the pointer it was given. They
+ * return -1 otherwise.
+ */
+typedef struct {
+    /** set to sizeof(GpsSerialTimingInterface) */
+    size_t          size;
+
+    int64_t (*get_location_elapsed_realtime)( const GpsLocation* location );
+
+    int64_t (*get_nmea_elapsed_realtime)( const char* nmea );
+} GpsSerialTimingInterface;
+
+/**
+ * Name for the batching interface.
+ */
+#define GPS_SERIAL_BATCHING_INTERFACE  "serial-gps-batching"
+
+/** Deliver the batch when the buffer is full, instead of dropping fixes.
+ *  While the previous batch is still in the callback, one full buffer more
+ *  is kept; fixes are only dropped if the buffer fills up again before the
+ *  callback returns. */
+#define GPS_BATCH_WAKEUP_ON_FULL    0x0001
+/** When the buffer is full, drop the new fixes rather than the oldest ones */
+#define GPS_BATCH_KEEP_OLDEST       0x0002
+
+/**
+ * Receives a batch of fixes, oldest first. Called from the thread that
+ * delivers the other GpsCallbacks, the one made with create_thread_cb, or
+ * from the GPS thread if it could not be created. The array is only
+ * valid during the call.
+ */
+typedef void (* gps_batch_location_callback)( int num_locations, GpsLocation* locations );
+
+typedef struct {
+    /** set to sizeof(GpsSerialBatchingCallbacks) */
+    size_t                       size;
+    gps_batch_location_callback  batch_location_cb;
+} GpsSerialBatchingCallbacks;
+
+typedef struct {
+    /** set to sizeof(GpsSerialBatchOptions) */
+    size_t      size;
+    /** GPS_BATCH_* */
+    uint32_t    flags;
+    /** time between fixes, in milliseconds */
+    uint32_t    min_interval;
+    /** time between deliveries, in milliseconds, 0 to only deliver on
+     *  flush(), stop() or a full buffer */
+    uint32_t    flush_period;
+} GpsSerialBatchOptions;
+
+/**
+ * Stores fixes in the HAL while the application processor sleeps, and
+ * delivers them together. While a batch runs outside a GPS session
+ * (start()/stop() of GpsInterface), its fixes are not reported to
+ * location_cb; during a session they are reported and stored.
+ *
+ * The buffer holds get_batch_size() fixes, as set by the
+ * ro.kernel.android.gps.batch_size property.
+ */
+typedef struct {
+    /** set to sizeof(GpsSerialBatchingInterface) */
+    size_t          size;
+
+    /** returns 0 on success, -1 if the GPS is not initialized */
+    int   (*init)( GpsSerialBatchingCallbacks* callbacks );
+
+    int   (*get_batch_size)( void );
+
+    /** starts a batch, or changes the options of the running one */
+    int   (*start)( const GpsSerialBatchOptions* options );
+
+    /** delivers the fixes stored so far */
+    void  (*flush)( void );
+
+    /** delivers the fixes left, and stops storing them */
+    int   (*stop)( void );
+
+    void  (*cleanup)( void );
+} GpsSerialBatchingInterface;
+
+__END_DECLS
+
+#endif /* GPS_SERIAL_H */
@@ -0,0 +1,180 @@
+/*
+ * Host replay benchmark for the serial GPS HAL parser.
+ *
+ * Recorded receiver logs (NMEA, UBX or a mix of both) are loaded in
+ * memory and fed through the same framer the reader thread uses, in
+ * read()-sized chunks. Callbacks are delivered synchronously and only
+ * counted, so the figures reflect the parser alone.
+ *
+ *   gps_bench [-n repeat] [-c chunk] log...
+ */
+
+#include "gps.c"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+typedef struct {
+    unsigned long  location;
+    unsigned long  sv_status;
+    unsigned long  status;
+    unsigned long  nmea;
+} BenchCounts;
+
+static BenchCounts  counts;
+
+static void
+bench_location_cb( GpsLocation*  location )
+{
+    counts.location++;
+}
+
+static void
+bench_status_cb( GpsStatus*  status )
+{
+    counts.status++;
+}
+
+static void
+bench_sv_status_cb( GpsSvStatus*  sv_info )
+{
+    counts.sv_status++;
+}
+
+static void
+bench_nmea_cb( GpsUtcTime  timestamp, const char*  nmea, int  length )
+{
+    counts.nmea++;
+}
+
+static GpsCallbacks  bench_callbacks = {
+    .size         = sizeof(GpsCallbacks),
+    .location_cb  = bench_location_cb,
+    .status_cb    = bench_status_cb,
+    .sv_status_cb = bench_sv_status_cb,
+    .nmea_cb      = bench_nmea_cb,
+};
+
+
+static char*
+bench_load( const char*  path, size_t*  size )
+{
+    FILE*   f = fopen(path, "rb");
+    char*   data;
+    long    len;
+
+    if (f == NULL) {
+        perror(path);
+        return NULL;
+    }
+
+    fseek(f, 0, SEEK_END);
+    len = ftell(f);
+    fseek(f, 0, SEEK_SET);
+
+    data = malloc(len > 0 ? len : 1);
+    if (data == NULL || fread(data, 1, len, f) != (size_t) len) {
+        fprintf(stderr, "%s: could not read %ld bytes\n", path, len);
+        free(data);
+        fclose(f);
+        return NULL;
+    }
+
+    fclose(f);
+    *size = (size_t) len;
+    return data;
+}
+
+
+static void
+bench_feed( NmeaFramer*  framer, NmeaReader*  reader,
+            const char*  data, size_t  size, int  chunk )
+{
+    size_t  off = 0;
+
+    while (off < size) {
+        char*  p;
+        int    room = nmea_framer_space(framer, &p);
+        int    n    = (size - off < (size_t) chunk) ? (int)(size - off) : chunk;
+
+        if (n > room)
+            n = room;
+
+        memcpy(p, data + off, n);
+        nmea_framer_commit(framer, reader, n, gps_clock_ns(CLOCK_BOOTTIME));
+        off += n;
+    }
+}
+
+
+static double
+bench_now( void )
+{
+    struct timespec  ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+
+int
+main( int  argc, char**  argv )
+{
+    static NmeaFramer  framer[1];
+    NmeaReader         reader[1];
+    int                repeat = 100;
+    int                chunk  = 64;
+    int                opt, i, n;
+    size_t             bytes = 0;
+    double             start, elapsed;
+
+    while ((opt = getopt(argc, argv, "n:c:")) != -1) {
+        switch (opt) {
+        case 'n': repeat = atoi(optarg); break;
+        case 'c': chunk  = atoi(optarg); break;
+        default:
+            fprintf(stderr, "usage: %s [-n repeat] [-c chunk] log...\n", argv[0]);
+            return 1;
+        }
+    }
+
+    if (optind >= argc || repeat <= 0 || chunk <= 0) {
+        fprintf(stderr, "usage: %s [-n repeat] [-c chunk] log...\n", argv[0]);
+        return 1;
+    }
+
+    // no dispatch thread: events are delivered from the parser itself
+    _gps_state->init       = 1;
+    _gps_state->callbacks  = &bench_callbacks;
+    _gps_events->callbacks = &bench_callbacks;
+
+    for (i = optind; i < argc; i++) {
+        size_t  size;
+        char*   data = bench_load(argv[i], &size);
+
+        if (data == NULL)
+            return 1;
+
+        memset(&counts, 0, sizeof(counts));
+        nmea_reader_init(reader);
+        nmea_framer_init(framer);
+
+        start = bench_now();
+        for (n = 0; n < repeat; n++)
+            bench_feed(framer, reader, data, size, chunk);
+        elapsed = bench_now() - start;
+
+        bytes = size * (size_t) repeat;
+        printf("%s: %zu bytes x %d in %.3f s\n", argv[i], size, repeat, elapsed);
+        printf("  %.0f sentences/s, %.2f MB/s, %.1f ns/sentence\n",
+               counts.nmea / elapsed, bytes / elapsed / 1e6,
+               counts.nmea ? elapsed * 1e9 / counts.nmea : 0.0);
+        printf("  callbacks: nmea %lu, location %lu, sv_status %lu, status %lu\n",
+               counts.nmea, counts.location, counts.sv_status, counts.status);
+        printf("  rejected: %u bad checksums\n", reader->bad_checksum);
+
+        free(data);
+    }
+
+    return 0;
+}
@@ -0,0 +1,155 @@
+/*
+ * Host checks of the NMEA field parsers, on inputs that recorded logs do
+ * not cover: fields a receiver never sends, but a corrupted line may, and
+ * the change of date at midnight.
+ *
+ *   gps_parse_test
+ */
+
+#include "gps.c"
+
+#include <stdio.h>
+
+static int  failures;
+
+#define  CHECK(cond)                                                  \
+    do {                                                              \
+        if (!(cond)) {                                                \
+            fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond); \
+            failures++;                                               \
+        }                                                             \
+    } while (0)
+
+
+static int
+parse( const char*  s, NmeaFixed*  f )
+{
+    return str2fixed(s, s + strlen(s), f);
+}
+
+
+static void
+test_str2fixed( void )
+{
+    NmeaFixed  f;
+
+    CHECK(parse("4807.038", &f) == 0 && f.mant == 4807038 && f.scale == 3);
+    CHECK(parse("-0.5", &f) == 0 && f.mant == -5 && f.scale == 1);
+    CHECK(parse("", &f) < 0);
+    CHECK(parse("1.2.3", &f) < 0);
+
+    // zeroes after the point count toward the digits kept
+    CHECK(parse("0.00000000000000000000005", &f) == 0 && f.mant == 0 &&
+          f.scale <= FIXED_MAX_DIGITS);
+    CHECK(parse("0.000000000000000001", &f) == 0 && f.mant == 1 && f.scale == 18);
+    CHECK(parse("0.0000000000000000001", &f) == 0 && f.mant == 0 &&
+          f.scale <= FIXED_MAX_DIGITS);
+    CHECK(parse("1.00000000000000000000000009", &f) == 0 &&
+          f.scale <= FIXED_MAX_DIGITS && f.mant == pow10_table[f.scale]);
+
+    // integer parts beyond the mantissa are rejected
+    CHECK(parse("123456789012345678", &f) == 0 && f.mant == 123456789012345678LL);
+    CHECK(parse("1234567890123456789", &f) < 0);
+    CHECK(parse("000000000000000000001", &f) == 0 && f.mant == 1 && f.scale == 0);
+}
+
+
+static void
+test_fixed_rescale( void )
+{
+    NmeaFixed  f;
+    int64_t    v;
+
+    CHECK(parse("1.5", &f) == 0 && fixed_rescale(f, 0, &v) == 0 && v == 2);
+    CHECK(parse("-1.5", &f) == 0 && fixed_rescale(f, 0, &v) == 0 && v == -2);
+    CHECK(parse("12.345", &f) == 0 && fixed_rescale(f, 9, &v) == 0 && v == 12345000000LL);
+
+    // out of range either way
+    CHECK(parse("123456789012345678", &f) == 0 && fixed_rescale(f, 9, &v) < 0);
+    CHECK(parse("-123456789012345678", &f) == 0 && fixed_rescale(f, 9, &v) < 0);
+    CHECK(parse("9223372036", &f) == 0 && fixed_rescale(f, 9, &v) == 0 && v == 9223372036000000000LL);
+    CHECK(parse("9223372037", &f) == 0 && fixed_rescale(f, 9, &v) < 0);
+    CHECK(parse("0.000000000000000009", &f) == 0 && fixed_rescale(f, 0, &v) == 0 && v == 0);
+    CHECK(parse("0", &f) == 0 && fixed_rescale(f, 18, &v) == 0 && v == 0);
+    f.mant = 7; f.scale = 18;
+    CHECK(fixed_rescale(f, -1, &v) == 0 && v == 0);
+    f.mant = 7; f.scale = 0;
+    CHECK(fixed_rescale(f, 19, &v) < 0);
+}
+
+
+static void
+test_convert_from_hhmm( void )
+{
+    static const char  good[] = "4807.038", huge[] = "123456789012345678.0";
+    Token              tok;
+    int64_t            nanodeg;
+
+    tok.p = good; tok.end = good + sizeof(good) - 1;
+    CHECK(convert_from_hhmm(tok, &nanodeg) == 0 && nanodeg == 48117300000LL);
+
+    tok.p = huge; tok.end = huge + sizeof(huge) - 1;
+    CHECK(convert_from_hhmm(tok, &nanodeg) < 0);
+}
+
+
+static void
+test_str2float( void )
+{
+    static const char  a[] = "0.00000000000000000000005", b[] = "545.4";
+
+    CHECK(str2float(a, a + sizeof(a) - 1) == 0.);
+    CHECK(str2float(b, b + sizeof(b) - 1) == 545.4);
+}
+
+
+static int64_t
+update_time( NmeaReader*  r, const char*  hhmmss )
+{
+    Token    tok = { hhmmss, hhmmss + strlen(hhmmss) };
+    int64_t  ms  = -1;
+
+    nmea_reader_update_time(r, tok, &ms);
+    return ms;
+}
+
+
+static void
+test_midnight( void )
+{
+    NmeaReader  r[1];
+
+    // RMC gives the new date with the first time of the day
+    nmea_reader_init(r);
+    nmea_reader_set_date(r, 2024, 12, 31);
+    CHECK(update_time(r, "235959.00") == 1735689599000LL);
+    nmea_reader_set_date(r, 2025, 1, 1);
+    CHECK(update_time(r, "000000.00") == 1735689600000LL);
+    CHECK(update_time(r, "000001.00") == 1735689601000LL);
+
+    // only GGA: the time of day wraps, and the date follows later
+    nmea_reader_init(r);
+    nmea_reader_set_date(r, 2024, 12, 31);
+    CHECK(update_time(r, "235959.00") == 1735689599000LL);
+    CHECK(update_time(r, "000000.00") == 1735689600000LL);
+    nmea_reader_set_date(r, 2025, 1, 1);
+    CHECK(update_time(r, "000001.00") == 1735689601000LL);
+}
+
+
+int
+main( void )
+{
+    test_str2fixed();
+    test_fixed_rescale();
+    test_convert_from_hhmm();
+    test_str2float();
+    test_midnight();
+
+    if (failures) {
+        fprintf(stderr, "%d checks failed\n", failures);
+        return 1;
+    }
+    printf("all checks passed\n");
+    return 0;
+}
@@ -0,0 +1,777 @@
+/*
+ * End-to-end latency harness for the serial GPS HAL.
+ *
+ * A simulated u-blox receiver drives the master side of a pseudo-terminal
+ * whose slave is handed to the HAL through ro.kernel.android.gps, so the
+ * whole gps_state_init -> gps_state_thread -> callback path runs as it
+ * does on a device. The receiver streams one epoch of NMEA sentences (or
+ * UBX NAV-SAT/NAV-PVT with -u, or a recorded log with -f) per measurement
+ * navigation solution, paced at the configured baud rate, and follows the
+ * CFG-RATE and CFG-MSG requests of the HAL, answering them with ACK-ACK. Noise,
+ * partial writes, lost CFG messages and a hangup can be injected, a fix
+ * interval requested with set_position_mode(), and the time and location
+ * injected before the start (-a), which the HAL sends as MGA-INI aiding.
+ * With -d, the receiver dumps a navigation database of SIM_DBD_ENTRIES
+ * MGA-DBD messages when polled, and the HAL keeps it in the given file:
+ * a second run with the same file shows it sent back at init.
+ *
+ * For every fix, the latency from the last byte of its epoch leaving the
+ * simulator to location_cb is recorded, and percentiles are reported.
+ *
+ *   gps_sim [-u] [-f log] [-n epochs] [-r rate_ms] [-i interval_ms] [-b baud]
+ *           [-e end] [-N noise] [-A loss] [-a] [-d file] [-p] [-H epoch] [-s seed]
+ */
+
+#define _GNU_SOURCE  // posix_openpt() and friends
+
+#include "gps.c"
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define  SIM_MAX_RECORD   (UBX_MAX_SIZE)
+#define  SIM_HISTORY      256
+#define  SIM_DBD_ENTRIES  40
+
+/* one sentence or UBX frame, tagged with the UTC time of its epoch */
+typedef struct {
+    int            tod;        // UTC time of day (ms)
+    int            size;
+    unsigned char  data[ SIM_MAX_RECORD ];
+} SimRecord;
+
+typedef struct {
+    int       tod;
+    int64_t   written;         // CLOCK_MONOTONIC (ns) of the epoch's last byte
+} SimEpoch;
+
+typedef struct {
+    int              fd;
+    int              ubx;
+    int              epochs;
+    unsigned         baud;
+    int              noise;    // per mille of records corrupted
+    int              cfg_loss; // per mille of CFG messages lost
+    int              partial;
+    int              hangup;   // epoch after which the line drops, or -1
+    unsigned         seed;
+    int              period;   // ms, as set by CFG-RATE
+    int              nav_rate; // measurements per solution, as set by CFG-RATE
+    int64_t          line_free;
+    int64_t          last_write;
+
+    // recorded log replay
+    unsigned char*   log;
+    size_t           log_size;
+    size_t           log_pos;
+
+    // HAL -> receiver
+    unsigned char    in[ UBX_MAX_SIZE ];
+    int              in_len;
+    int              cfg_rate;
+    int              cfg_other;
+    int              cfg_lost;
+    int              mga_time;         // MGA-INI-TIME_UTC received
+    int              mga_pos;          // MGA-INI-POS_LLH received
+    int              dbd_polls;        // MGA-DBD polls answered
+    int              dbd_restored;     // MGA-DBD entries received
+    unsigned char    nmea_rate[ 16 ];  // per NMEA message id (class 0xF0), as set by CFG-MSG
+    unsigned char    sat_rate;         // NAV-SAT, as set by CFG-MSG
+    long long        bytes;            // sent to the HAL
+
+    // fix latency bookkeeping, shared with location_cb
+    pthread_mutex_t  lock;
+    SimEpoch         history[ SIM_HISTORY ];
+    int              written;
+    int64_t*         latency;
+    int              fixes;
+    int              unmatched;
+    int64_t          init;             // CLOCK_MONOTONIC (ns) of init()
+    int64_t          init_done;        // CLOCK_MONOTONIC (ns) of the return of init()
+    int64_t          engine_on;        // CLOCK_MONOTONIC (ns) of GPS_STATUS_ENGINE_ON
+    int64_t          started;          // CLOCK_MONOTONIC (ns) of start()
+    int64_t          first_fix;        // CLOCK_MONOTONIC (ns) of the first location_cb
+    int              corrupted;
+} SimState;
+
+static SimState  _sim[1];
+
+
+static int64_t
+sim_now( void )
+{
+    struct timespec  ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+
+static void
+sim_sleep_until( int64_t  t )
+{
+    struct timespec  ts = { t / 1000000000LL, t % 1000000000LL };
+
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+        ;
+}
+
+
+/*****************************************************************/
+/*****************************************************************/
+/*****                                                       *****/
+/*****       R E C E I V E R                                 *****/
+/*****                                                       *****/
+/*****************************************************************/
+/*****************************************************************/
+
+static void
+sim_nmea( SimRecord*  rec, const char*  fmt, ... )
+{
+    va_list        args;
+    unsigned char  sum = 0;
+    int            n, i;
+
+    va_start(args, fmt);
+    n = vsnprintf((char*) rec->data + 1, SIM_MAX_RECORD - 8, fmt, args);
+    va_end(args);
+
+    rec->data[0] = '$';
+    for (i = 1; i <= n; i++)
+        sum ^= rec->data[i];
+    rec->size = 1 + n + snprintf((char*) rec->data + 1 + n, 6, "*%02X\r\n", sum);
+}
+
+
+static void
+sim_ubx( SimRecord*  rec, unsigned char  cls, unsigned char  id, const void*  payload, int  len )
+{
+    rec->data[0] = UBX_SYNC_CHAR1;
+    rec->data[1] = UBX_SYNC_CHAR2;
+    rec->data[2] = cls;
+    rec->data[3] = id;
+    rec->data[4] = (unsigned char) len;
+    rec->data[5] = (unsigned char) (len >> 8);
+    memcpy(rec->data + UBX_HEADER_SIZE, payload, len);
+    gps_dev_calc_ubx_csum(rec->data + 2, len + 4, rec->data + UBX_HEADER_SIZE + len,
+                          rec->data + UBX_HEADER_SIZE + len + 1);
+    rec->size = UBX_HEADER_SIZE + len + 2;
+}
+
+
+/* build the synthetic epoch number k, returns the number of records */
+static int
+sim_make_epoch( SimState*  s, int  k, int  tod, SimRecord*  recs )
+{
+    static const int  prn[12] = { 2, 5, 6, 9, 12, 14, 17, 19, 22, 25, 29, 31 };
+    int     hh = tod / 3600000, mm = tod / 60000 % 60, ss = tod / 1000 % 60, ms = tod % 1000;
+    double  lat = 4807.038 + k * 0.0001;
+    double  lon = 1131.000 + k * 0.0001;
+    int     n = 0, i, j;
+
+    if (s->ubx) {
+        unsigned char  sat[ sizeof(UbxNavSat) + 12 * sizeof(UbxNavSatSv) ];
+        UbxNavSat*     hdr = (UbxNavSat*) sat;
+        UbxNavPvt      pvt;
+
+        memset(sat, 0, sizeof(sat));
+        hdr->version = 1;
+        hdr->numSvs  = 12;
+        for (i = 0; i < 12; i++) {
+            UbxNavSatSv*  sv = (UbxNavSatSv*)(sat + sizeof(UbxNavSat)) + i;
+            sv->gnssId = UBX_GNSS_GPS;
+            sv->svId   = prn[i];
+            sv->cno    = 30 + i;
+            sv->elev   = 10 + 6 * i;
+            sv->azim   = 30 * i;
+            sv->flags  = (i < 8) ? UBX_SAT_SV_USED : 0;
+        }
+        sim_ubx(&recs[n++], UBX_CLASS_NAV, UBX_NAV_SAT, sat, sizeof(sat));
+
+        memset(&pvt, 0, sizeof(pvt));
+        pvt.year    = 2024;
+        pvt.month   = 1;
+        pvt.day     = 1;
+        pvt.hour    = hh;
+        pvt.min     = mm;
+        pvt.sec     = ss;
+        pvt.nano    = ms * 1000000;
+        pvt.valid   = UBX_PVT_VALID_DATE | UBX_PVT_VALID_TIME;
+        pvt.fixType = 3;
+        pvt.flags   = UBX_PVT_GNSS_FIX_OK;
+        pvt.numSV   = 8;
+        pvt.lat     = (int32_t)((48.0 + (lat - 4800.0) / 60.0) * 1e7);
+        pvt.lon     = (int32_t)((11.0 + (lon - 1100.0) / 60.0) * 1e7);
+        pvt.hMSL    = 545400;
+        pvt.hAcc    = 2500;
+        pvt.gSpeed  = 11524;
+        pvt.headMot = 8440000;
+        sim_ubx(&recs[n++], UBX_CLASS_NAV, UBX_NAV_PVT, &pvt, sizeof(pvt));
+    } else {
+        char  t[16];
+
+        snprintf(t, sizeof(t), "%02d%02d%02d.%02d", hh, mm, ss, ms / 10);
+        sim_nmea(&recs[n++], "GPRMC,%s,A,%.5f,N,%011.5f,E,022.4,084.4,010124,,,A", t, lat, lon);
+        sim_nmea(&recs[n++], "GPVTG,084.4,T,,M,022.4,N,041.5,K,A");
+        sim_nmea(&recs[n++], "GPGGA,%s,%.5f,N,%011.5f,E,1,08,0.9,545.4,M,46.9,M,,", t, lat, lon);
+        sim_nmea(&recs[n++], "GPGSA,A,3,%02d,%02d,%02d,%02d,%02d,%02d,%02d,%02d,,,,,1.8,0.9,1.5",
+                 prn[0], prn[1], prn[2], prn[3], prn[4], prn[5], prn[6], prn[7]);
+        for (i = 0; i < 3; i++) {
+            char  sv[64] = "";
+            for (j = 4 * i; j < 4 * i + 4; j++)
+                snprintf(sv + strlen(sv), sizeof(sv) - strlen(sv), ",%02d,%02d,%03d,%02d",
+                         prn[j], 10 + 6 * j, 30 * j, 30 + j);
+            sim_nmea(&recs[n++], "GPGSV,3,%d,12%s", i + 1, sv);
+        }
+        sim_nmea(&recs[n++], "GPGLL,%.5f,N,%011.5f,E,%s,A,A", lat, lon, t);
+    }
+
+    // drop what CFG-MSG turned off, or asked for less often
+    for (i = j = 0; i < n; i++) {
+        int  rate = 1;
+
+        if (recs[i].data[0] == '$') {
+            int  id  = NMEA_ID(recs[i].data[3], recs[i].data[4], recs[i].data[5]);
+            int  msg;
+
+            for (msg = 0; msg < (int)(sizeof(gps_dev_nmea_msgs) / sizeof(gps_dev_nmea_msgs[0])); msg++)
+                if (gps_dev_nmea_msgs[msg].nmea == id)
+                    rate = s->nmea_rate[ gps_dev_nmea_msgs[msg].id ];
+        } else if (recs[i].data[3] == UBX_NAV_SAT) {
+            rate = s->sat_rate;
+        }
+        if (rate == 0 || k % rate != 0)
+            continue;
+        if (j != i)
+            recs[j] = recs[i];
+        j++;
+    }
+    n = j;
+
+    for (i = 0; i < n; i++)
+        recs[i].tod = tod;
+    return n;
+}
+
+
+/* time of day (ms) carried by a recorded NMEA time sentence or NAV-PVT */
+static int
+sim_record_time( const unsigned char*  p, int  size )
+{
+    if (p[0] == UBX_SYNC_CHAR1) {
+        const UbxNavPvt*  pvt = (const UbxNavPvt*)(p + UBX_HEADER_SIZE);
+
+        if (p[2] != UBX_CLASS_NAV || p[3] != UBX_NAV_PVT ||
+            size < UBX_HEADER_SIZE + (int) sizeof(*pvt))
+            return -1;
+        return ((pvt->hour * 60 + pvt->min) * 60 + pvt->sec) * 1000 + pvt->nano / 1000000;
+    }
+
+    if (size > 14 && p[0] == '$' && p[6] == ',' &&
+        (!memcmp(p + 3, "RMC", 3) || !memcmp(p + 3, "GGA", 3)))
+        return str2tod((const char*) p + 7, (const char*) memchr(p + 7, ',', size - 7));
+
+    return -1;
+}
+
+
+/* next epoch of the recorded log, grouped on the time of its fixes */
+static int
+sim_read_epoch( SimState*  s, SimRecord*  recs, int  max )
+{
+    int  n = 0, tod = -1;
+
+    while (s->log_pos < s->log_size && n < max) {
+        const unsigned char*  p    = s->log + s->log_pos;
+        size_t                left = s->log_size - s->log_pos;
+        int                   size, t;
+
+        if (left > UBX_HEADER_SIZE + 2 && p[0] == UBX_SYNC_CHAR1 && p[1] == UBX_SYNC_CHAR2) {
+            size = UBX_HEADER_SIZE + (p[4] | p[5] << 8) + 2;
+        } else {
+            const unsigned char*  nl = memchr(p, '\n', left);
+            size = nl ? (int)(nl - p) + 1 : (int) left;
+        }
+        if (size > (int) left || size > SIM_MAX_RECORD)
+            size = (left < SIM_MAX_RECORD) ? (int) left : SIM_MAX_RECORD;
+
+        t = sim_record_time(p, size);
+        if (t >= 0 && tod >= 0 && t != tod)
+            break;
+        if (t >= 0)
+            tod = t;
+
+        memcpy(recs[n].data, p, size);
+        recs[n].size = size;
+        s->log_pos  += size;
+        n++;
+    }
+
+    for (int i = 0; i < n; i++)
+        recs[i].tod = tod;
+    return n;
+}
+
+
+/* handle the UBX messages sent by the HAL */
+static void
+sim_poll_input( SimState*  s, int  timeout_ms )
+{
+    struct pollfd  pfd = { s->fd, POLLIN, 0 };
+    int            ret;
+
+    while (poll(&pfd, 1, timeout_ms) > 0 && (pfd.revents & POLLIN)) {
+        ret = read(s->fd, s->in + s->in_len, sizeof(s->in) - s->in_len);
+        if (ret <= 0)
+            return;
+        s->in_len += ret;
+        timeout_ms = 0;
+
+        for (;;) {
+            unsigned char*  p = memchr(s->in, UBX_SYNC_CHAR1, s->in_len);
+            unsigned char   ck_a, ck_b, ack[2];
+            int             len, size;
+
+            if (p == NULL) {
+                s->in_len = 0;
+                break;
+            }
+            s->in_len -= p - s->in;
+            memmove(s->in, p, s->in_len);
+            if (s->in_len < UBX_HEADER_SIZE)
+                break;
+
+            len  = s->in[4] | s->in[5] << 8;
+            size = UBX_HEADER_SIZE + len + 2;
+            if (s->in[1] != UBX_SYNC_CHAR2 || size > (int) sizeof(s->in)) {
+                memmove(s->in, s->in + 1, --s->in_len);
+                continue;
+            }
+            if (s->in_len < size)
+                break;
+
+            gps_dev_calc_ubx_csum(s->in + 2, len + 4, &ck_a, &ck_b);
+            if (ck_a == s->in[size - 2] && ck_b == s->in[size - 1] && s->in[2] == UBX_CLASS_CFG &&
+                s->cfg_loss && (int)(rand_r(&s->seed) % 1000) < s->cfg_loss) {
+                // neither applied nor answered
+                s->cfg_lost++;
+            } else if (ck_a == s->in[size - 2] && ck_b == s->in[size - 1] && s->in[2] == UBX_CLASS_CFG) {
+                SimRecord  rec;
+
+                if (s->in[3] == UBX_CFG_RATE && len >= 6) {
+                    s->period   = s->in[6] | s->in[7] << 8;
+                    s->nav_rate = s->in[8] | s->in[9] << 8;
+                    if (s->nav_rate < 1)
+                        s->nav_rate = 1;
+                    s->cfg_rate++;
+                } else {
+                    if (s->in[3] == UBX_CFG_MSG && len >= 3) {
+                        if (s->in[6] == 0xF0 && s->in[7] < sizeof(s->nmea_rate))
+                            s->nmea_rate[s->in[7]] = s->in[8];
+                        else if (s->in[6] == UBX_CLASS_NAV && s->in[7] == UBX_NAV_SAT)
+                            s->sat_rate = s->in[8];
+                    }
+                    s->cfg_other++;
+                }
+                ack[0] = s->in[2];
+                ack[1] = s->in[3];
+                sim_ubx(&rec, UBX_CLASS_ACK, UBX_ACK_ACK, ack, sizeof(ack));
+                write(s->fd, rec.data, rec.size);
+            } else if (ck_a == s->in[size - 2] && ck_b == s->in[size - 1] &&
+                       s->in[2] == UBX_CLASS_MGA && s->in[3] == UBX_MGA_INI && len >= 1) {
+                if (s->in[6] == 0x10 && len == 24)
+                    s->mga_time++;
+                else if (s->in[6] == 0x01 && len == 20)
+                    s->mga_pos++;
+            } else if (ck_a == s->in[size - 2] && ck_b == s->in[size - 1] &&
+                       s->in[2] == UBX_CLASS_MGA && s->in[3] == UBX_MGA_DBD) {
+                if (len == 0) {
+                    // dump the database: made up entries of various sizes
+                    unsigned char  entry[ 12 + 160 ];
+                    SimRecord      rec;
+                    int            i;
+
+                    for (i = 0; i < SIM_DBD_ENTRIES; i++) {
+                        int  n = 12 + 16 * (1 + i % 10);
+
+                        memset(entry, i, n);
+                        sim_ubx(&rec, UBX_CLASS_MGA, UBX_MGA_DBD, entry, n);
+                        write(s->fd, rec.data, rec.size);
+                    }
+                    s->dbd_polls++;
+                } else {
+                    s->dbd_restored++;
+                }
+            }
+
+            s->in_len -= size;
+            memmove(s->in, s->in + size, s->in_len);
+        }
+    }
+}
+
+
+/* write one record as the UART would deliver it */
+static void
+sim_write( SimState*  s, SimRecord*  rec )
+{
+    int  off = 0;
+
+    if (s->noise && (int)(rand_r(&s->seed) % 1000) < s->noise) {
+        if (rand_r(&s->seed) & 1) {
+            rec->data[rand_r(&s->seed) % rec->size] ^= 0x20;
+        } else {
+            static const char  junk[] = "\x13\xff\x00$GP*zz\r\n";
+            write(s->fd, junk, sizeof(junk) - 1);
+        }
+        s->corrupted++;
+    }
+
+    while (off < rec->size) {
+        int  n = rec->size - off;
+
+        if (s->partial && n > 1)
+            n = 1 + rand_r(&s->seed) % n;
+
+        if (s->baud) {
+            int64_t  now = sim_now();
+            if (s->line_free < now)
+                s->line_free = now;
+            s->line_free += n * 10 * 1000000000LL / s->baud;
+            sim_sleep_until(s->line_free);
+        } else if (s->partial && off) {
+            usleep(rand_r(&s->seed) % 200);
+        }
+
+        s->last_write = sim_now();
+        n = write(s->fd, rec->data + off, n);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return;
+        }
+        off      += n;
+        s->bytes += n;
+    }
+}
+
+
+static void*
+sim_thread( void*  arg )
+{
+    SimState*   s = arg;
+    SimRecord*  recs = malloc(64 * sizeof(SimRecord));
+    int64_t     next = sim_now();
+    int         tod = 12 * 3600000;
+    int         k;
+
+    for (k = 0; k < s->epochs; k++) {
+        int  n, i;
+
+        sim_poll_input(s, 0);
+        n = s->log ? sim_read_epoch(s, recs, 64) : sim_make_epoch(s, k, tod, recs);
+        if (n == 0)
+            break;
+
+        for (i = 0; i < n - 1; i++) {
+            sim_write(s, &recs[i]);
+            sim_poll_input(s, 0);
+        }
+
+        // the fix may be delivered before write() returns: hold it back
+        // until the epoch is recorded
+        pthread_mutex_lock(&s->lock);
+        sim_write(s, &recs[n - 1]);
+        s->history[s->written % SIM_HISTORY].tod     = recs[n - 1].tod;
+        s->history[s->written % SIM_HISTORY].written = s->last_write;
+        s->written++;
+        pthread_mutex_unlock(&s->lock);
+
+        if (k == s->hangup) {
+            D("simulator hanging up after epoch %d", k);
+            close(s->fd);
+            s->fd = -1;
+            break;
+        }
+
+        tod   = (tod + s->period * s->nav_rate) % 86400000;
+        next += s->period * s->nav_rate * 1000000LL;
+        while (sim_now() < next)
+            sim_poll_input(s, (int)((next - sim_now()) / 1000000) + 1);
+    }
+
+    free(recs);
+    return NULL;
+}
+
+
+/*****************************************************************/
+/*****************************************************************/
+/*****                                                       *****/
+/*****       H A L   C L I E N T                             *****/
+/*****                                                       *****/
+/*****************************************************************/
+/*****************************************************************/
+
+static void
+sim_location_cb( GpsLocation*  location )
+{
+    SimState*  s   = _sim;
+    int64_t    now = sim_now();
+    int        tod = (int)(location->timestamp % 86400000);
+    int        i;
+
+    pthread_mutex_lock(&s->lock);
+    if (s->first_fix == 0)
+        s->first_fix = now;
+    for (i = s->written - 1; i >= 0 && i >= s->written - SIM_HISTORY; i--) {
+        if (s->history[i % SIM_HISTORY].tod == tod) {
+            s->latency[s->fixes++] = now - s->history[i % SIM_HISTORY].written;
+            break;
+        }
+    }
+    if (i < 0 || i < s->written - SIM_HISTORY)
+        s->unmatched++;
+    pthread_mutex_unlock(&s->lock);
+}
+
+static void
+sim_status_cb( GpsStatus*  status )
+{
+    D("status %d", status->status);
+    if (status->status == GPS_STATUS_ENGINE_ON)
+        _sim->engine_on = sim_now();
+}
+
+static void
+sim_sv_status_cb( GpsSvStatus*  sv_info )
+{
+}
+
+static void
+sim_nmea_cb( GpsUtcTime  timestamp, const char*  nmea, int  length )
+{
+}
+
+static void
+sim_set_capabilities_cb( uint32_t  capabilities )
+{
+}
+
+static void
+sim_wakelock_cb( void )
+{
+}
+
+/* the HAL threads do not return a value, pthread ones do */
+typedef struct {
+    void   (*start)(void*);
+    void*  arg;
+} SimThread;
+
+static void*
+sim_thread_start( void*  opaque )
+{
+    SimThread  t = *(SimThread*) opaque;
+
+    free(opaque);
+    t.start(t.arg);
+    return NULL;
+}
+
+static pthread_t
+sim_create_thread_cb( const char*  name, void (*start)(void*), void*  arg )
+{
+    pthread_t   thread;
+    SimThread*  t = malloc(sizeof(*t));
+
+    if (t == NULL)
+        return 0;
+    t->start = start;
+    t->arg   = arg;
+    if (pthread_create(&thread, NULL, sim_thread_start, t) != 0) {
+        free(t);
+        return 0;
+    }
+    return thread;
+}
+
+static GpsCallbacks  sim_callbacks = {
+    .size                = sizeof(GpsCallbacks),
+    .location_cb         = sim_location_cb,
+    .status_cb           = sim_status_cb,
+    .sv_status_cb        = sim_sv_status_cb,
+    .nmea_cb             = sim_nmea_cb,
+    .set_capabilities_cb = sim_set_capabilities_cb,
+    .acquire_wakelock_cb = sim_wakelock_cb,
+    .release_wakelock_cb = sim_wakelock_cb,
+    .create_thread_cb    = sim_create_thread_cb,
+};
+
+
+static int
+sim_compare( const void*  a, const void*  b )
+{
+    int64_t  x = *(const int64_t*) a, y = *(const int64_t*) b;
+    return (x > y) - (x < y);
+}
+
+
+static void
+sim_report( SimState*  s )
+{
+    static const double  pct[] = { 50, 90, 99, 99.9 };
+    int64_t              sum = 0;
+    int                  i;
+
+    printf("epochs %d, fixes %d, unmatched %d, corrupted records %d, %lld bytes\n",
+           s->written, s->fixes, s->unmatched, s->corrupted, s->bytes);
+    printf("CFG-RATE %d (period %d ms, navRate %d), other CFG %d, lost CFG %d\n",
+           s->cfg_rate, s->period, s->nav_rate, s->cfg_other, s->cfg_lost);
+    printf("MGA-INI time %d, position %d, MGA-DBD polls %d, restored %d",
+           s->mga_time, s->mga_pos, s->dbd_polls, s->dbd_restored);
+    if (s->first_fix)
+        printf(", first fix %.1f ms after start()", (s->first_fix - s->started) / 1e6);
+    printf("\n");
+    printf("init() returned in %.1f ms, engine on after %.1f ms\n",
+           (s->init_done - s->init) / 1e6, s->engine_on ? (s->engine_on - s->init) / 1e6 : -1.0);
+
+    if (s->fixes == 0)
+        return;
+
+    qsort(s->latency, s->fixes, sizeof(int64_t), sim_compare);
+    for (i = 0; i < s->fixes; i++)
+        sum += s->latency[i];
+
+    printf("latency (us): min %.1f", s->latency[0] / 1e3);
+    for (i = 0; i < (int)(sizeof(pct) / sizeof(pct[0])); i++)
+        printf(", p%g %.1f", pct[i], s->latency[(int)((s->fixes - 1) * pct[i] / 100)] / 1e3);
+    printf(", max %.1f, mean %.1f\n", s->latency[s->fixes - 1] / 1e3, sum / 1e3 / s->fixes);
+}
+
+
+static void
+sim_usage( const char*  name )
+{
+    fprintf(stderr, "usage: %s [-u] [-f log] [-n epochs] [-r rate_ms] [-i interval_ms] [-b baud]\n"
+                    "          [-e end] [-N noise] [-A loss] [-a] [-d file] [-p] [-H epoch] [-s seed]\n", name);
+    exit(1);
+}
+
+
+int
+main( int  argc, char**  argv )
+{
+    SimState*              s = _sim;
+    struct hw_device_t*    device;
+    const GpsInterface*    gps;
+    const char*            rate = "1000";
+    const char*            end  = NULL;
+    const char*            log  = NULL;
+    const char*            dbd  = "off";
+    pthread_t              thread;
+    int                    interval = 0;
+    int                    aid = 0;
+    int                    opt;
+
+    memset(s, 0, sizeof(*s));
+    pthread_mutex_init(&s->lock, NULL);
+    s->epochs = 100;
+    s->baud   = 115200;
+    s->hangup = -1;
+    s->period   = 1000;
+    s->nav_rate = 1;
+    s->sat_rate = 1;
+    memset(s->nmea_rate, 1, sizeof(s->nmea_rate));
+    s->seed   = 1;
+
+    while ((opt = getopt(argc, argv, "uf:n:r:i:b:e:N:A:ad:pH:s:")) != -1) {
+        switch (opt) {
+        case 'u': s->ubx     = 1; break;
+        case 'f': log        = optarg; break;
+        case 'n': s->epochs  = atoi(optarg); break;
+        case 'r': rate       = optarg; break;
+        case 'i': interval   = atoi(optarg); break;
+        case 'b': s->baud    = strtoul(optarg, NULL, 10); break;
+        case 'e': end        = optarg; break;
+        case 'N': s->noise   = atoi(optarg); break;
+        case 'A': s->cfg_loss = atoi(optarg); break;
+        case 'a': aid        = 1; break;
+        case 'd': dbd        = optarg; break;
+        case 'p': s->partial = 1; break;
+        case 'H': s->hangup  = atoi(optarg); break;
+        case 's': s->seed    = strtoul(optarg, NULL, 10); break;
+        default:  sim_usage(argv[0]);
+        }
+    }
+    if (optind != argc || s->epochs <= 0)
+        sim_usage(argv[0]);
+
+    if (log) {
+        FILE*  f = fopen(log, "rb");
+        if (f == NULL) {
+            perror(log);
+            return 1;
+        }
+        fseek(f, 0, SEEK_END);
+        s->log_size = ftell(f);
+        fseek(f, 0, SEEK_SET);
+        s->log = malloc(s->log_size + 1);
+        s->log_size = fread(s->log, 1, s->log_size, f);
+        fclose(f);
+    }
+    s->latency = calloc(s->epochs, sizeof(int64_t));
+
+    // the receiver side of the line
+    s->fd = posix_openpt(O_RDWR | O_NOCTTY);
+    if (s->fd < 0 || grantpt(s->fd) < 0 || unlockpt(s->fd) < 0) {
+        perror("posix_openpt");
+        return 1;
+    }
+
+    // properties are read from the environment by the host headers
+    setenv("ro_kernel_android_gps", ptsname(s->fd) + strlen("/dev/"), 1);
+    setenv("ro_kernel_android_gps_max_rate", rate, 1);
+    if (s->ubx)
+        setenv("ro_kernel_android_gps_protocol", "ubx", 1);
+    setenv("ro_kernel_android_gps_dbd_file", dbd, 1);
+    if (end)
+        setenv("ro_kernel_android_gps_epoch_end", end, 1);
+
+    HAL_MODULE_INFO_SYM.methods->open(&HAL_MODULE_INFO_SYM, GPS_HARDWARE_MODULE_ID, &device);
+    gps = ((struct gps_device_t*) device)->get_gps_interface((struct gps_device_t*) device);
+
+    s->init = sim_now();
+    if (gps->init(&sim_callbacks) < 0) {
+        fprintf(stderr, "HAL init failed\n");
+        return 1;
+    }
+    s->init_done = sim_now();
+    gps->set_position_mode(GPS_POSITION_MODE_STANDALONE, GPS_POSITION_RECURRENCE_PERIODIC,
+                           interval, 0, 0);
+    if (aid) {
+        gps->inject_time(gps_clock_ns(CLOCK_REALTIME) / 1000000, gps_clock_ns(CLOCK_BOOTTIME) / 1000000, 100);
+        gps->inject_location(48.1173, 11.5167, 3000);
+    }
+    s->started = sim_now();
+    gps->start();
+
+    // let the HAL configure the receiver before streaming
+    sim_poll_input(s, 100);
+
+    pthread_create(&thread, NULL, sim_thread, s);
+    pthread_join(thread, NULL);
+
+    // wait for the last fix to be delivered
+    usleep(100000);
+
+    gps->stop();
+
+    // answer the navigation database poll of the end of the session
+    sim_poll_input(s, 200);
+    gps->cleanup();
+
+    sim_report(s);
+    return 0;
+}
@@ -0,0 +1,22 @@
+/*
+ * Minimal host stand-in for <cutils/log.h>: log lines go to stderr.
+ */
+#ifndef HOST_STUB_CUTILS_LOG_H
+#define HOST_STUB_CUTILS_LOG_H
+
+#include <stdio.h>
+
+#ifndef LOG_TAG
+#define LOG_TAG NULL
+#endif
+
+#define HOST_LOG(level, ...) \
+    ((void)fprintf(stderr, "%s %s: ", level, LOG_TAG), \
+     (void)fprintf(stderr, __VA_ARGS__), (void)fputc('\n', stderr))
+
+#define ALOGD(...)  HOST_LOG("D", __VA_ARGS__)
+#define ALOGI(...)  HOST_LOG("I", __VA_ARGS__)
+#define ALOGW(...)  HOST_LOG("W", __VA_ARGS__)
+#define ALOGE(...)  HOST_LOG("E", __VA_ARGS__)
+
+#endif /* HOST_STUB_CUTILS_LOG_H */
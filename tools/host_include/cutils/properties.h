@@ -0,0 +1,38 @@
+/*
+ * Minimal host stand-in for <cutils/properties.h>.  Properties are read from
+ * the environment, with every '.' in the key replaced by '_', so that
+ * "ro.kernel.android.gps" is looked up as $ro_kernel_android_gps.
+ */
+#ifndef HOST_STUB_CUTILS_PROPERTIES_H
+#define HOST_STUB_CUTILS_PROPERTIES_H
+
+#include <stdlib.h>
+#include <string.h>
+
+#define PROPERTY_KEY_MAX    32
+#define PROPERTY_VALUE_MAX  92
+
+static inline int
+property_get( const char*  key, char*  value, const char*  default_value )
+{
+    char         name[128];
+    const char*  v;
+    size_t       n;
+
+    for (n = 0; key[n] && n < sizeof(name) - 1; n++)
+        name[n] = (key[n] == '.') ? '_' : key[n];
+    name[n] = '\0';
+
+    v = getenv(name);
+    if (v == NULL)
+        v = default_value ? default_value : "";
+
+    n = strlen(v);
+    if (n >= PROPERTY_VALUE_MAX)
+        n = PROPERTY_VALUE_MAX - 1;
+    memcpy(value, v, n);
+    value[n] = '\0';
+    return (int) n;
+}
+
+#endif /* HOST_STUB_CUTILS_PROPERTIES_H */
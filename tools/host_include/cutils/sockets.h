@@ -0,0 +1,14 @@
+/*
+ * Minimal host stand-in for <cutils/sockets.h>.  There is no init to hand
+ * over sockets, so android_get_control_socket() always fails.
+ */
+#ifndef HOST_STUB_CUTILS_SOCKETS_H
+#define HOST_STUB_CUTILS_SOCKETS_H
+
+static inline int
+android_get_control_socket( const char*  name )
+{
+    return -1;
+}
+
+#endif /* HOST_STUB_CUTILS_SOCKETS_H */
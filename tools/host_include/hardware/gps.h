@@ -0,0 +1,184 @@
+/*
+ * Minimal host stand-in for <hardware/gps.h>: the subset of the legacy GPS
+ * HAL interface used by gps.c, with the same layout as libhardware.
+ */
+#ifndef HOST_STUB_HARDWARE_GPS_H
+#define HOST_STUB_HARDWARE_GPS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+#include <hardware/hardware.h>
+
+#define GPS_HARDWARE_MODULE_ID "gps"
+
+typedef int64_t GpsUtcTime;
+
+#define GPS_MAX_SVS 32
+#define GNSS_MAX_SVS 64
+
+typedef uint32_t GpsPositionMode;
+#define GPS_POSITION_MODE_STANDALONE    0
+#define GPS_POSITION_MODE_MS_BASED      1
+#define GPS_POSITION_MODE_MS_ASSISTED   2
+
+typedef uint32_t GpsPositionRecurrence;
+#define GPS_POSITION_RECURRENCE_PERIODIC    0
+#define GPS_POSITION_RECURRENCE_SINGLE      1
+
+typedef uint16_t GpsStatusValue;
+#define GPS_STATUS_NONE             0
+#define GPS_STATUS_SESSION_BEGIN    1
+#define GPS_STATUS_SESSION_END      2
+#define GPS_STATUS_ENGINE_ON        3
+#define GPS_STATUS_ENGINE_OFF       4
+
+typedef uint16_t GpsLocationFlags;
+#define GPS_LOCATION_HAS_LAT_LONG   0x0001
+#define GPS_LOCATION_HAS_ALTITUDE   0x0002
+#define GPS_LOCATION_HAS_SPEED      0x0004
+#define GPS_LOCATION_HAS_BEARING    0x0008
+#define GPS_LOCATION_HAS_ACCURACY   0x0010
+
+#define GPS_CAPABILITY_SCHEDULING       0x0000001
+#define GPS_CAPABILITY_MSB              0x0000002
+#define GPS_CAPABILITY_MSA              0x0000004
+#define GPS_CAPABILITY_SINGLE_SHOT      0x0000008
+#define GPS_CAPABILITY_ON_DEMAND_TIME   0x0000010
+
+typedef uint16_t GpsAidingData;
+#define GPS_DELETE_EPHEMERIS        0x0001
+#define GPS_DELETE_ALMANAC          0x0002
+#define GPS_DELETE_POSITION         0x0004
+#define GPS_DELETE_TIME             0x0008
+#define GPS_DELETE_IONO             0x0010
+#define GPS_DELETE_UTC              0x0020
+#define GPS_DELETE_HEALTH           0x0040
+#define GPS_DELETE_SVDIR            0x0080
+#define GPS_DELETE_SVSTEER          0x0100
+#define GPS_DELETE_SADATA           0x0200
+#define GPS_DELETE_RTI              0x0400
+#define GPS_DELETE_CELLDB_INFO      0x8000
+#define GPS_DELETE_ALL              0xFFFF
+
+typedef uint8_t GnssConstellationType;
+#define GNSS_CONSTELLATION_UNKNOWN      0
+#define GNSS_CONSTELLATION_GPS          1
+#define GNSS_CONSTELLATION_SBAS         2
+#define GNSS_CONSTELLATION_GLONASS      3
+#define GNSS_CONSTELLATION_QZSS         4
+#define GNSS_CONSTELLATION_BEIDOU       5
+#define GNSS_CONSTELLATION_GALILEO      6
+
+typedef uint8_t GnssSvFlags;
+#define GNSS_SV_FLAGS_NONE                  0
+#define GNSS_SV_FLAGS_HAS_EPHEMERIS_DATA    (1 << 0)
+#define GNSS_SV_FLAGS_HAS_ALMANAC_DATA      (1 << 1)
+#define GNSS_SV_FLAGS_USED_IN_FIX           (1 << 2)
+
+typedef struct {
+    size_t          size;
+    uint16_t        flags;
+    double          latitude;
+    double          longitude;
+    double          altitude;
+    float           speed;
+    float           bearing;
+    float           accuracy;
+    GpsUtcTime      timestamp;
+} GpsLocation;
+
+typedef struct {
+    size_t          size;
+    GpsStatusValue  status;
+} GpsStatus;
+
+typedef struct {
+    size_t  size;
+    int     prn;
+    float   snr;
+    float   elevation;
+    float   azimuth;
+} GpsSvInfo;
+
+typedef struct {
+    size_t      size;
+    int         num_svs;
+    GpsSvInfo   sv_list[GPS_MAX_SVS];
+    uint32_t    ephemeris_mask;
+    uint32_t    almanac_mask;
+    uint32_t    used_in_fix_mask;
+} GpsSvStatus;
+
+typedef struct {
+    size_t                  size;
+    int16_t                 svid;
+    GnssConstellationType   constellation;
+    float                   c_n0_dbhz;
+    float                   elevation;
+    float                   azimuth;
+    GnssSvFlags             flags;
+} GnssSvInfo;
+
+typedef struct {
+    size_t      size;
+    int         num_svs;
+    GnssSvInfo  gnss_sv_list[GNSS_MAX_SVS];
+} GnssSvStatus;
+
+typedef struct {
+    size_t      size;
+    uint16_t    year_of_hw;
+} GnssSystemInfo;
+
+typedef void (* gps_location_callback)(GpsLocation* location);
+typedef void (* gps_status_callback)(GpsStatus* status);
+typedef void (* gps_sv_status_callback)(GpsSvStatus* sv_info);
+typedef void (* gnss_sv_status_callback)(GnssSvStatus* sv_info);
+typedef void (* gps_nmea_callback)(GpsUtcTime timestamp, const char* nmea, int length);
+typedef void (* gps_set_capabilities)(uint32_t capabilities);
+typedef void (* gps_acquire_wakelock)();
+typedef void (* gps_release_wakelock)();
+typedef void (* gps_request_utc_time)();
+typedef void (* gnss_set_system_info)(const GnssSystemInfo* info);
+typedef pthread_t (* gps_create_thread)(const char* name, void (*start)(void *), void* arg);
+
+typedef struct {
+    size_t      size;
+    gps_location_callback location_cb;
+    gps_status_callback status_cb;
+    gps_sv_status_callback sv_status_cb;
+    gps_nmea_callback nmea_cb;
+    gps_set_capabilities set_capabilities_cb;
+    gps_acquire_wakelock acquire_wakelock_cb;
+    gps_release_wakelock release_wakelock_cb;
+    gps_create_thread create_thread_cb;
+    gps_request_utc_time request_utc_time_cb;
+    gnss_set_system_info set_system_info_cb;
+    gnss_sv_status_callback gnss_sv_status_cb;
+} GpsCallbacks;
+
+typedef struct {
+    size_t          size;
+    int   (*init)( GpsCallbacks* callbacks );
+    int   (*start)( void );
+    int   (*stop)( void );
+    void  (*cleanup)( void );
+    int   (*inject_time)(GpsUtcTime time, int64_t timeReference,
+                         int uncertainty);
+    int  (*inject_location)(double latitude, double longitude, float accuracy);
+    void  (*delete_aiding_data)(GpsAidingData flags);
+    int   (*set_position_mode)(GpsPositionMode mode, GpsPositionRecurrence recurrence,
+            uint32_t min_interval, uint32_t preferred_accuracy, uint32_t preferred_time);
+    const void* (*get_extension)(const char* name);
+} GpsInterface;
+
+struct gps_device_t {
+    struct hw_device_t common;
+    const GpsInterface* (*get_gps_interface)(struct gps_device_t* dev);
+};
+
+#endif /* HOST_STUB_HARDWARE_GPS_H */